@@ -1,6 +1,36 @@
 
 #include "fs.h"
 
+// The block cache keeps at most BC_MAXBLOCKS blocks mapped. Once it is
+// full, bc_pgfault makes room for a block by evicting another one, which
+// it picks with the CLOCK algorithm: bc_blocks is a ring of the cached
+// blocks, and the hand passes over, clearing their accessed bit, the blocks
+// that have been accessed since it last came by. Dirty blocks are written
+// back before they are unmapped.
+static uint32_t bc_blocks[BC_MAXBLOCKS];
+static uint32_t bc_nblocks;
+static uint32_t bc_hand;
+
+struct BcStats bc_stats;
+
+// Disk requests in flight: runs of blocks being read, e.g. for read-ahead,
+// and blocks being written back. The pages of blocks being read are mapped
+// but hold nothing yet, and those of blocks being written may not be
+// unmapped or written again, until bc_op_finish; see bc_wait_block.
+#define BC_MAXOPS	16
+
+static struct BcOp {
+	uint32_t blockno;
+	uint32_t n;		// 0 if the slot is free
+	bool write;
+	int req;		// see block_start
+	uint32_t seq;		// the order they were started in
+} bc_ops[BC_MAXOPS];
+static uint32_t bc_seq;
+
+// Whether requests go to the virtio disk rather than the IDE one
+static bool bc_virtio;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -24,16 +54,203 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
-int block_read(uint32_t blockno, void *addr, size_t nbytes) {
-	uint32_t secno = blockno * BLKSECTS + FS_OFFSET;
-	size_t nsecs = ROUNDUP(nbytes, SECTSIZE) / SECTSIZE;
-	return ide_read(secno, addr, nsecs);
+// Set up the disk we keep the file system on: the virtio one if the kernel
+// found it, else the IDE one.
+void
+disk_init(void)
+{
+	if (!(bc_virtio = virtio_blk_init()))
+		ide_init();
 }
 
-int block_write(uint32_t blockno, void *addr, size_t nbytes) {
+// Start a disk request which moves the 'nbytes' at addr to or from the
+// blocks from 'blockno' on. Returns a request number for block_done and
+// block_wait, or < 0 on error. The virtio disk takes many requests at once;
+// the IDE one does one at a time, so there a new request first waits for the
+// one before, whose block_wait then finds nothing left to wait for.
+static int
+block_start(uint32_t blockno, void *addr, size_t nbytes, bool write)
+{
 	uint32_t secno = blockno * BLKSECTS + FS_OFFSET;
 	size_t nsecs = ROUNDUP(nbytes, SECTSIZE) / SECTSIZE;
-	return ide_write(secno, addr, nsecs);
+	int r;
+
+	if (bc_virtio)
+		return virtio_blk_start(secno, addr, nsecs, write);
+
+	if ((r = ide_finish()) < 0)
+		return r;
+	if (write)
+		return ide_write(secno, addr, nsecs);
+	return ide_read_start(secno, addr, nsecs);
+}
+
+// Is disk request 'req' done, so that block_wait won't block?
+static bool
+block_done(int req)
+{
+	return bc_virtio ? virtio_blk_done(req) : ide_done();
+}
+
+// Wait for disk request 'req' to finish. Returns 0 on success, < 0 if it
+// failed.
+static int
+block_wait(int req)
+{
+	return bc_virtio ? virtio_blk_wait(req) : ide_finish();
+}
+
+int block_read(uint32_t blockno, void *addr, size_t nbytes) {
+	int req;
+
+	if ((req = block_start(blockno, addr, nbytes, 0)) < 0)
+		return req;
+	return block_wait(req);
+}
+
+// Wait for the request in flight in op, and free op.
+static void
+bc_op_finish(struct BcOp *op)
+{
+	static struct PageBatch batch;
+	uint32_t i;
+	void *va;
+	int r;
+
+	if (block_wait(op->req))
+		panic(op->write ? "block_write failed" : "block_read failed");
+
+	// reading the blocks through PIO dirtied their pages; clear the dirty
+	// bits with a single system call.
+	if (!op->write) {
+		page_batch_init(&batch, 0);
+		for (i = 0; i < op->n; i++) {
+			va = diskaddr(op->blockno + i);
+			if ((r = page_batch_add(&batch, PGOP_PROTECT, va, va, 
+									PTE_U | PTE_P | PTE_W)))
+				panic("in bc_op_finish, page_batch_add: %e", r);
+		}
+		if ((r = page_batch_flush(&batch)))
+			panic("in bc_op_finish, page_batch_flush: %e", r);
+	}
+	op->n = 0;
+}
+
+// Start reading or writing the 'n' blocks from 'blockno' on, whose pages
+// are mapped, with a single disk request. If all slots are taken, the
+// oldest request is waited for first.
+static void
+bc_op_start(uint32_t blockno, uint32_t n, bool write)
+{
+	struct BcOp *op = NULL;
+	int i;
+
+	for (i = 0; i < BC_MAXOPS && bc_ops[i].n; i++)
+		if (!op || (int32_t) (bc_ops[i].seq - op->seq) < 0)
+			op = &bc_ops[i];
+	if (i < BC_MAXOPS)
+		op = &bc_ops[i];
+	else
+		bc_op_finish(op);
+
+	if ((op->req = block_start(blockno, diskaddr(blockno), n * BLKSIZE, 
+							   write)) < 0)
+		panic(write ? "block_write failed" : "block_read failed");
+	op->blockno = blockno;
+	op->n = n;
+	op->write = write;
+	op->seq = bc_seq++;
+}
+
+// Wait for the requests in flight for block 'blockno', if any, before its
+// contents are used, or its page is unmapped or written out again.
+void
+bc_wait_block(uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < BC_MAXOPS; i++)
+		if (bc_ops[i].n && blockno >= bc_ops[i].blockno && 
+			blockno < bc_ops[i].blockno + bc_ops[i].n)
+			bc_op_finish(&bc_ops[i]);
+}
+
+// Finish the requests the disk is done with; this doesn't block. The file
+// server calls this when the disk interrupts it.
+void
+bc_poll(void)
+{
+	int i;
+
+	for (i = 0; i < BC_MAXOPS; i++)
+		if (bc_ops[i].n && block_done(bc_ops[i].req))
+			bc_op_finish(&bc_ops[i]);
+}
+
+// Wait for all requests in flight, e.g. so that the blocks written back so
+// far are on disk.
+void
+bc_sync(void)
+{
+	int i;
+
+	for (i = 0; i < BC_MAXOPS; i++)
+		if (bc_ops[i].n)
+			bc_op_finish(&bc_ops[i]);
+}
+
+// The super block and the bitmap stay cached, since bc_pgfault itself
+// reads them.
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return blockno < 2 || (super && blockno < 2 + 
+		(super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
+}
+
+// Return a free slot in bc_blocks, evicting a block if the cache is full.
+static uint32_t
+bc_make_room(void)
+{
+	uint32_t slot, blockno;
+	void *va;
+	int r;
+
+	if (bc_nblocks < BC_MAXBLOCKS)
+		return bc_nblocks++;
+
+	while (1) {
+		slot = bc_hand;
+		bc_hand = (bc_hand + 1) % BC_MAXBLOCKS;
+		blockno = bc_blocks[slot];
+		va = (void *) (DISKMAP + blockno * BLKSIZE);
+
+		// someone else unmapped the block already (see check_bc)
+		if (!va_is_mapped(va))
+			return slot;
+		if (bc_pinned(blockno))
+			continue;
+
+		// used since we last came by, so give it another round. Mapping
+		// the page again clears the accessed bit, but the dirty bit as
+		// well, which is why dirty blocks get written back now.
+		if (uvpt[PGNUM(va)] & PTE_A) {
+			if (va_is_dirty(va))
+				flush_block(va);
+			else if ((r = sys_page_map(0, va, 0, va, 
+						uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("in bc_make_room, sys_page_map: %e", r);
+			continue;
+		}
+
+		// the disk may still be using the page.
+		flush_block(va);
+		bc_wait_block(blockno);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("in bc_make_room, sys_page_unmap: %e", r);
+		bc_stats.bs_evictions++;
+		return slot;
+	}
 }
 
 // Fault any disk block that is read in to memory by
@@ -54,8 +271,10 @@ bc_pgfault(struct UTrapframe *utf)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
-	// Allocate a page in the disk map region, 
+	// Allocate a page in the disk map region, after making room for it
 	addr = ROUNDDOWN(addr, PGSIZE);
+	bc_blocks[bc_make_room()] = blockno;
+	bc_stats.bs_misses++;
 	if ((r = sys_page_alloc(0, addr, PTE_U | PTE_P | PTE_W)))
 		panic("allocation failed (%e)", r);
 
@@ -75,8 +294,62 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
-// Flush the contents of the block containing VA out to disk if
-// necessary, then clear the PTE_D bit using sys_page_map.
+// Most blocks a single disk request fetches
+#define BC_MAXRUN	(256 / BLKSECTS)
+
+// Start reading the 'n' blocks from 'blockno' on, none of which are cached,
+// with a single disk request, which may still be in flight when we return.
+static void
+bc_read_run(uint32_t blockno, uint32_t n)
+{
+	uint32_t i;
+	int r;
+
+	assert(n <= BC_MAXRUN);
+
+	for (i = 0; i < n; i++) {
+		bc_blocks[bc_make_room()] = blockno + i;
+		if ((r = sys_page_alloc(0, diskaddr(blockno + i), 
+								PTE_U | PTE_P | PTE_W)))
+			panic("allocation failed (%e)", r);
+	}
+
+	// the pages lie next to each other, just like the blocks.
+	bc_op_start(blockno, n, 0);
+	bc_stats.bs_readahead += n;
+}
+
+// Read the 'n' blocks from 'blockno' on into the cache before they are
+// used, e.g. for read-ahead. Blocks that are cached already are skipped;
+// the others are read in runs of up to BC_MAXRUN blocks per disk command.
+// The runs may still be in flight when we return; see bc_wait_block.
+// The blocks must be allocated.
+void
+bc_read_blocks(uint32_t blockno, uint32_t n)
+{
+	uint32_t run;
+
+	// don't push out the very blocks we are reading ahead.
+	n = MIN(n, BC_MAXBLOCKS / 4);
+
+	while (n > 0) {
+		if (va_is_mapped(diskaddr(blockno))) {
+			blockno++;
+			n--;
+			continue;
+		}
+		for (run = 1; run < n && run < BC_MAXRUN && 
+			 !va_is_mapped(diskaddr(blockno + run)); run++)
+			;
+		bc_read_run(blockno, run);
+		blockno += run;
+		n -= run;
+	}
+}
+
+// Start flushing the contents of the block containing VA out to disk if
+// necessary, then clear the PTE_D bit using sys_page_map. The write may
+// still be in flight when we return; see bc_sync.
 void
 flush_block(void *addr)
 {
@@ -92,9 +365,11 @@ flush_block(void *addr)
 		return;
 	
 	// If the block is in the cache and is dirty, flush the block out to the
-	// disk
-	if (block_write(blockno, addr, BLKSIZE))
-		panic("block_write failed");
+	// disk, after any earlier write of it, since the disk may reorder
+	// requests.
+	bc_wait_block(blockno);
+	bc_op_start(blockno, 1, 1);
+	bc_stats.bs_writebacks++;
 	
 	// clear the PTE_D bit
 	if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
@@ -118,6 +393,7 @@ check_bc(void)
 	assert(!va_is_dirty(diskaddr(1)));
 
 	// clear it out
+	bc_sync();
 	sys_page_unmap(0, diskaddr(1));
 	assert(!va_is_mapped(diskaddr(1)));
 
@@ -127,6 +403,45 @@ check_bc(void)
 	// fix it
 	memmove(diskaddr(1), &backup, sizeof backup);
 	flush_block(diskaddr(1));
+	bc_sync();
+}
+
+// Write back all dirty blocks, and drop every block that isn't pinned, as
+// if the file system had just been mounted: their next use reads them from
+// the disk again.
+void
+bc_drop(void)
+{
+	uint32_t i, n, blockno;
+	void *va;
+	int r;
+
+	for (i = n = 0; i < bc_nblocks; i++) {
+		blockno = bc_blocks[i];
+		va = diskaddr(blockno);
+		if (!va_is_mapped(va))
+			continue;
+		flush_block(va);
+		if (bc_pinned(blockno)) {
+			bc_blocks[n++] = blockno;
+			continue;
+		}
+		bc_wait_block(blockno);
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("in bc_drop, sys_page_unmap: %e", r);
+	}
+	bc_nblocks = n;
+	bc_hand = 0;
+	bc_sync();
+}
+
+// Fill in 'stats' with the counters of the block cache.
+void
+bc_get_stats(struct BcStats *stats)
+{
+	*stats = bc_stats;
+	stats->bs_nblocks = bc_nblocks;
+	stats->bs_maxblocks = BC_MAXBLOCKS;
 }
 
 void
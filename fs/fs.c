@@ -197,11 +197,41 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 		*blockptr = r;
 	}
 
-	// now the block is guaranteed to exist, so return it
+	// now the block is guaranteed to exist, so return it once it has
+	// arrived from the disk
+	bc_wait_block(*blockptr);
 	*blk = diskaddr(*blockptr);
+	if (va_is_mapped(*blk))
+		bc_stats.bs_hits++;
 	return 0;
 }
 
+// Read the blocks 'filebno' up to 'filebno' + 'n' of f into the block
+// cache ahead of their use, as far as they exist. Runs of them that lie
+// next to each other on disk are read with as few disk commands as
+// possible; see bc_read_blocks.
+void
+file_readahead(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t *ptr, start = 0, len = 0, end;
+
+	end = MIN(filebno + n, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	for (; filebno < end; filebno++) {
+		if (file_block_walk(f, filebno, &ptr, 0) < 0 || !*ptr)
+			break;
+		if (len && *ptr == start + len) {
+			len++;
+			continue;
+		}
+		if (len)
+			bc_read_blocks(start, len);
+		start = *ptr;
+		len = 1;
+	}
+	if (len)
+		bc_read_blocks(start, len);
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -491,6 +521,7 @@ file_flush(struct File *f)
 	flush_block(f);
 	if (f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	bc_sync();
 }
 
 
@@ -501,5 +532,6 @@ fs_sync(void)
 	int i;
 	for (i = 1; i < super->s_nblocks; i++)
 		flush_block(diskaddr(i));
+	bc_sync();
 }
 
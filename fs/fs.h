@@ -11,6 +11,9 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Most blocks the block cache keeps in memory at once (1MB) */
+#define BC_MAXBLOCKS	256
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
@@ -20,18 +23,38 @@ void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+int	ide_read_start(uint32_t secno, void *dst, size_t nsecs);
+bool	ide_done(void);
+int	ide_finish(void);
 void ide_init();
 
+/* virtio_blk.c */
+bool	virtio_blk_init(void);
+int	virtio_blk_start(uint32_t secno, const void *va, size_t nsecs, 
+			 bool write);
+bool	virtio_blk_done(int req);
+int	virtio_blk_wait(int req);
+
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
 void	bc_init(void);
+void	bc_read_blocks(uint32_t blockno, uint32_t n);
+void	bc_poll(void);
+void	bc_wait_block(uint32_t blockno);
+void	bc_sync(void);
+void	bc_drop(void);
+void	disk_init(void);
+void	bc_get_stats(struct BcStats *stats);
+
+extern struct BcStats bc_stats;
 
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+void	file_readahead(struct File *f, uint32_t file_blockno, uint32_t n);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code. Transfers go through the PIIX bus-master DMA
+ * engine if the controller has one, and we block until the disk interrupts
+ * us; otherwise we fall back to polled PIO.
  */
 
 #include "fs.h"
@@ -10,17 +12,77 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_WRITE		0x30
+#define IDE_CMD_READ_DMA	0xC8
+#define IDE_CMD_WRITE_DMA	0xCA
+
+// Bus-master registers, relative to bm_base
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4
+
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08	// the controller writes to memory
+
+#define BM_STATUS_ACTIVE	0x01
+#define BM_STATUS_ERR		0x02
+#define BM_STATUS_IRQ		0x04	// the drive is done; write 1 to clear
+
+// A physical region descriptor: one piece of memory of a DMA transfer. The
+// controller walks a table of these until it reaches one marked PRD_EOT. A
+// piece may not cross a 64KB boundary, which one within a page never does.
+struct Prd {
+	uint32_t prd_addr;
+	uint32_t prd_count;	// bytes, in the low 16 bits
+};
+
+#define PRD_EOT		0x80000000
+
+// Where the PRD table is mapped, just below fsreq
+#define PRDTMAP		0x0fffe000
+
+// A transfer of 256 sectors spans at most this many pages
+#define IDE_MAXPAGES	(256 * SECTSIZE / PGSIZE + 1)
+
 static int diskno = 1;
 
 static uint32_t io_base;
+static uint32_t bm_base;
+
+// The notification bit with which the kernel tells us of IDE interrupts
+#define IDE_NOTIFY	0x1
+
+static struct Prd *prdt = (struct Prd *) PRDTMAP;
+static physaddr_t prdt_pa;
+
+static bool dma_busy;		// a DMA transfer is in flight
+static uint8_t dma_dir;		// its BM_CMD direction bit
 
 // prepares for IDE IO by contacting the OS to get the io_base at which to do
-// PIO. The io_base originates from a PCI driver.
+// PIO, and the bm_base at which to do DMA. Both originate from a PCI driver.
+// If the controller can't do DMA we stick to PIO; otherwise the kernel
+// notifies us of the disk's interrupts.
 void ide_init() {
+	int r;
+
 	io_base = sys_get_ide_io_base();
 	if (io_base <= 1) {
 		panic("No IDE disk was registered via PCI! io_base: 0x%x\n", io_base);
 	}
+
+	bm_base = sys_get_ide_bm_base();
+	if ((int) bm_base <= 0) {
+		bm_base = 0;
+		return;
+	}
+
+	// the controller reads the PRD table by physical address.
+	if ((r = sys_dma_alloc(prdt, 1, &prdt_pa)) < 0 || 
+		(r = sys_ide_set_notify(IDE_NOTIFY)) < 0) {
+		cprintf("ide_init: can't do DMA (%e), using PIO\n", r);
+		bm_base = 0;
+	}
 }
 
 static int
@@ -76,21 +138,119 @@ ide_set_disk(int d)
 }
 
 
+// Tell the drive to carry out command 'cmd' on 'nsecs' sectors from 'secno'
+// on.
+static void
+ide_start(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
+	outb(io_base + 2, nsecs);
+	outb(io_base + 3, secno & 0xFF);
+	outb(io_base + 4, (secno >> 8) & 0xFF);
+	outb(io_base + 5, (secno >> 16) & 0xFF);
+	outb(io_base + 6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+	outb(io_base + 7, cmd);
+}
+
+// Start moving 'nsecs' sectors from 'secno' on between the disk and the
+// memory at 'va' using bus-master DMA. The controller copies the data by
+// itself; ide_finish() waits until it is done. Returns -E_INVAL if the
+// memory isn't fit for DMA, in which case nothing happened.
+static int
+ide_dma_start(uint32_t secno, const void *va, size_t nsecs, bool write)
+{
+	static physaddr_t pas[IDE_MAXPAGES];
+	uintptr_t addr = (uintptr_t) va;
+	uintptr_t start = ROUNDDOWN(addr, PGSIZE);
+	size_t len = nsecs * SECTSIZE, n, i;
+	int r;
+
+	assert(!dma_busy);
+
+	// the controller moves 16-bit words.
+	if (addr & 1)
+		return -E_INVAL;
+
+	if ((r = sys_page_phys((void *) start, 
+						   (ROUNDUP(addr + len, PGSIZE) - start) / PGSIZE,
+						   pas)) < 0)
+		return -E_INVAL;
+	
+	// one piece per page, since they needn't be physically contiguous.
+	for (i = 0; len > 0; i++, addr += n, len -= n) {
+		n = MIN(len, PGSIZE - PGOFF(addr));
+		prdt[i].prd_addr = pas[i] + PGOFF(addr);
+		prdt[i].prd_count = n;
+	}
+	prdt[i - 1].prd_count |= PRD_EOT;
+
+	ide_wait_ready(0);
+
+	dma_dir = write ? 0 : BM_CMD_READ;
+	outb(bm_base + BM_CMD, dma_dir);
+	outl(bm_base + BM_PRDT, prdt_pa);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+
+	ide_start(secno, nsecs, write ? IDE_CMD_WRITE_DMA : IDE_CMD_READ_DMA);
+	outb(bm_base + BM_CMD, dma_dir | BM_CMD_START);
+	dma_busy = 1;
+	return 0;
+}
+
+// Has the DMA transfer in flight, if any, come to an end? Then ide_finish()
+// won't block.
+bool
+ide_done(void)
+{
+	return !dma_busy || 
+		(inb(bm_base + BM_STATUS) & (BM_STATUS_IRQ | BM_STATUS_ERR));
+}
+
+// Wait for the DMA transfer in flight, if any, to come to an end. We block
+// until the disk interrupts us (see sys_ide_set_notify), so that other
+// environments run meanwhile. Returns 0 on success, < 0 if the transfer
+// failed.
 int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+ide_finish(void)
+{
+	uint8_t status;
+	int r;
+
+	if (!dma_busy)
+		return 0;
+
+	// an interrupt that came before we wait stays pending, so none gets
+	// lost; one left from an earlier command just makes us look again.
+	while (!((status = inb(bm_base + BM_STATUS)) & 
+			 (BM_STATUS_IRQ | BM_STATUS_ERR)))
+		sys_wait_notify(0);
+
+	outb(bm_base + BM_CMD, dma_dir);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_IRQ);
+	dma_busy = 0;
+
+	// reading the drive's status also acknowledges its interrupt.
+	if ((r = ide_wait_ready(1)) < 0 || (status & BM_STATUS_ERR))
+		return -1;
+
+	return 0;
+}
+
+// Start reading 'nsecs' sectors from 'secno' on into 'dst'. The data is
+// there once ide_finish() returns; we read synchronously if we can't use
+// DMA. No other disk command may be issued until then.
+int
+ide_read_start(uint32_t secno, void *dst, size_t nsecs)
 {
 	int r;
 
 	assert(nsecs <= 256);
 
+	if (bm_base && (r = ide_dma_start(secno, dst, nsecs, 0)) != -E_INVAL)
+		return r;
+
 	ide_wait_ready(0);
 
-	outb(io_base + 2, nsecs);
-	outb(io_base + 3, secno & 0xFF);
-	outb(io_base + 4, (secno >> 8) & 0xFF);
-	outb(io_base + 5, (secno >> 16) & 0xFF);
-	outb(io_base + 6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(io_base + 7, 0x20);	// CMD 0x20 means read sector
+	ide_start(secno, nsecs, IDE_CMD_READ);
 
 	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -101,6 +261,17 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	return 0;
 }
 
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	int r;
+
+	if ((r = ide_read_start(secno, dst, nsecs)) < 0)
+		return r;
+
+	return ide_finish();
+}
+
 int
 ide_write(uint32_t secno, const void *src, size_t nsecs)
 {
@@ -108,14 +279,12 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	assert(nsecs <= 256);
 
+	if (bm_base && (r = ide_dma_start(secno, src, nsecs, 1)) != -E_INVAL)
+		return r < 0 ? r : ide_finish();
+
 	ide_wait_ready(0);
 
-	outb(io_base + 2, nsecs);
-	outb(io_base + 3, secno & 0xFF);
-	outb(io_base + 4, (secno >> 8) & 0xFF);
-	outb(io_base + 5, (secno >> 16) & 0xFF);
-	outb(io_base + 6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(io_base + 7, 0x30);	// CMD 0x30 means write sector
+	ide_start(secno, nsecs, IDE_CMD_WRITE);
 
 	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
 		if ((r = ide_wait_ready(1)) < 0)
@@ -125,4 +294,3 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 
 	return 0;
 }
-
@@ -34,8 +34,27 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+
+	// Read-ahead state; see serve_read
+	off_t o_ra_next;	// where a sequential read would go on
+	uint32_t o_ra_block;	// first block not read ahead yet
+	uint32_t o_ra_window;	// blocks to read ahead; 0 if not sequential
 };
 
+// Read-ahead starts with RA_MINWINDOW blocks once a file is read
+// sequentially, and doubles with each further sequential read up to
+// RA_MAXWINDOW blocks.
+#define RA_MINWINDOW	4
+#define RA_MAXWINDOW	32
+
+// Blocks to read ahead once we have replied to the current request; see
+// serve().
+static struct {
+	struct File *f;
+	uint32_t filebno;
+	uint32_t n;
+} ra_pending;
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
@@ -158,6 +177,9 @@ try_open:
 
 	// Save the file pointer
 	o->o_file = f;
+	o->o_ra_next = 0;
+	o->o_ra_block = 0;
+	o->o_ra_window = 0;
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
@@ -200,6 +222,35 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Note a read of 'nb' bytes at 'offset' from o. If o is read sequentially,
+// the blocks after the ones read are read ahead, in a window that grows
+// while the reads stay sequential.
+static void
+readahead_note(struct OpenFile *o, off_t offset, ssize_t nb)
+{
+	uint32_t next, end;
+
+	if (offset == o->o_ra_next)
+		o->o_ra_window = o->o_ra_window ? 
+			MIN(2 * o->o_ra_window, RA_MAXWINDOW) : RA_MINWINDOW;
+	else
+		o->o_ra_window = o->o_ra_block = 0;
+	o->o_ra_next = offset + nb;
+
+	if (!o->o_ra_window || nb <= 0)
+		return;
+
+	next = MAX(ROUNDUP(offset + nb, BLKSIZE) / BLKSIZE, o->o_ra_block);
+	end = (offset + nb) / BLKSIZE + o->o_ra_window;
+	if (next >= end)
+		return;
+
+	ra_pending.f = o->o_file;
+	ra_pending.filebno = next;
+	ra_pending.n = end - next;
+	o->o_ra_block = end;
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -212,6 +263,7 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	struct Fsret_read *ret = &ipc->readRet;
 	int r;
 	ssize_t nb;
+	off_t offset;
 
 	if (debug)
 		cprintf("serve_read %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
@@ -219,9 +271,12 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 	
-	nb = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset);
-	if (nb >= 0)
+	offset = o->o_fd->fd_offset;
+	nb = file_read(o->o_file, ret->ret_buf, req->req_n, offset);
+	if (nb >= 0) {
 		o->o_fd->fd_offset += nb;
+		readahead_note(o, offset, nb);
+	}
 
 	return nb;
 }
@@ -297,6 +352,20 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+int
+serve_cache_stats(envid_t envid, union Fsipc *req)
+{
+	bc_get_stats(&req->cacheStatsRet);
+	return 0;
+}
+
+int
+serve_drop_cache(envid_t envid, union Fsipc *req)
+{
+	bc_drop();
+	return 0;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -307,19 +376,58 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_CACHE_STATS] =	serve_cache_stats,
+	[FSREQ_DROP_CACHE] =	serve_drop_cache
 };
 
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	envid_t client = 0;
+	int perm, r = 0, rperm = 0;
+	void *pg = NULL;
+
+	// the disk's interrupts end our receives, as messages from envid 0;
+	// see disk_init.
+	sys_bind_notify(1);
 
 	while (1) {
+		// with read-ahead to do, reply on its own first, so that the
+		// client can go on while we read.
+		if (ra_pending.n) {
+			if (client)
+				sys_ipc_try_send(client, r, pg ? pg : (void *) -1, 
+								 pg ? rperm : 0);
+			client = 0;
+			file_readahead(ra_pending.f, ra_pending.filebno, 
+						   ra_pending.n);
+			ra_pending.n = 0;
+		}
+
+		// reply to the last request, if any, and wait for the next one
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		req = ipc_reply_recv(client, r, pg, rperm, (int32_t *) &whom,
+				     fsreq, &perm);
+
+		// the reply couldn't be sent, and nothing was received; the
+		// client is left hanging, and we just receive next time.
+		if (!whom && (int32_t) req < 0) {
+			cprintf("fs: reply to %08x failed: %e\n", client, req);
+			client = 0;
+			continue;
+		}
+		client = 0;
+
+		// the disk is done with some read-ahead or write-back, unless
+		// it's a leftover interrupt; meanwhile we served others from
+		// the cache.
+		if (!whom) {
+			bc_poll();
+			continue;
+		}
+
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
@@ -332,16 +440,17 @@ serve(void)
 		}
 
 		pg = NULL;
+		rperm = 0;
 		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
+			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &rperm);
 		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
 			r = handlers[req](whom, fsreq);
 		} else {
 			cprintf("Invalid request code %d from %08x\n", req, whom);
 			r = -E_INVAL;
 		}
-		ipc_send(whom, r, pg, perm);
 		sys_page_unmap(0, fsreq);
+		client = whom;
 	}
 }
 
@@ -355,7 +464,7 @@ umain(int argc, char **argv)
 	outw(0x8A00, 0x8A00);
 
 	serve_init();
-	ide_init();
+	disk_init();
 	fs_init();
 	serve();
 }
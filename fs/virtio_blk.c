@@ -0,0 +1,322 @@
+/*
+ * Driver for QEMU's virtio block device, using the legacy (virtio 0.9.5)
+ * PCI interface. Requests go into a single virtqueue, so several of them can
+ * be in flight at once; the device tells us through an interrupt when it
+ * has used some of them (see sys_virtio_blk_set_notify).
+ */
+
+#include "fs.h"
+#include <inc/x86.h>
+
+// Legacy virtio registers, relative to io_base
+#define VIRTIO_PCI_HOST_FEATURES	0x00
+#define VIRTIO_PCI_GUEST_FEATURES	0x04
+#define VIRTIO_PCI_QUEUE_PFN		0x08
+#define VIRTIO_PCI_QUEUE_NUM		0x0C
+#define VIRTIO_PCI_QUEUE_SEL		0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10
+#define VIRTIO_PCI_STATUS		0x12
+
+#define VIRTIO_STATUS_ACKNOWLEDGE	0x01
+#define VIRTIO_STATUS_DRIVER		0x02
+#define VIRTIO_STATUS_DRIVER_OK		0x04
+#define VIRTIO_STATUS_FAILED		0x80
+
+// A virtqueue, as laid out in memory: the descriptors, the ring of
+// descriptor chains we make available to the device, and, on the next page
+// boundary, the ring of those it has used.
+struct VringDesc {
+	uint64_t vd_addr;
+	uint32_t vd_len;
+	uint16_t vd_flags;
+	uint16_t vd_next;
+};
+
+#define VRING_DESC_F_NEXT	0x1
+#define VRING_DESC_F_WRITE	0x2	// the device writes to the buffer
+
+struct VringAvail {
+	uint16_t va_flags;
+	uint16_t va_idx;
+	uint16_t va_ring[];
+};
+
+struct VringUsedElem {
+	uint32_t vu_id;		// head of the chain the device used
+	uint32_t vu_len;
+};
+
+struct VringUsed {
+	uint16_t vu_flags;
+	uint16_t vu_idx;
+	struct VringUsedElem vu_ring[];
+};
+
+// The header which starts each request, and the status which ends it
+struct VirtioBlkHdr {
+	uint32_t vh_type;
+	uint32_t vh_reserved;
+	uint64_t vh_sector;
+};
+
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+#define VIRTIO_BLK_S_OK		0
+
+// The largest queue we handle, and the most descriptors one request of 256
+// sectors takes: the header, a piece per page, and the status.
+#define VB_MAXQUEUE	1024
+#define VB_MAXCHAIN	(256 * SECTSIZE / PGSIZE + 3)
+
+// The most requests in flight at once
+#define VB_MAXREQS	32
+
+// Where the virtqueue and the request headers are mapped, below the PRD
+// table of fs/ide.c
+#define VB_REQMAP	0x0fffd000
+#define VB_RINGMAP	0x0ffb0000
+
+// The notification bit with which the kernel tells us of interrupts
+#define VB_NOTIFY	0x1
+
+// A request we issued, and the DMA-able header and status the device
+// reads and writes
+struct VbSlot {
+	struct VirtioBlkHdr vs_hdr;
+	uint8_t vs_status;
+};
+
+static struct {
+	uint16_t head;		// first descriptor of its chain
+	bool busy;		// issued, and not waited for yet
+	bool done;		// the device has used it
+} vb_reqs[VB_MAXREQS];
+
+static uint32_t io_base;
+static bool irq_ok;
+
+static volatile struct VringDesc *desc;
+static volatile struct VringAvail *avail;
+static volatile struct VringUsed *used;
+static uint16_t qsize;
+static uint16_t last_used;	// vu_idx of the next used entry to look at
+
+static uint16_t free_head;	// descriptors not part of any chain
+static uint16_t nfree;
+
+static volatile struct VbSlot *slots = (struct VbSlot *) VB_REQMAP;
+static physaddr_t slots_pa;
+
+#define barrier()	__asm __volatile("" : : : "memory")
+
+static size_t
+vring_size(uint16_t n)
+{
+	return ROUNDUP(sizeof(struct VringDesc) * n + 
+				   sizeof(uint16_t) * (3 + n), PGSIZE) +
+		ROUNDUP(sizeof(uint16_t) * 3 + sizeof(struct VringUsedElem) * n, 
+				PGSIZE);
+}
+
+// Set up the device and its virtqueue, if the kernel found one. Returns
+// whether we can use it.
+bool
+virtio_blk_init(void)
+{
+	physaddr_t ring_pa;
+	void *ring = (void *) VB_RINGMAP;
+	int i, r;
+
+	io_base = sys_get_virtio_blk_io_base();
+	if ((int) io_base <= 0)
+		return 0;
+
+	outb(io_base + VIRTIO_PCI_STATUS, 0);
+	outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	outb(io_base + VIRTIO_PCI_STATUS, 
+		 VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+	// we need none of the optional features.
+	(void) inl(io_base + VIRTIO_PCI_HOST_FEATURES);
+	outl(io_base + VIRTIO_PCI_GUEST_FEATURES, 0);
+
+	// the device picks the queue size.
+	outw(io_base + VIRTIO_PCI_QUEUE_SEL, 0);
+	qsize = inw(io_base + VIRTIO_PCI_QUEUE_NUM);
+	if (qsize < VB_MAXCHAIN || qsize > VB_MAXQUEUE || 
+		vring_size(qsize) > DMA_MAXPAGES * PGSIZE) {
+		cprintf("virtio_blk_init: bad queue size %d\n", qsize);
+		goto fail;
+	}
+
+	if ((r = sys_dma_alloc(ring, vring_size(qsize) / PGSIZE, &ring_pa)) < 0 ||
+		(r = sys_dma_alloc((void *) slots, 1, &slots_pa)) < 0) {
+		cprintf("virtio_blk_init: %e\n", r);
+		goto fail;
+	}
+	static_assert(VB_MAXREQS * sizeof(struct VbSlot) <= PGSIZE);
+
+	desc = ring;
+	avail = ring + sizeof(struct VringDesc) * qsize;
+	used = ring + ROUNDUP(sizeof(struct VringDesc) * qsize + 
+						  sizeof(uint16_t) * (3 + qsize), PGSIZE);
+	for (i = 0; i < qsize; i++)
+		desc[i].vd_next = i + 1;
+	free_head = 0;
+	nfree = qsize;
+
+	outl(io_base + VIRTIO_PCI_QUEUE_PFN, ring_pa >> PGSHIFT);
+
+	// without the interrupt we poll instead of blocking.
+	irq_ok = sys_virtio_blk_set_notify(VB_NOTIFY) == 0;
+
+	outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | 
+		 VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	return 1;
+
+fail:
+	outb(io_base + VIRTIO_PCI_STATUS, VIRTIO_STATUS_FAILED);
+	io_base = 0;
+	return 0;
+}
+
+// Note the requests the device has used since we last looked, and return
+// their descriptors to the free list.
+static void
+vb_reap(void)
+{
+	uint16_t head, d;
+	int i;
+
+	while (last_used != used->vu_idx) {
+		barrier();
+		head = used->vu_ring[last_used % qsize].vu_id;
+		last_used++;
+
+		for (i = 0; i < VB_MAXREQS; i++)
+			if (vb_reqs[i].busy && !vb_reqs[i].done && 
+				vb_reqs[i].head == head)
+				break;
+		if (i == VB_MAXREQS)
+			panic("virtio_blk: device used unknown chain %d", head);
+		vb_reqs[i].done = 1;
+
+		for (d = head; desc[d].vd_flags & VRING_DESC_F_NEXT; 
+			 d = desc[d].vd_next)
+			nfree++;
+		desc[d].vd_next = free_head;
+		free_head = head;
+		nfree++;
+	}
+}
+
+// Wait until the device uses some request.
+static void
+vb_wait_used(void)
+{
+	uint16_t seen = last_used;
+
+	// an interrupt that came before we wait stays pending, so none gets
+	// lost.
+	while (used->vu_idx == seen) {
+		if (irq_ok)
+			sys_wait_notify(0);
+		else
+			sys_yield();
+	}
+	vb_reap();
+}
+
+// Start moving 'nsecs' sectors from 'secno' on between the disk and the
+// memory at 'va', which must be mapped. Returns a request number >= 0 for
+// virtio_blk_done and virtio_blk_wait, or < 0 on error.
+int
+virtio_blk_start(uint32_t secno, const void *va, size_t nsecs, bool write)
+{
+	static physaddr_t pas[VB_MAXCHAIN];
+	uintptr_t addr = (uintptr_t) va;
+	uintptr_t start = ROUNDDOWN(addr, PGSIZE);
+	size_t len = nsecs * SECTSIZE, n, i;
+	uint16_t head, d;
+	int req, r;
+
+	assert(nsecs > 0 && nsecs <= 256);
+
+	if ((r = sys_page_phys((void *) start, 
+						   (ROUNDUP(addr + len, PGSIZE) - start) / PGSIZE,
+						   pas)) < 0)
+		return r;
+
+	// wait for room in the queue, if need be.
+	while (1) {
+		vb_reap();
+		for (req = 0; req < VB_MAXREQS && vb_reqs[req].busy; req++)
+			;
+		if (req < VB_MAXREQS && nfree >= VB_MAXCHAIN)
+			break;
+		vb_wait_used();
+	}
+
+	slots[req].vs_hdr.vh_type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	slots[req].vs_hdr.vh_reserved = 0;
+	slots[req].vs_hdr.vh_sector = secno;
+	slots[req].vs_status = 0xff;
+
+	// the header, then one piece per page, since they needn't be
+	// physically contiguous, then the status.
+	head = d = free_head;
+	desc[d].vd_addr = slots_pa + req * sizeof(struct VbSlot) + 
+		offsetof(struct VbSlot, vs_hdr);
+	desc[d].vd_len = sizeof(struct VirtioBlkHdr);
+	desc[d].vd_flags = VRING_DESC_F_NEXT;
+	for (i = 0; len > 0; i++, addr += n, len -= n) {
+		d = desc[d].vd_next;
+		n = MIN(len, PGSIZE - PGOFF(addr));
+		desc[d].vd_addr = pas[i] + PGOFF(addr);
+		desc[d].vd_len = n;
+		desc[d].vd_flags = VRING_DESC_F_NEXT | 
+			(write ? 0 : VRING_DESC_F_WRITE);
+	}
+	d = desc[d].vd_next;
+	desc[d].vd_addr = slots_pa + req * sizeof(struct VbSlot) + 
+		offsetof(struct VbSlot, vs_status);
+	desc[d].vd_len = 1;
+	desc[d].vd_flags = VRING_DESC_F_WRITE;
+	free_head = desc[d].vd_next;
+	nfree -= i + 2;
+
+	vb_reqs[req].head = head;
+	vb_reqs[req].busy = 1;
+	vb_reqs[req].done = 0;
+
+	// the device may look at the chain as soon as the index moves.
+	avail->va_ring[avail->va_idx % qsize] = head;
+	barrier();
+	avail->va_idx++;
+	barrier();
+	outw(io_base + VIRTIO_PCI_QUEUE_NOTIFY, 0);
+	return req;
+}
+
+// Has the device used request 'req'? Then virtio_blk_wait won't block.
+bool
+virtio_blk_done(int req)
+{
+	vb_reap();
+	return vb_reqs[req].done;
+}
+
+// Wait until the device has used request 'req', and free it. Returns 0 on
+// success, < 0 if the request failed.
+int
+virtio_blk_wait(int req)
+{
+	assert(req >= 0 && req < VB_MAXREQS && vb_reqs[req].busy);
+
+	vb_reap();
+	while (!vb_reqs[req].done)
+		vb_wait_used();
+
+	vb_reqs[req].busy = 0;
+	return slots[req].vs_status == VIRTIO_BLK_S_OK ? 0 : -1;
+}
@@ -39,6 +39,10 @@ Application *foreground_application = NULL;
 #define BORDER_COLOR COLOR_BLACK
 #define BORDER_THICKNESS 3
 
+// how long to wait before retrying to deliver events to an application which
+// wasn't receiving, in microseconds
+#define EVENT_RETRY_USEC 10000
+
 static void alloc_share_page() {
 	int r;
 	if ((r = sys_page_alloc(0, D_SHARE_PAGE, PTE_U | PTE_P | PTE_W)))
@@ -372,12 +376,19 @@ static void init_window(Window *w, int x, int y, int height, int width,
 	w->title = title;
 }
 
+// mappings are made in batches, with one system call for many pages
+static struct PageBatch batch;
+
 static void mark_perm (void *mem, size_t size, int perm) {
 	size_t offset;
+	page_batch_init(&batch, 0);
 	for (offset = 0; offset < size; offset += PGSIZE) {
-		if (sys_page_map(0, mem + offset, 0, mem + offset, perm))
+		if (page_batch_add(&batch, PGOP_PROTECT, mem + offset, mem + offset, 
+						   perm))
 			panic("mark_perm");
 	}
+	if (page_batch_flush(&batch))
+		panic("mark_perm");
 }
 static void mark_nonshared (void *mem, size_t size) {
 	mark_perm(mem, size, PTE_U | PTE_P | PTE_W);
@@ -407,12 +418,15 @@ static Application *spawn_application(char *progname, int x, int y, int height,
 		panic("spawn_program: '%s' - %e", progname, app->pid);
 
 	// share the raw canvas memory with the child
+	page_batch_init(&batch, app->pid);
 	for (offset = 0; offset < w->canvas->size; offset += PGSIZE) {
 		void *addr = ((void *) w->canvas->raw_pixels) + offset;
-		if ((r = sys_page_map(0, addr, app->pid, CANVAS_BASE + offset, 
-							  PTE_U | PTE_P | PTE_W | PTE_SHARE)))
+		if ((r = page_batch_add(&batch, PGOP_MAP, addr, CANVAS_BASE + offset,
+								PTE_U | PTE_P | PTE_W | PTE_SHARE)))
 			panic("spawn_program sys_page_map: %e", r);
 	}
+	if ((r = page_batch_flush(&batch)))
+		panic("spawn_program sys_page_map: %e", r);
 
 	// start the program
 	if (sys_env_set_status(app->pid, ENV_RUNNABLE) < 0)
@@ -533,6 +547,14 @@ static void transmit_events() {
 	}
 }
 
+// returns whether some application has events which weren't delivered yet
+static bool events_pending() {
+	struct event_list_head *elh;
+	for (elh = events_queue; elh; elh = elh->next)
+		if (elh->link)
+			return 1;
+	return 0;
+}
 
 void umain(int argc, char **argv) {
 
@@ -569,7 +591,11 @@ void umain(int argc, char **argv) {
 		// write the changes to the LFB
 		refresh_screen();
 
-		// TODO: add some kind of rate limiting so we don't eat all the CPU
+		// sleep until there is something new to show: the kernel has io
+		// events for us, or an application drew on its canvas. If some
+		// application wasn't ready for its events, retry in a bit.
+		sys_wait_notify(events_pending() ? 
+						sys_time_usec() + EVENT_RETRY_USEC : 0);
 	}
 
 }
@@ -47,10 +47,33 @@ enum EnvType {
 	ENV_TYPE_GRAPHICS,
 };
 
+// A FIFO of envs blocked sending to one env; see kern/syscall.c.
+struct IpcQueue {
+	struct Env *iq_head;
+	struct Env *iq_tail;
+};
+
+// A FIFO of envs blocked in sys_futex_wait; see kern/futex.c.
+struct FutexQueue {
+	struct Env *fq_head;
+	struct Env *fq_tail;
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	struct Env *env_link;		// Next free Env
 
+	// Run queue linkage; env_rq is non-NULL iff the env is queued
+	struct RunQueue *env_rq;	// Per-CPU run queue we are on
+	struct Env *env_rq_next;
+	struct Env *env_rq_prev;
+
+	// Timer wheel linkage; env_tw is non-NULL iff the env is sleeping
+	struct TimerWheel *env_tw;	// Per-CPU timer wheel we are on
+	struct Env *env_tw_next;
+	struct Env *env_tw_prev;
+	uint64_t env_wakeup;		// When to wake up, in microseconds
+
 	// Unique environment identifier
 	envid_t env_id;			
 
@@ -71,13 +94,38 @@ struct Env {
 
 	// Exception handling
 	void *env_pgfault_upcall;	// Page fault upcall entry point
+	uintptr_t env_xstacktop;	// Top of our exception stack
+
+	int env_thread_slot;		// Our stacks' slot; see UTHREADSTACKTOP
 
 	bool env_ipc_recving;		// Env is blocked receiving
+	envid_t env_ipc_recv_from;	// If set, only accept messages from this env
+
+	// Envs blocked in sys_ipc_send to us, oldest first
+	struct IpcQueue env_ipc_sendq;
+
+	// While we are blocked sending: the queue we are on, and the message
+	struct IpcQueue *env_ipc_waitq;	// NULL if we aren't queued
+	struct Env *env_ipc_waitq_next;
+	uint32_t env_ipc_send_value;
+	void *env_ipc_send_va;
+	int env_ipc_send_perm;
+	bool env_ipc_send_call;		// Wait for a reply once it's taken
 	void *env_ipc_dst_va;		// VA at which to map received page
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
 
+	uint32_t env_notify_pending;	// Notification bits not yet waited for
+	bool env_notify_waiting;	// Env is blocked in sys_wait_notify
+	bool env_notify_bound;		// Notifications also end sys_ipc_recv
+
+	// While we are blocked in sys_futex_wait: the queue we are on, and the
+	// physical address we wait on
+	struct FutexQueue *env_futex_q;	// NULL if we aren't queued
+	struct Env *env_futex_next;
+	physaddr_t env_futex_key;
+
 	// used when switching to virtual-8086 mode
 	bool in_v86_mode;
 	uint32_t saved_eip;
@@ -30,6 +30,9 @@ enum {
 
 	E_NOT_READY ,
 
+	E_AGAIN		,	// Value changed before we could wait for it
+	E_TIMEOUT	,	// Deadline passed
+
 	MAXERROR
 };
 
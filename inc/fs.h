@@ -75,7 +75,22 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Cache stats returns a struct BcStats on the request page
+	FSREQ_CACHE_STATS,
+	// Writes back and empties the block cache, e.g. to test the disk
+	FSREQ_DROP_CACHE
+};
+
+// Counters of the file server's block cache; see fs/bc.c.
+struct BcStats {
+	uint32_t bs_hits;	// Blocks file_get_block found cached
+	uint32_t bs_misses;	// Blocks read in from disk when first used
+	uint32_t bs_readahead;	// Blocks read in from disk ahead of use
+	uint32_t bs_evictions;	// Blocks dropped to make room
+	uint32_t bs_writebacks;	// Dirty blocks written to disk
+	uint32_t bs_nblocks;	// Blocks cached right now
+	uint32_t bs_maxblocks;	// Most blocks the cache holds
 };
 
 union Fsipc {
@@ -113,6 +128,7 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct BcStats cacheStatsRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -5,6 +5,10 @@
 #define CANVAS_BASE ((void *) 0x30001000)
 #define SHARE_PAGE (CANVAS_BASE - PGSIZE*2)
 
+// applications notify the display server with this bit once they have drawn
+// on their canvas. The kernel uses 0x1 (IO_EVENTS_NOTIFY) for new io events.
+#define DS_NOTIFY_REDRAW 0x2
+
 
 #define RED(color)   (((color)>>16) & 0xff)
 #define GREEN(color) (((color)>> 8) & 0xff)
@@ -3,9 +3,19 @@
 
 #include <kern/pci.h>
 #include <kern/pcireg.h>
+#include <inc/env.h>
 
 int ide_disk_attach(struct pci_func *pcif);
 
 uint32_t io_base;
 
+// the port of the PIIX bus-master DMA registers for io_base's channel, or 0
+// if the controller can't do DMA.
+uint32_t bm_base;
+
+// the env to notify of IDE interrupts, and the bits to notify it with; see
+// sys_ide_set_notify.
+envid_t ide_notify_envid;
+uint32_t ide_notify_bits;
+
 #endif	// not JOS_INC_FD_H
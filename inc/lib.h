@@ -8,6 +8,7 @@
 #define JOS_INC_LIB_H 1
 
 #include <inc/types.h>
+#include <inc/x86.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 #include <inc/string.h>
@@ -22,6 +23,8 @@
 #include <inc/args.h>
 #include <inc/malloc.h>
 #include <inc/ns.h>
+#include <inc/ring.h>
+#include <inc/mutex.h>
 #include <kern/graphics.h>
 
 #define USED(x)		(void)(x)
@@ -31,10 +34,24 @@ void	umain(int argc, char **argv);
 
 // libmain.c or entry.S
 extern const char *binaryname;
-extern const volatile struct Env *thisenv;
+extern const volatile struct Env *thread_envs[NTHREAD];
 extern const volatile struct Env envs[NENV];
 extern const volatile struct PageInfo pages[];
 
+// The threads made by sfork share our globals, so each one finds its own
+// Env by the stack it runs on; see UTHREADSTACKTOP.
+static inline int
+thread_slot(void)
+{
+	uintptr_t esp = read_esp();
+
+	if (esp > UTHREADSTACKTOP(NTHREAD) && esp <= UTHREADSTACKTOP(1))
+		return (USTACKTOP - esp) / UTHREADSLOT;
+	return 0;
+}
+
+#define thisenv	(thread_envs[thread_slot()])
+
 // exit.c
 void	exit(void);
 
@@ -53,6 +70,8 @@ void	sys_yield(void);
 void	sys_v86(void);
 int sys_get_io_events(void *arr, size_t size);
 static envid_t sys_exofork(void);
+envid_t	sys_fork(void);
+envid_t	sys_sfork(void);
 int sys_map_lfb(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
@@ -63,10 +82,31 @@ int sys_receive(void *buf, size_t bufsize);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_batch(envid_t src_env, envid_t dst_env, struct PageOp *ops,
+		       size_t nops);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		     void *rcv_pg);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+			   void *rcv_pg);
 unsigned int sys_time_msec(void);
+unsigned int sys_time_usec(void);
+int	sys_sleep_until(unsigned int deadline);
+int	sys_notify(envid_t envid, uint32_t bits);
+uint32_t sys_wait_notify(unsigned int deadline);
+int	sys_bind_notify(bool bind);
+int	sys_futex_wait(volatile uint32_t *addr, uint32_t val, 
+		       unsigned int deadline);
+int	sys_futex_wake(volatile uint32_t *addr, int n);
 unsigned int sys_get_ide_io_base(void);
+unsigned int sys_get_ide_bm_base(void);
+int	sys_dma_alloc(void *va, size_t npages, physaddr_t *pa_store);
+int	sys_page_phys(const void *va, size_t npages, physaddr_t *pa_store);
+int	sys_ide_set_notify(uint32_t bits);
+unsigned int sys_get_virtio_blk_io_base(void);
+int	sys_virtio_blk_set_notify(uint32_t bits);
 int sys_get_mode_info(struct vbe_mode_info *p);
 
 // This must be inlined.  Exercise for reader: why?
@@ -83,12 +123,31 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
+// mutex.c
+void	mutex_lock(struct mutex *m);
+bool	mutex_trylock(struct mutex *m);
+void	mutex_unlock(struct mutex *m);
+void	cond_wait(struct cond *c, struct mutex *m);
+void	cond_signal(struct cond *c);
+void	cond_broadcast(struct cond *c);
+
+// ring.c
+int	ring_init(struct ring *r, size_t nslots, size_t slotsize,
+		  uint32_t cons_bit, uint32_t prod_bit);
+void *	ring_read_slot(struct ring *r, bool wait);
+void	ring_read_done(struct ring *r);
+void *	ring_write_slot(struct ring *r, bool wait);
+void	ring_write_done(struct ring *r);
+
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
-envid_t	sfork(void);	// Challenge!
+envid_t	sfork(void);
 
 // fd.c
 int	close(int fd);
@@ -106,6 +165,8 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	fs_cache_stats(struct BcStats *stats);
+int	fs_drop_cache(void);
 
 // pageref.c
 int	pageref(void *addr);
@@ -148,7 +209,19 @@ int	pipeisclosed(int pipefd);
 void	wait(envid_t env);
 
 // map.c
+// Page mapping operations from us to env pb_dst, which are applied in
+// batches by sys_page_batch; see page_batch_add().
+struct PageBatch {
+	envid_t pb_dst;
+	size_t pb_nops;
+	struct PageOp pb_ops[PGOP_MAX];
+};
+
 void print_process_mappings(void);
+void	page_batch_init(struct PageBatch *b, envid_t dst);
+int	page_batch_add(struct PageBatch *b, int op, void *va, void *dst_va,
+		       int perm);
+int	page_batch_flush(struct PageBatch *b);
 
 
 /* File open modes */
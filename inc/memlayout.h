@@ -58,6 +58,8 @@
  *    USTACKTOP  --->  +------------------------------+ 0xeebfe000
  *                     |      Normal User Stack       | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebfd000
+ *                     |    Thread Stacks (if any)    | RW/RW
+ *                     +------------------------------+ 0xeeafe000
  *                     |                              |
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -142,6 +144,15 @@
 // Top of normal user stack
 #define USTACKTOP	(UTOP - 2*PGSIZE)
 
+// The threads of an env (see sys_sfork) share its address space, so each
+// thread i > 0 has its own one-page stack and exception stack in slot i of
+// the UTHREADSLOT-sized slots below the normal user stack. The other pages
+// of a slot are left invalid as guards. Thread 0 uses the stacks above.
+#define UTHREADSLOT	(4*PGSIZE)
+#define NTHREAD		64
+#define UTHREADSTACKTOP(i)	(USTACKTOP - (i) * UTHREADSLOT)
+#define UTHREADXSTACKTOP(i)	(UTHREADSTACKTOP(i) - 2*PGSIZE)
+
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
 
@@ -191,8 +202,10 @@ extern volatile pde_t uvpd[];     // VA of current page directory
  * with page2pa() in kern/pmap.h.
  */
 struct PageInfo {
-	// Next page on the free list.
+	// Next and previous free block on the free list of its order; the
+	// first page of a free block stands for all of it.
 	struct PageInfo *pp_link;
+	struct PageInfo *pp_prev;
 
 	// pp_ref is the count of pointers (usually in page table entries)
 	// to this page, for pages allocated using page_alloc.
@@ -200,6 +213,9 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// For the first page of a free block: the block has 2^pp_order pages.
+	uint8_t pp_order;
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -69,6 +69,10 @@
 // hardware, so user processes are allowed to set them arbitrarily.
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// ... except for these two, which sys_fork looks at as well.
+#define PTE_SHARE	0x400	// Shared with children by fork and spawn
+#define PTE_COW		0x800	// Copy-on-write; see env_copy_vm
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
@@ -91,6 +95,7 @@
 #define CR0_PG		0x80000000	// Paging
 
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -98,6 +103,16 @@
 #define CR4_PVI		0x00000002	// Protected-Mode Virtual Interrupts
 #define CR4_VME		0x00000001	// V86 Mode Extensions
 
+// CPUID feature flags (EAX = 1, in EDX)
+#define CPUID_PSE	0x00000008	// 4MB pages
+#define CPUID_SEP	0x00000800	// sysenter and sysexit
+#define CPUID_PGE	0x00002000	// global pages
+
+// Model-specific registers
+#define MSR_SYSENTER_CS		0x174	// Code segment of sysenter's target
+#define MSR_SYSENTER_ESP	0x175	// Stack of sysenter's target
+#define MSR_SYSENTER_EIP	0x176	// Entry point of sysenter's target
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
@@ -0,0 +1,21 @@
+// Mutexes and condition variables for envs sharing memory, built on
+// sys_futex_wait and sys_futex_wake; see lib/mutex.c.
+
+#ifndef JOS_INC_MUTEX_H
+#define JOS_INC_MUTEX_H
+
+#include <inc/types.h>
+
+// A zeroed mutex is unlocked.
+struct mutex {
+	// 0 if unlocked, 1 if locked, 2 if locked and someone may be waiting
+	volatile uint32_t m_state;
+};
+
+// A zeroed condition variable is ready to use.
+struct cond {
+	// Bumped by every signal, so that a waiter can tell it missed one
+	volatile uint32_t c_seq;
+};
+
+#endif /* !JOS_INC_MUTEX_H */
@@ -22,21 +22,41 @@ enum {
 	NSREQ_CLOSE,
 	NSREQ_CONNECT,
 	NSREQ_LISTEN,
-	// Recv returns a Nsret_recv on the request page.
-	NSREQ_RECV,
-	NSREQ_SEND,
 	NSREQ_SOCKET,
 
-	// The following two messages pass a page containing a struct jif_pkt
-	NSREQ_INPUT,
-	// NSREQ_OUTPUT, unlike all other messages, is sent *from* the
-	// network server, to the output environment
-	NSREQ_OUTPUT,
+	// Passes one page of the client's socket rings; see below.
+	NSREQ_RING,
 
-	// The following message passes no page
+	// Packets to and from the input and output environments don't go
+	// through IPC, but through the rings in net/ns.h.
+
+	// The following messages pass no page. Send and recv take their
+	// arguments and data from the client's send ring, and recv returns
+	// the data it got on the client's receive ring.
+	NSREQ_RECV,
+	NSREQ_SEND,
 	NSREQ_TIMER,
 };
 
+// Socket data goes through a pair of rings per client (see lib/ring.c)
+// rather than through the request page. The client fills the send ring
+// with Nsring_msgs and makes one NSREQ_SEND or NSREQ_RECV call for all of
+// them; the network server answers a recv with Nsring_msgs on the receive
+// ring. Before its first send or recv, the client passes the pages of both
+// rings, send ring first, with one NSREQ_RING each.
+#define NSRING_SLOTS		4
+#define NSRING_SLOT_SIZE	2048
+#define NSRING_PAGES		(1 + NSRING_SLOTS * NSRING_SLOT_SIZE / PGSIZE)
+
+struct Nsring_msg {
+	int m_s;
+	int m_len;		// Bytes in m_data, or bytes wanted for a recv
+	unsigned int m_flags;
+	char m_data[0];
+};
+
+#define NSRING_MAXDATA	((int) (NSRING_SLOT_SIZE - sizeof(struct Nsring_msg)))
+
 union Nsipc {
 	struct Nsreq_accept {
 		int req_s;
@@ -74,31 +94,12 @@ union Nsipc {
 		int req_backlog;
 	} listen;
 
-	struct Nsreq_recv {
-		int req_s;
-		int req_len;
-		unsigned int req_flags;
-	} recv;
-
-	struct Nsret_recv {
-		char ret_buf[0];
-	} recvRet;
-
-	struct Nsreq_send {
-		int req_s;
-		int req_size;
-		unsigned int req_flags;
-		char req_buf[0];
-	} send;
-
 	struct Nsreq_socket {
 		int req_domain;
 		int req_type;
 		int req_protocol;
 	} socket;
 
-	struct jif_pkt pkt;
-
 	// Ensure Nsipc is one page
 	char _pad[PGSIZE];
 };
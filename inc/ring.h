@@ -0,0 +1,27 @@
+// Single-producer, single-consumer rings of fixed-size slots in shared
+// memory; see lib/ring.c.
+
+#ifndef JOS_INC_RING_H
+#define JOS_INC_RING_H
+
+#include <inc/types.h>
+
+// The header lives in the first page of the ring; the slots follow on the
+// next pages. head and tail count the slots ever filled and taken, so the
+// ring holds head - tail slots.
+struct ring {
+	volatile uint32_t r_head;	// Written only by the producer
+	volatile uint32_t r_tail;	// Written only by the consumer
+
+	// envid of a side that sleeps until the other one makes progress, or
+	// 0; and the notification bit to wake it up with.
+	volatile uint32_t r_cons_waiter;
+	volatile uint32_t r_prod_waiter;
+	uint32_t r_cons_bit;
+	uint32_t r_prod_bit;
+
+	uint32_t r_nslots;
+	uint32_t r_slotsize;
+};
+
+#endif /* !JOS_INC_RING_H */
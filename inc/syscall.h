@@ -25,7 +25,47 @@ enum {
 	SYS_get_io_events,
 	SYS_get_ide_io_base,
 	SYS_get_mode_info,
+	SYS_time_usec,
+	SYS_sleep_until,
+	SYS_ipc_call,
+	SYS_ipc_reply_recv,
+	SYS_ipc_send,
+	SYS_notify,
+	SYS_wait_notify,
+	SYS_bind_notify,
+	SYS_page_batch,
+	SYS_fork,
+	SYS_sfork,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_get_ide_bm_base,
+	SYS_dma_alloc,
+	SYS_page_phys,
+	SYS_ide_set_notify,
+	SYS_get_virtio_blk_io_base,
+	SYS_virtio_blk_set_notify,
 	NSYSCALLS
 };
 
+// Operations for sys_page_batch, between a source and a destination env
+enum {
+	PGOP_MAP = 0,	// Map the source's page at po_va at po_dst_va in the
+			// destination, like sys_page_map
+	PGOP_PROTECT,	// Change the perm of the source's page at po_va
+	PGOP_UNMAP,	// Unmap the destination's page at po_dst_va
+};
+
+struct PageOp {
+	int po_op;
+	void *po_va;
+	void *po_dst_va;
+	int po_perm;
+};
+
+// The most operations a single sys_page_batch call takes
+#define PGOP_MAX	256
+
+// The most pages a single sys_dma_alloc or sys_page_phys call takes
+#define DMA_MAXPAGES	64
+
 #endif /* !JOS_INC_SYSCALL_H */
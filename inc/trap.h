@@ -38,8 +38,14 @@
 #define IRQ_SPURIOUS     7
 #define IRQ_MOUSE		12
 #define IRQ_IDE         14
+#define IRQ_PCI_FIRST   9	// the BIOS routes PCI interrupts to lines 9-11
+#define IRQ_PCI_LAST    11
 #define IRQ_ERROR       19
 
+// Inter-processor interrupts, sent by the local APICs.
+#define IRQ_RESCHED     20	// go look at the run queues
+#define IRQ_TLB         21	// flush stale TLB entries; see tlb_shootdown
+
 #ifndef __ASSEMBLER__
 
 #include <inc/types.h>
@@ -223,6 +223,12 @@ read_esp(void)
 	return esp;
 }
 
+static inline void
+wrmsr(uint32_t msr, uint64_t val)
+{
+	asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
 static inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
@@ -261,4 +267,18 @@ xchg(volatile uint32_t *addr, uint32_t newval)
 	return result;
 }
 
+// Store newval at addr if it holds oldval; either way, return what was
+// there before.
+static inline uint32_t
+cmpxchg(volatile uint32_t *addr, uint32_t oldval, uint32_t newval)
+{
+	uint32_t result;
+
+	asm volatile("lock; cmpxchgl %2, %1"
+		     : "=a" (result), "+m" (*addr)
+		     : "r" (newval), "0" (oldval)
+		     : "cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -3,70 +3,83 @@
 #include <inc/assert.h>
 #include <inc/types.h>
 #include <inc/env.h>
+#include <inc/error.h>
 #include <inc/string.h>
 
 #include <kern/env.h>
 #include <kern/pmap.h>
-
-// inserts the pages in [begin, end) from the current env's page table into
-// the kernel page table
-static void dup_range(void *begin, void *end) {
-	void * cur;
-	pte_t *pte = NULL;
-
-	end = ROUNDUP(end, PGSIZE);
-
-	assert (begin < (void *) ULIM);
-	assert (end < (void *) ULIM);
-
-	for (cur = ROUNDDOWN(begin, PGSIZE); cur < end; cur += PGSIZE) {
-
-		// look it up in the page table
-		struct PageInfo* pageinfo = page_lookup(curenv->env_pgdir, cur, &pte);
-
-		// is it not present?
-		if (!pageinfo)
-			panic("pageinfo not present in dup_range");
-
-		if (page_insert(kern_pgdir, pageinfo, cur, PTE_P | PTE_W))
-			panic("bad page_inset in dup_range");
-	}
+#include <kern/copy.h>
+
+// The copy itself, which runs on curenv's page directory like the rest of
+// a syscall. User memory may fault while we are between copy_user_start and
+// copy_user_end; trap_dispatch then either resolves the fault and lets the
+// copy go on, or makes copy_user_raw return -E_FAULT (see copy_user_fail).
+int copy_user_raw(void *dst, const void *src, size_t length);
+extern char copy_user_start[], copy_user_end[], copy_user_out[];
+
+asm(".text\n"
+	"copy_user_raw:\n"
+	"	pushl %edi\n"
+	"	pushl %esi\n"
+	"	movl 12(%esp), %edi\n"
+	"	movl 16(%esp), %esi\n"
+	"	movl 20(%esp), %ecx\n"
+	"	movl %ecx, %edx\n"
+	"	shrl $2, %ecx\n"
+	"copy_user_start:\n"
+	"	rep movsl\n"
+	"	movl %edx, %ecx\n"
+	"	andl $3, %ecx\n"
+	"	rep movsb\n"
+	"copy_user_end:\n"
+	"	xorl %eax, %eax\n"
+	"copy_user_out:\n"
+	"	popl %esi\n"
+	"	popl %edi\n"
+	"	ret\n");
+
+// checks that [va, va + length) lies in userland, without wrapping around.
+static bool user_range_ok(const void *va, size_t length) {
+	return (uintptr_t) va + length >= (uintptr_t) va &&
+		(uintptr_t) va + length <= ULIM;
 }
 
-void copy_from_user(void *dst, void *src, size_t length) {
-	user_mem_assert(curenv, src, length, 0);
+// copies 'length' bytes from userland to the kernel. The caller must not
+// hold curenv's lock, which copy-on-write faults need.
+// returns 0 on success, -E_FAULT if curenv can't read the source.
+int copy_from_user(void *dst, void *src, size_t length) {
 	assert (dst >= (void *) ULIM);
-	assert (dst + length >= (void *) ULIM);
-
-	// we are now guaranteed that the source and destination areas don't
-	// overlap, since one is in kernelland and the other is in userland.
 
-	// walk over the destination pages and add them to the kernel page table
-	// before copying.
-	dup_range(src, src + length);
+	if (!user_range_ok(src, length))
+		return -E_FAULT;
 
-	// load new page table, copy the data, load old page table
-	uint32_t old_pgdir = rcr3();
-	lcr3(PADDR(kern_pgdir));
-	memcpy(dst, src, length);
-	lcr3(old_pgdir);
+	// the source and destination areas don't overlap, since one is in
+	// kernelland and the other is in userland.
+	return copy_user_raw(dst, src, length);
 }
 
-void copy_to_user(void *dst, void *src, size_t length) {
-	user_mem_assert(curenv, dst, length, 0);
+// copies 'length' bytes from the kernel to userland, giving curenv its own
+// copy of copy-on-write pages on the way. The caller must not hold curenv's
+// lock.
+// returns 0 on success, -E_FAULT if curenv can't write the destination.
+int copy_to_user(void *dst, void *src, size_t length) {
 	assert (src >= (void *) ULIM);
-	assert (src + length >= (void *) ULIM);
 
-	// we are now guaranteed that the source and destination areas don't
-	// overlap, since one is in kernelland and the other is in userland.
+	if (!user_range_ok(dst, length))
+		return -E_FAULT;
 
-	// walk over the destination pages and add them to the kernel page table
-	// before copying.
-	dup_range(dst, dst + length);
+	return copy_user_raw(dst, src, length);
+}
+
+// whether the kernel-mode page fault in tf hit user memory during a copy.
+bool copy_user_faulted(struct Trapframe *tf) {
+	return tf->tf_eip >= (uintptr_t) copy_user_start &&
+		tf->tf_eip < (uintptr_t) copy_user_end &&
+		rcr2() < ULIM;
+}
 
-	// load new page table, copy the data, load old page table
-	uint32_t old_pgdir = rcr3();
-	lcr3(PADDR(kern_pgdir));
-	memcpy(dst, src, length);
-	lcr3(old_pgdir);
+// makes the copy that faulted in tf return -E_FAULT once tf is resumed.
+void copy_user_fail(struct Trapframe *tf) {
+	tf->tf_eip = (uintptr_t) copy_user_out;
+	tf->tf_regs.reg_eax = -E_FAULT;
 }
@@ -3,8 +3,13 @@
 #ifndef JOS_KERN_COPY_H
 #define JOS_KERN_COPY_H
 
-void copy_to_user(void *dst, void *src, size_t length);
-void copy_from_user(void *dst, void *src, size_t length);
+#include <inc/trap.h>
+
+int copy_to_user(void *dst, void *src, size_t length);
+int copy_from_user(void *dst, void *src, size_t length);
+
+bool copy_user_faulted(struct Trapframe *tf);
+void copy_user_fail(struct Trapframe *tf);
 
 
 #endif // !JOS_KERN_COPY_H
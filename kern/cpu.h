@@ -17,12 +17,36 @@ enum {
 	CPU_HALTED,
 };
 
+// A FIFO of ENV_RUNNABLE environments waiting for a CPU. Each CPU has
+// its own; see kern/sched.c.
+struct RunQueue {
+	struct Env *rq_head;
+	struct Env *rq_tail;
+	int rq_len;
+};
+
+// Environments sleeping until a deadline, hashed by the WHEEL_TICK long
+// tick their deadline falls in. Each CPU has one; see kern/timer.c.
+#define WHEEL_SLOTS	256
+#define WHEEL_TICK	1000		// microseconds
+struct TimerWheel {
+	struct Env *tw_slots[WHEEL_SLOTS];
+	uint64_t tw_tick;		// Ticks before this one have been run
+	int tw_len;
+};
+
 // Per-CPU state
 struct CpuInfo {
 	uint8_t cpu_id;                 // Local APIC ID; index into cpus[] below
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	struct RunQueue cpu_rq;         // Environments waiting to run here
+	struct TimerWheel cpu_tw;       // Environments sleeping here
+	uint64_t cpu_timer_at;          // When the LAPIC timer fires, or 0
+	uint64_t cpu_slice_end;         // When curenv's time slice ends, or 0
+	pde_t *cpu_pgdir;               // User page directory loaded, or NULL
+	volatile uint32_t cpu_tlb_req;  // Pending TLB shootdown; see pmap.c
 };
 
 // Initialized in mpconfig.c
@@ -42,5 +66,8 @@ void init_lapic(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(uint8_t apicid, int vector);
+void lapic_timer_oneshot(uint32_t usec);
+void lapic_timer_stop(void);
 
 #endif
@@ -345,7 +345,8 @@ int e1000_transmit(unsigned char *data, size_t length) {
 	}
 
 	// there is space, so copy the data there
-	copy_from_user(&txbuffers[index].data, data, length);
+	if (copy_from_user(&txbuffers[index].data, data, length))
+		return -E_FAULT;
 	desc->length = length;
 	mark_descriptor_in_use(desc);
 
@@ -373,7 +374,8 @@ int e1000_receive(unsigned char *buf, size_t bufsize) {
 	if (desc->length > bufsize)
 		return -E_NO_MEM;
 	
-	copy_to_user(buf, &rxbuffers[index].data, desc->length);
+	if (copy_to_user(buf, &rxbuffers[index].data, desc->length))
+		return -E_FAULT;
 
 	// the EOP bit should be set since every packet fits into one descriptor
 	// (because we disallow jumbo frames)
@@ -14,10 +14,15 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/futex.h>
 
 // an array of all the environments
 struct Env *envs = NULL;		
 
+// the lock of each env in envs; see env_lock
+struct spinlock env_locks[NENV];
+
 // the currently executing environment
 // this is replaced by a macro instead (?)
 // struct Env *curenv = NULL;		
@@ -25,6 +30,12 @@ struct Env *envs = NULL;
 static struct Env *env_free_list;	// Free environment list
 					// (linked by Env->env_link)
 
+static struct spinlock env_free_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "env_free_lock"
+#endif
+};
+
 #define ENVGENSHIFT	12		// >= LOGNENV
 
 // Global descriptor table.
@@ -114,6 +125,61 @@ envid2env(envid_t envid, struct Env **env_store, bool checkperm)
 	return 0;
 }
 
+//
+// Lock env e, which the caller looked up with envid2env() without holding
+// any locks. By the time we hold the lock the env may have been freed, or
+// even recycled for a new env, so check that it is still 'envid'.
+//
+// RETURNS
+//   0 with env_lock(e) held on success, -E_BAD_ENV (and no lock) on error.
+//
+int
+env_lock_checked(struct Env *e, envid_t envid)
+{
+	if (envid == 0)
+		envid = curenv->env_id;
+
+	spin_lock(env_lock(e));
+	if (e->env_status == ENV_FREE || e->env_id != envid) {
+		spin_unlock(env_lock(e));
+		return -E_BAD_ENV;
+	}
+	return 0;
+}
+
+//
+// Like env_lock_checked(), but for two envs, which may be the same one. The
+// locks are taken in address order so that two CPUs locking the same pair
+// can't deadlock.
+//
+int
+env_lock_pair_checked(struct Env *a, envid_t a_id, struct Env *b, envid_t b_id)
+{
+	int r;
+
+	if (a == b)
+		return env_lock_checked(a, a_id);
+
+	if (a > b)
+		return env_lock_pair_checked(b, b_id, a, a_id);
+
+	if ((r = env_lock_checked(a, a_id)))
+		return r;
+	if ((r = env_lock_checked(b, b_id))) {
+		spin_unlock(env_lock(a));
+		return r;
+	}
+	return 0;
+}
+
+void
+env_unlock_pair(struct Env *a, struct Env *b)
+{
+	spin_unlock(env_lock(a));
+	if (b != a)
+		spin_unlock(env_lock(b));
+}
+
 // Mark all environments in 'envs' as free, set their env_ids to 0,
 // and insert them into the env_free_list.
 // Make sure the environments are in the free list in the same order
@@ -125,6 +191,7 @@ init_environments(void)
 {
 	struct Env *cur;
 	for (cur = envs + NENV - 1; cur >= envs; cur--) {
+		spin_initlock(env_lock(cur));
 		cur->env_status = ENV_FREE;
 		cur->env_id = 0;
 		cur->env_link = env_free_list;
@@ -197,8 +264,14 @@ env_setup_vm(struct Env *env)
 	// exits.
 	for (i = PDX(UTOP); i < NPDENTRIES; i++) {
 		pde_t pde  = kern_pgdir[i];
-		if (!(pde & PTE_P))
+		if (!(pde & PTE_P) || i == PDX(UVPT))
+			continue;
+
+		// 4MB pages have no second level to copy.
+		if (pde & PTE_PS) {
+			env->env_pgdir[i] = pde;
 			continue;
+		}
 
 		// allocate a separate second-level page in the page table; a process
 		// can *NOT* share the second level of its page table with the kernel,
@@ -247,6 +320,9 @@ void init_trapframe(struct Trapframe *tf) {
 	tf->tf_eflags |= FL_IF;
 }
 
+static int env_alloc_common(struct Env **newenv_store, envid_t parent_id, 
+			    struct Env *share);
+
 //
 // Allocates and initializes a new environment.
 // On success, the new environment is stored in *newenv_store.
@@ -257,17 +333,56 @@ void init_trapframe(struct Trapframe *tf) {
 //
 int
 env_alloc(struct Env **newenv_store, envid_t parent_id)
+{
+	return env_alloc_common(newenv_store, parent_id, NULL);
+}
+
+//
+// Like env_alloc, but the new environment is a thread of 'parent': it
+// shares parent's page directory, which lives on until its last thread
+// is freed. The caller gives it stacks of its own; see sys_sfork.
+//
+int
+env_alloc_thread(struct Env **newenv_store, struct Env *parent)
+{
+	return env_alloc_common(newenv_store, parent->env_id, parent);
+}
+
+static int
+env_alloc_common(struct Env **newenv_store, envid_t parent_id, 
+				 struct Env *share)
 {
 	int32_t generation;
-	int r;
+	int r = 0;
 	struct Env *e;
 
-	if (!(e = env_free_list))
+	spin_lock(&env_free_lock);
+	if (!(e = env_free_list)) {
+		spin_unlock(&env_free_lock);
 		return -E_NO_FREE_ENV;
-
-	// Allocate and set up the page directory for this environment.
-	if ((r = env_setup_vm(e)) < 0)
+	}
+	env_free_list = e->env_link;
+	spin_unlock(&env_free_lock);
+
+	// Allocate and set up the page directory for this environment, or take
+	// a reference to the one we share; see env_free.
+	if (share) {
+		e->env_pgdir = share->env_pgdir;
+		page_incref(pa2page(PADDR(e->env_pgdir)));
+	} else
+		r = env_setup_vm(e);
+
+	if (r < 0) {
+		spin_lock(&env_free_lock);
+		e->env_link = env_free_list;
+		env_free_list = e;
+		spin_unlock(&env_free_lock);
 		return r;
+	}
+
+	// envid2env() may still hand out e to someone holding a stale envid;
+	// they take the lock and recheck the id before touching it.
+	spin_lock(env_lock(e));
 
 	// Generate an env_id for this environment.
 	generation = (e->env_id + (1 << ENVGENSHIFT)) & ~(NENV - 1);
@@ -278,7 +393,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	// the caller makes the env runnable once it is fully set up.
+	e->env_status = ENV_NOT_RUNNABLE;
 	e->env_runs = 0;
 
 	// Clear out all the saved register state,
@@ -294,14 +410,22 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 
 	// Clear the page fault handler until user installs one.
 	e->env_pgfault_upcall = 0;
+	e->env_xstacktop = UXSTACKTOP;
+	e->env_thread_slot = 0;
 
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
+	e->env_ipc_recv_from = 0;
+
+	// and any notifications left over from the previous env in this slot.
+	e->env_notify_pending = 0;
+	e->env_notify_waiting = 0;
+	e->env_notify_bound = 0;
 
 	e->in_v86_mode = false;
 
-	// commit the allocation
-	env_free_list = e->env_link;
+	spin_unlock(env_lock(e));
+
 	*newenv_store = e;
 
 	// cprintf("[%08x] new env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
@@ -329,7 +453,9 @@ region_alloc(pde_t *pgdir, uintptr_t va, size_t len)
 		if (pp)
 			continue;
 
-		if (!(pp = page_alloc(0)))
+		// pages aren't cleared otherwise, and the segment may not fill
+		// the page.
+		if (!(pp = page_alloc(ALLOC_ZERO)))
 			goto bad;
 
 		if (page_insert(pgdir, pp, (void *) cur, PTE_U | PTE_W | PTE_P))
@@ -399,7 +525,7 @@ load_icode(struct Env *env, uint8_t *binary)
 
 	// switch to the userland page directory first, so that we can copy data
 	// directly with memcpy during load_segment
-	lcr3(PADDR(user_pgdir));
+	pgdir_load(user_pgdir);
 
 	// perform the actual loading of each segment
 	// TODO: add size checks so we don't go oob
@@ -411,7 +537,7 @@ load_icode(struct Env *env, uint8_t *binary)
 	}
 
 	// switch back to the kernel page directory
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
 
 	// initialize the trap frame according to the ELF entry point
 	// so that the environment starts executing at the right place
@@ -469,60 +595,183 @@ env_create(uint8_t *binary, enum EnvType type)
 		env->env_tf.tf_eflags |= FL_IOPL_3;
 	}
 
+	spin_lock(env_lock(env));
+	sched_set_status(env, ENV_RUNNABLE);
+	spin_unlock(env_lock(env));
+
 }
 
 //
-// Frees env e and all memory it uses.
+// Copy the address space of 'parent' into 'child', which has none yet, for
+// sys_fork. Pages which either env could write to become read-only and
+// PTE_COW in both, and page_fault_handler gives an env its own copy once it
+// writes to one. Pages marked PTE_SHARE stay shared, and the child gets a
+// fresh exception stack where parent has its own. The caller holds the
+// locks of both envs.
 //
-void
-env_free(struct Env *e)
+// Returns 0 on success, -E_NO_MEM if we run out of memory; the child's
+// address space is then incomplete.
+//
+int
+env_copy_vm(struct Env *parent, struct Env *child)
+{
+	pte_t *pt, *child_pt, pte;
+	uint32_t pdeno, pteno;
+	struct PageInfo *pp;
+	void *va;
+	int perm, result = 0;
+
+	// the child is ours alone until it runs, but parent's threads may be
+	// changing its page tables right now.
+	pgdir_lock(parent->env_pgdir);
+
+	for (pdeno = 0; pdeno < PDX(UTOP) && !result; pdeno++) {
+
+		// only look at mapped page tables
+		if (!(parent->env_pgdir[pdeno] & PTE_P))
+			continue;
+
+		pt = (pte_t *) KADDR(PTE_ADDR(parent->env_pgdir[pdeno]));
+		child_pt = NULL;
+
+		for (pteno = 0; pteno <= PTX(~0); pteno++) {
+			pte = pt[pteno];
+			va = PGADDR(pdeno, pteno, 0);
+
+			// device memory, like the frame buffer, isn't passed on.
+			if (!(pte & PTE_P) || PGNUM(PTE_ADDR(pte)) >= npages)
+				continue;
+
+			if (va == (void *) (parent->env_xstacktop - PGSIZE)) {
+				if (!(pp = page_alloc(ALLOC_ZERO))) {
+					result = -E_NO_MEM;
+					break;
+				}
+				if ((result = page_insert(child->env_pgdir, pp, va, 
+										  PTE_P | PTE_U | PTE_W))) {
+					page_free(pp);
+					break;
+				}
+				continue;
+			}
+
+			if (!child_pt) {
+				if (!(child_pt = pgdir_walk(child->env_pgdir, va, 1))) {
+					result = -E_NO_MEM;
+					break;
+				}
+				child_pt -= pteno;
+			}
+
+			perm = pte & PTE_SYSCALL;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W | PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				pt[pteno] = PTE_ADDR(pte) | perm;
+			}
+
+			page_incref(pa2page(PTE_ADDR(pte)));
+			child_pt[pteno] = PTE_ADDR(pte) | perm;
+		}
+	}
+
+	// the parent's writable pages have just become read-only.
+	tlb_flush(parent->env_pgdir);
+	pgdir_unlock(parent->env_pgdir);
+	return result;
+}
+
+//
+// Free page directory 'pgdir' and all memory mapped in it.
+//
+static void
+env_free_vm(pde_t *pgdir)
 {
 	pte_t *pt;
 	uint32_t pdeno, pteno;
 	physaddr_t pa;
 
-	// If freeing the current environment, switch to kern_pgdir
-	// before freeing the page directory, just in case the page
-	// gets reused.
-	if (e == curenv)
-		lcr3(PADDR(kern_pgdir));
-
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
 
 		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
+		if (!(pgdir[pdeno] & PTE_P))
 			continue;
 
 		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
+		pa = PTE_ADDR(pgdir[pdeno]);
 		pt = (pte_t*) KADDR(pa);
 
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+				page_remove(pgdir, PGADDR(pdeno, pteno, 0));
 		}
 
 		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
+		pgdir[pdeno] = 0;
+		page_decref(pa2page(pa));
+	}
+
+	// free our copies of the kernel's page tables (see env_setup_vm)
+	for (pdeno = PDX(UTOP); pdeno < NPDENTRIES; pdeno++) {
+		if (!(pgdir[pdeno] & PTE_P) || 
+			(pgdir[pdeno] & PTE_PS) || pdeno == PDX(UVPT))
+			continue;
+
+		pa = PTE_ADDR(pgdir[pdeno]);
+		pgdir[pdeno] = 0;
 		page_decref(pa2page(pa));
 	}
 
 	// free the page directory
-	pa = PADDR(e->env_pgdir);
+	page_decref(pa2page(PADDR(pgdir)));
+}
+
+//
+// Frees env e and all memory it uses.
+// The caller must hold env_lock(e).
+//
+void
+env_free(struct Env *e)
+{
+	int slot = e->env_thread_slot;
+
+	// If freeing the current environment, switch to kern_pgdir
+	// before freeing the page directory, just in case the page
+	// gets reused.
+	if (e == curenv)
+		pgdir_load(kern_pgdir);
+
+	// a thread's stacks go now, so that its slot can be used again.
+	if (slot > 0) {
+		pgdir_lock(e->env_pgdir);
+		page_remove(e->env_pgdir, (void *) UTHREADSTACKTOP(slot) - PGSIZE);
+		page_remove(e->env_pgdir, (void *) UTHREADXSTACKTOP(slot) - PGSIZE);
+		pgdir_unlock(e->env_pgdir);
+	}
+
+	// the rest of the address space goes with the last of the threads
+	// sharing it; see env_alloc_thread.
+	if (!page_decref_shared(pa2page(PADDR(e->env_pgdir))))
+		env_free_vm(e->env_pgdir);
 	e->env_pgdir = 0;
-	page_decref(pa2page(pa));
 
-	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	// senders queued on us can't be served anymore
+	ipc_orphan_senders(e);
+
+	// return the environment to the free list, and wake up whoever waits
+	// for us to exit (see wait())
+	sched_set_status(e, ENV_FREE);
+	futex_wake(PADDR(&e->env_status), NENV);
+	spin_lock(&env_free_lock);
 	e->env_link = env_free_list;
 	env_free_list = e;
+	spin_unlock(&env_free_lock);
 }
 
 //
-// Frees environment e.
+// Frees environment e. The caller must hold env_lock(e), which is released.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
 //
@@ -530,14 +779,17 @@ void
 env_destroy(struct Env *e)
 {
 	// If e is currently running on other CPUs, we change its state to
-	// ENV_DYING. A zombie environment will be freed the next time
-	// it traps to the kernel.
-	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+	// ENV_DYING. A zombie environment will be freed by its CPU the next time
+	// that CPU enters the kernel or switches away from it.
+	if ((e->env_status == ENV_RUNNING || e->env_status == ENV_DYING) && 
+		curenv != e) {
+		sched_set_status(e, ENV_DYING);
+		spin_unlock(env_lock(e));
 		return;
 	}
 
 	env_free(e);
+	spin_unlock(env_lock(e));
 
 	if (curenv == e) {
 		curenv = NULL;
@@ -573,7 +825,7 @@ env_pop_tf(struct Trapframe *tf)
 #define ENABLE_SLOW_CHECKS 0
 
 static void sanity_check_env(struct Env *e) {
-	int i;
+	int i, n;
 
 	if (!ENABLE_SLOW_CHECKS)
 		return;
@@ -581,13 +833,16 @@ static void sanity_check_env(struct Env *e) {
 	// a process should not use the kernel pgdir.
 	assert (e->env_pgdir != kern_pgdir);
 
-	// a process should not share a pgdir with another process
-	for (i = 0; i < NENV; i++) {
+	// a process should not share a pgdir with another process, except
+	// with its threads, each of which holds a reference to it.
+	for (i = 0, n = 1; i < NENV; i++) {
 		struct Env *other = &envs[i];
 		if (other == e)
 			continue;
-		assert (other->env_pgdir != e->env_pgdir);
+		if (other->env_pgdir == e->env_pgdir)
+			n++;
 	}
+	assert (n <= pa2page(PADDR(e->env_pgdir))->pp_ref);
 }
 
 //
@@ -606,24 +861,30 @@ env_run(struct Env *new)
 	assert (new);
 	assert (new->env_tf.tf_eflags & FL_IF);
 
-	// update the old environment's status
-	if (old && old->env_status == ENV_RUNNING)
-		old->env_status = ENV_RUNNABLE;
-	else
-		; // nothing; it's ENV_DYING or such.
-	
-	// set the new environment as the current one and update its fields
+	// the caller has claimed 'new' for this CPU already (see sched_yield),
+	// although someone may have marked it dying since then.
+	assert (new->env_status == ENV_RUNNING || new->env_status == ENV_DYING);
+
+	// set the new environment as the current one and update its fields.
 	curenv = new;
-	new->env_status = ENV_RUNNING;
 	new->env_runs++;
 
 	sanity_check_env(new);
 
-	// unlock the big kernel lock before context switching to userland
-	unlock_kernel();
+	// paths still under the big kernel lock drop it before going to userland
+	unlock_kernel_if_held();
+
+	// switch to the new address space. When we return to the env that
+	// trapped, we are still on its page directory; don't flush the TLB.
+	if (rcr3() != PADDR(new->env_pgdir))
+		pgdir_load(new->env_pgdir);
+
+	// only now that we're off the old env's page directory may other CPUs
+	// run it again (or free it, if it is dying).
+	if (old && old != new)
+		sched_put_prev(old);
 
-	// switch to the new address space
-	lcr3(PADDR(new->env_pgdir));
+	sched_arm_timer(old != new);
 
 	// context switch to user mode
 	env_pop_tf(&new->env_tf);
@@ -5,20 +5,38 @@
 
 #include <inc/env.h>
 #include <kern/cpu.h>
+#include <kern/spinlock.h>
 
 extern struct Env *envs;		// All environments
+extern struct spinlock env_locks[];	// The lock of each env, see env_lock
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
 
+// Each env's lock protects its status, its IPC fields, its saved registers
+// while it isn't running, and its address space. The locks live here rather
+// than in struct Env, which user space sees.
+static inline struct spinlock *
+env_lock(struct Env *e)
+{
+	return &env_locks[e - envs];
+}
+
 void	init_environments(void);
 void	init_trapframe(struct Trapframe *tf);
 void	env_init_percpu(void);
 int	env_alloc(struct Env **e, envid_t parent_id);
+int	env_alloc_thread(struct Env **e, struct Env *parent);
 void	env_free(struct Env *e);
+int	env_copy_vm(struct Env *parent, struct Env *child);
 void	env_create(uint8_t *binary, enum EnvType type);
-void	env_destroy(struct Env *e);	// Does not return if e == curenv
+void	env_destroy(struct Env *e);	// Does not return if e == curenv;
+					// called with env_lock(e) held
 
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
+int	env_lock_checked(struct Env *e, envid_t envid);
+int	env_lock_pair_checked(struct Env *a, envid_t a_id, 
+			      struct Env *b, envid_t b_id);
+void	env_unlock_pair(struct Env *a, struct Env *b);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
@@ -0,0 +1,198 @@
+// Wait queues keyed by physical address, for sys_futex_wait and
+// sys_futex_wake.
+//
+// An env waits on a word of user memory, as long as the word holds the
+// value it expects; the check and the queueing are atomic with respect to
+// wakeups. The word is named by its physical address, so envs that share
+// the page wait on the same word whatever address they map it at. Waiters
+// hash into NFUTEXQ queues by that address.
+//
+// Waking an env takes its lock, so wakeups move the waiters to futex_woken
+// first; futex_run_woken() makes them runnable once the caller holds no env
+// locks. That lets env_free wake the envs waiting for an env to exit.
+
+#include <inc/assert.h>
+#include <inc/error.h>
+#include <kern/futex.h>
+#include <kern/pmap.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/env.h>
+
+#define NFUTEXQ		64
+#define FUTEXQ(key)	(&futex_queues[((key) >> 2) % NFUTEXQ])
+
+// Protects the futex queues and the env_futex fields of all envs. Lock
+// order: an env's env_lock and the lock of the page directory a key was
+// found in come before futex_lock, which comes before timer_lock.
+static struct spinlock futex_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "futex_lock"
+#endif
+};
+
+static struct FutexQueue futex_queues[NFUTEXQ];
+
+// Waiters whose wakeup is due; see futex_run_woken().
+static struct FutexQueue futex_woken;
+
+static void
+fq_push(struct FutexQueue *q, struct Env *e)
+{
+	assert (!e->env_futex_q);
+
+	e->env_futex_q = q;
+	e->env_futex_next = NULL;
+	if (q->fq_tail)
+		q->fq_tail->env_futex_next = e;
+	else
+		q->fq_head = e;
+	q->fq_tail = e;
+}
+
+static void
+fq_remove(struct Env *e)
+{
+	struct FutexQueue *q = e->env_futex_q;
+	struct Env **pp, *prev = NULL;
+
+	assert (q);
+
+	for (pp = &q->fq_head; *pp != e; pp = &(*pp)->env_futex_next)
+		prev = *pp;
+	*pp = e->env_futex_next;
+	if (q->fq_tail == e)
+		q->fq_tail = prev;
+
+	e->env_futex_q = NULL;
+	e->env_futex_next = NULL;
+}
+
+//
+// Find the physical address of the word at 'va' in 'pgdir', which must be
+// mapped user-readable, and store it in *key. The caller holds the lock of
+// pgdir, and keeps it until it is done with the word.
+// Returns 0 on success, < 0 on error. Errors are:
+//	-E_INVAL if va is not 4-byte aligned, or is not ordinary memory.
+//	-E_FAULT if va is not mapped for the user.
+//
+int
+futex_key(pde_t *pgdir, const void *va, physaddr_t *key)
+{
+	pte_t *pte;
+	physaddr_t pa;
+
+	if ((uintptr_t) va % 4 || va >= (void *) ULIM)
+		return -E_INVAL;
+
+	pte = pgdir_walk(pgdir, va, 0);
+	if (!pte || (*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+		return -E_FAULT;
+
+	if (*pte & PTE_PS)
+		pa = (*pte & ~(PTSIZE - 1)) | ((uintptr_t) va & (PTSIZE - 1));
+	else
+		pa = PTE_ADDR(*pte) | PGOFF(va);
+
+	// e.g. the frame buffer; we only read words that KADDR reaches.
+	if (PGNUM(pa) >= npages)
+		return -E_INVAL;
+
+	*key = pa;
+	return 0;
+}
+
+//
+// Queue env e, whose lock the caller holds, as a waiter on 'key' if the
+// word there still holds 'val'. The caller holds the lock of the page
+// directory key was found in, and blocks e afterwards.
+// Returns 0 on success, -E_AGAIN if the word holds something else.
+//
+int
+futex_queue(struct Env *e, physaddr_t key, uint32_t val)
+{
+	int r = 0;
+
+	assert (spin_holding(env_lock(e)));
+
+	spin_lock(&futex_lock);
+	if (*(volatile uint32_t *) KADDR(key) != val)
+		r = -E_AGAIN;
+	else {
+		e->env_futex_key = key;
+		fq_push(FUTEXQ(key), e);
+	}
+	spin_unlock(&futex_lock);
+	return r;
+}
+
+//
+// Take env e, whose lock the caller holds, off the futex queue it waits on,
+// if any; e.g. because its deadline passed or it is being destroyed.
+//
+void
+futex_cancel(struct Env *e)
+{
+	assert (spin_holding(env_lock(e)));
+
+	spin_lock(&futex_lock);
+	// futex_wake counted e as woken already, so its sys_futex_wait must
+	// return 0 rather than, say, -E_TIMEOUT, or the wakeup gets lost.
+	if (e->env_futex_q == &futex_woken)
+		e->env_tf.tf_regs.reg_eax = 0;
+	if (e->env_futex_q)
+		fq_remove(e);
+	spin_unlock(&futex_lock);
+}
+
+//
+// Wake up at most 'n' of the envs waiting on 'key', oldest first. They only
+// become runnable in futex_run_woken(), so the caller may hold env locks.
+// Returns the number of envs woken.
+//
+int
+futex_wake(physaddr_t key, int n)
+{
+	struct FutexQueue *q = FUTEXQ(key);
+	struct Env *e, *next;
+	int woken = 0;
+
+	spin_lock(&futex_lock);
+	for (e = q->fq_head; e && woken < n; e = next) {
+		next = e->env_futex_next;
+		if (e->env_futex_key != key)
+			continue;
+		fq_remove(e);
+		fq_push(&futex_woken, e);
+		woken++;
+	}
+	spin_unlock(&futex_lock);
+	return woken;
+}
+
+//
+// Make the envs woken by futex_wake() runnable; their sys_futex_wait
+// returns 0. The caller must not hold any env locks.
+//
+void
+futex_run_woken(void)
+{
+	struct Env *e;
+
+	while ((e = futex_woken.fq_head)) {
+		spin_lock(env_lock(e));
+		spin_lock(&futex_lock);
+		if (e->env_futex_q != &futex_woken) {
+			// somebody else got to it first
+			spin_unlock(&futex_lock);
+			spin_unlock(env_lock(e));
+			continue;
+		}
+		fq_remove(e);
+		spin_unlock(&futex_lock);
+
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_set_status(e, ENV_RUNNABLE);
+		spin_unlock(env_lock(e));
+	}
+}
@@ -0,0 +1,15 @@
+#ifndef JOS_KERN_FUTEX_H
+#define JOS_KERN_FUTEX_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+int futex_key(pde_t *pgdir, const void *va, physaddr_t *key);
+int futex_queue(struct Env *e, physaddr_t key, uint32_t val);
+void futex_cancel(struct Env *e);
+int futex_wake(physaddr_t key, int n);
+void futex_run_woken(void);
+
+#endif /* JOS_KERN_FUTEX_H */
@@ -4,6 +4,8 @@
 
 #include <kern/graphics.h>
 
+envid_t io_events_envid;
+
 extern void *realmode_gdt;
 extern int _get_video_mode();
 extern int _set_video_mode();
@@ -12,6 +12,8 @@
 
 #ifndef __ASSEMBLER__
 
+#include <inc/env.h>
+
 void init_graphics();
 bool graphics_enabled();
 
@@ -77,6 +79,11 @@ size_t io_events_queue_cursize;
 
 void io_event_put(struct io_event *event);
 
+// The env that drains the io events queue. It is notified with
+// IO_EVENTS_NOTIFY whenever new events arrive; see sys_notify.
+extern envid_t io_events_envid;
+#define IO_EVENTS_NOTIFY 0x1
+
 
 
 struct vbe_mode_info mode_info;
@@ -5,12 +5,18 @@
 
 // after finding an IDE disk on the PCI bridge, this function finds the
 // device's io_base, which is the port number where we do PIO to talk to the
-// disk.
+// disk, and bm_base, where we drive its bus-master DMA engine. 
+// pci_func_enable also lets the controller master the bus.
 int ide_disk_attach(struct pci_func *pcif) {
 	pci_func_enable(pcif);
 	io_base = pcif->reg_base[0];
 	if (io_base == 0 || io_base == 1)
 		io_base = 0x1f0;
 	
+	// BAR 4 holds the bus-master registers of both channels; those of the
+	// primary channel, which io_base is, come first.
+	if (pcif->reg_size[4] >= 8)
+		bm_base = pcif->reg_base[4];
+	
 	return 1;
 }
@@ -43,13 +43,14 @@ void i386_init(void) {
 	// set up the IDT to handle exceptions and other interrupts
 	init_idt();
 
+	// init the subsystem responsible for keeping track of time; the LAPIC
+	// timer is calibrated against it
+	init_time();
+
 	// set up the local and global interrupt controllers
 	init_lapic();
 	init_pic();
 
-	// init the subsystem responsible for keeping track of time
-	init_time();
-
 	// scan the PCI bus and initialize any recognized devices, e.g. the network card
 	init_pci_devices();
 
@@ -151,6 +152,7 @@ static void boot_aps(void) {
 // Setup code for APs
 void mp_main(void) {
 	// We are in high EIP now, safe to switch to kern_pgdir 
+	init_memory_percpu();
 	lcr3(PADDR(kern_pgdir));
 	cprintf("SMP: CPU %d starting\n", cpunum());
 
@@ -160,8 +162,10 @@ void mp_main(void) {
 	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
 
 	// Now that we have finished some basic setup, call sched_yield()
-	// to start running processes on this CPU.  But make sure that
-	// only one CPU can enter the scheduler at a time!
+	// to start running processes on this CPU. The BSP holds the big
+	// kernel lock until it has created the initial environments, so
+	// waiting for it here keeps us from scheduling half-built envs;
+	// sched_yield() drops it again.
 	lock_kernel();
 	sched_yield();
 }
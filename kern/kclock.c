@@ -1,8 +1,10 @@
 /* See COPYRIGHT for copyright information. */
 
-/* Support for reading the NVRAM from the real-time clock. */
+/* Support for reading the NVRAM from the real-time clock, and for timing
+ * things with the PIT. */
 
 #include <inc/x86.h>
+#include <inc/assert.h>
 
 #include <kern/kclock.h>
 
@@ -20,3 +22,30 @@ mc146818_write(unsigned reg, unsigned datum)
 	outb(IO_RTC, reg);
 	outb(IO_RTC+1, datum);
 }
+
+// Count how many TSC cycles pass in 'msec' milliseconds (at most 50), as
+// timed by channel 2 of the PIT, which runs at a known frequency. Channel 2
+// is the one wired to the PC speaker; we can poll its output in port B
+// without taking any interrupts.
+uint64_t
+pit_measure_tsc(unsigned msec)
+{
+	unsigned count = PIT_FREQ / 1000 * msec;
+	uint64_t start;
+
+	assert (count <= 0xffff);
+
+	// raise the gate of channel 2 but keep the speaker off
+	outb(IO_PORTB, (inb(IO_PORTB) & ~0x02) | 0x01);
+
+	// channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+	outb(IO_PIT_CTL, 0xB0);
+	outb(IO_PIT + 2, count & 0xff);
+	outb(IO_PIT + 2, count >> 8);
+
+	// the output goes high when the count reaches zero
+	start = read_tsc();
+	while (!(inb(IO_PORTB) & 0x20))
+		;
+	return read_tsc() - start;
+}
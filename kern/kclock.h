@@ -6,6 +6,8 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 #define	IO_RTC		0x070		/* RTC port */
 
 #define	MC_NVRAM_START	0xe	/* start of NVRAM: offset 14 */
@@ -23,7 +25,13 @@
 #define NVRAM_EXT16LO	(MC_NVRAM_START + 38)	/* low byte; RTC off. 0x34 */
 #define NVRAM_EXT16HI	(MC_NVRAM_START + 39)	/* high byte; RTC off. 0x35 */
 
+#define	IO_PIT		0x040		/* 8253/8254 timer ports */
+#define	IO_PIT_CTL	(IO_PIT + 3)	/* mode/command register */
+#define	PIT_FREQ	1193182		/* PIT input clock, in Hz */
+#define	IO_PORTB	0x061		/* PIT channel 2 gate and output */
+
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
+uint64_t pit_measure_tsc(unsigned msec);
 
 #endif	// !JOS_KERN_KCLOCK_H
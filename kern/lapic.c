@@ -9,6 +9,7 @@
 #include <inc/x86.h>
 #include <kern/pmap.h>
 #include <kern/cpu.h>
+#include <kern/time.h>
 
 // Local APIC registers, divided by 4 for use as uint32_t[] indices.
 #define ID      (0x0020/4)   // ID
@@ -45,6 +46,10 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+static uint32_t timer_khz;   // Timer counts per millisecond
+
+#define CALIBRATE_USEC 10000
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +57,24 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure the rate of the timer against the TSC (see kern/time.c).
+static void
+calibrate_timer(void)
+{
+	uint64_t start;
+
+	lapicw(TIMER, MASKED);
+	lapicw(TICR, 0xffffffff);
+	start = time_usec();
+	while (time_usec() - start < CALIBRATE_USEC)
+		;
+	timer_khz = (0xffffffff - lapic[TCCR]) / (CALIBRATE_USEC / 1000);
+	lapicw(TICR, 0);
+
+	if (!timer_khz)
+		panic("calibrate_timer: the LAPIC timer doesn't tick");
+}
+
 void
 init_lapic(void)
 {
@@ -67,13 +90,14 @@ init_lapic(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down at bus frequency from lapic[TICR] and then
+	// issues an interrupt. The scheduler arms it as a one-shot, and only
+	// when some env is waiting to be run; see sched_arm_timer(). All CPUs
+	// share the bus clock, so the BSP measures its rate for everyone.
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	if (thiscpu == bootcpu)
+		calibrate_timer();
+	lapic_timer_stop();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -183,3 +207,38 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an interrupt to the single CPU with the given LAPIC ID.
+void
+lapic_ipi_cpu(uint8_t apicid, int vector)
+{
+	if (!lapic)
+		return;
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Make the timer interrupt this CPU once, 'usec' microseconds from now.
+// Re-arming a pending timer restarts the countdown.
+void
+lapic_timer_oneshot(uint32_t usec)
+{
+	uint64_t count = (uint64_t) usec * timer_khz / 1000;
+
+	if (count == 0)
+		count = 1;
+	if (count > 0xffffffff)
+		count = 0xffffffff;
+
+	lapicw(TIMER, IRQ_OFFSET + IRQ_TIMER);
+	lapicw(TICR, count);
+}
+
+// Cancel any pending timer interrupt; a zero initial count stops the timer.
+void
+lapic_timer_stop(void)
+{
+	lapicw(TICR, 0);
+}
@@ -5,6 +5,7 @@
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/e1000.h>
+#include <kern/virtio_blk.h>
 
 // Flag to do "lspci" at bootup
 static int pci_show_devs = 0;
@@ -41,6 +42,10 @@ struct pci_driver pci_attach_vendor[] = {
 	// boot.
 	{ 0x8086, 0x100e, e1000_attach },
 
+	// a transitional virtio block device, which also speaks the legacy
+	// interface; see the virtio spec, section 4.1.2.
+	{ 0x1af4, 0x1001, virtio_blk_attach },
+
 	{ 0, 0, 0 } // end
 };
 
@@ -10,8 +10,7 @@
 #include <kern/env.h>
 #include <kern/cpu.h>
 #include <kern/monitor.h>
-
-#define ENABLE_EXPENSIVE_ASSERTIONS 1
+#include <kern/spinlock.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -19,25 +18,69 @@ static size_t npages_basemem;	// Amount of base memory (in pages)
 
 // These variables are set in mem_init()
 pde_t *kern_pgdir;		// Kernel's initial page directory
+static bool have_pse;		// Whether we can map 4MB pages
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+
+// Free blocks of physical pages, by order. A block of order n consists of
+// 2^n pages and starts at a page number which is a multiple of 2^n; only
+// its first page is on the list.
+static struct PageInfo *page_free_lists[PAGE_MAX_ORDER + 1];
+
+// Each CPU keeps a few free pages of its own in a magazine, so that most
+// calls to page_alloc and page_free don't take page_lock. Magazines are
+// refilled and drained MAG_BATCH pages at a time. A magazine is used by its
+// own CPU, and emptied by any CPU that runs out of free pages; pm_lock is
+// only ever contended then. Lock order: pm_lock comes before page_lock, so
+// page_drain_locked only tries to take it.
+#define MAG_SIZE	32
+#define MAG_BATCH	16
+
+struct PageMagazine {
+	struct spinlock pm_lock;
+	struct PageInfo *pm_pages[MAG_SIZE];
+	int pm_len;
+};
+
+static struct PageMagazine magazines[NCPU];
+
+// Pages zeroed ahead of time by idle CPUs, for page_alloc(ALLOC_ZERO);
+// chained through pp_link. See page_prezero().
+#define ZERO_POOL_MAX	64
+static struct PageInfo *zero_pool;
+static int zero_pool_len;
+
+// Fill pages allocated without ALLOC_ZERO with junk, to catch uses of
+// uninitialized memory early. This costs a memset per page.
+#ifndef ENABLE_PAGE_POISONING
+#define ENABLE_PAGE_POISONING 0
+#endif
+
+// Protects page_free_lists, the zero pool and the pp_ref counts of all
+// pages.
+static struct spinlock page_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "page_lock"
+#endif
+};
+
+// The threads of an env share its page directory (see sys_sfork), so
+// holding an env's env_lock doesn't keep others from changing its page
+// tables. Code that changes a user page directory, or looks up a page in
+// it to map it elsewhere, holds the directory's pgdir lock as well. These
+// are hashed by page directory. Lock order: env_locks come before pgdir
+// locks, which come before page_lock.
+#define NPGDIRLOCK	64
+static struct spinlock pgdir_locks[NPGDIRLOCK];
 
 // the pp_link field of PageInfo structs are set to this upon allocation so
 // that we can check for invalid frees in page_free()
 #define MAGIC1 ((struct PageInfo *) 0xfffffff7)
 
-// similar idea, but for pp_ref
+// similar idea, but for pp_ref: the first page of a free block has this
+// pp_ref. The other pages of the block, and pages in magazines and the zero
+// pool, have MAGIC3.
 #define MAGIC2 0xfff0
-
-void check_not_in_page_free_list(struct PageInfo * p) {
-	if (ENABLE_EXPENSIVE_ASSERTIONS) {
-		// check that the result pginfo isn't in the list more than once
-		struct PageInfo * cur;
-		for (cur = page_free_list; cur; cur = cur->pp_link) {
-			assert (cur != p);
-		}
-	}
-}
+#define MAGIC3 0xfff1
 
 void print_pgdir(pde_t *pgdir) {
 	int i;
@@ -54,17 +97,28 @@ void print_pgdir(pde_t *pgdir) {
 
 }
 
+static void
+free_list_push(struct PageInfo *pp, int order)
+{
+	pp->pp_ref = MAGIC2;
+	pp->pp_order = order;
+	pp->pp_prev = NULL;
+	pp->pp_link = page_free_lists[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp;
+	page_free_lists[order] = pp;
+}
 
-// takes a single PageInfo struct off of the page_free_list
-static struct PageInfo * take_pageinfo() {
-	if (!page_free_list)
-		return NULL;
-	
-	struct PageInfo * result = page_free_list;
-	page_free_list = page_free_list->pp_link;
-	check_not_in_page_free_list(result);
-
-	return result;
+static void
+free_list_remove(struct PageInfo *pp, int order)
+{
+	if (pp->pp_prev)
+		pp->pp_prev->pp_link = pp->pp_link;
+	else
+		page_free_lists[order] = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_prev = pp->pp_prev;
+	pp->pp_link = pp->pp_prev = NULL;
 }
 
 
@@ -111,7 +165,6 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void mem_init_mp(void);
-static void boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, int perm);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
 static void stress_test_page_alloc(void);
@@ -119,6 +172,8 @@ static void check_kern_pgdir(void);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
 static void check_page(void);
 static void check_page_installed_pgdir(void);
+static int page_replace(pde_t *pgdir, struct PageInfo *pp, void *va, int perm,
+			struct PageInfo **old_store);
 
 bool boot_alloc_should_not_be_called;
 
@@ -133,7 +188,7 @@ bool boot_alloc_should_not_be_called;
 //
 // If we're out of memory, boot_alloc should panic.
 // This function may ONLY be used during initialization,
-// before the page_free_list list has been set up.
+// before the free lists have been set up.
 static void *
 boot_alloc(uint32_t n)
 {
@@ -198,6 +253,9 @@ init_memory(void)
 	// Find out how much memory the machine has (npages & npages_basemem).
 	i386_detect_memory();
 
+	// boot_map_region uses 4MB pages where it can, if the CPU has them.
+	init_memory_percpu();
+
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
 	kern_pgdir = (pde_t *) boot_alloc(PGSIZE);
@@ -228,11 +286,11 @@ init_memory(void)
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
-	// up the list of free physical pages. Once we've done so, all further
+	// up the lists of free physical pages. Once we've done so, all further
 	// memory management will go through the page_* functions. In
 	// particular, we can now map memory using boot_map_region
 	// or page_insert
-	page_init();
+	page_init(1);
 
 	// perform various tests of code sanity
 	check_page_free_list(1);
@@ -249,7 +307,7 @@ init_memory(void)
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
 	assert(PGOFF(pages) == 0);
-	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U);
+	boot_map_region(kern_pgdir, UPAGES, PTSIZE, PADDR(pages), PTE_U | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map the 'envs' array read-only by the user at linear address UENVS
@@ -258,7 +316,7 @@ init_memory(void)
 	//    - the new image at UENVS  -- kernel R, user R
 	//    - envs itself -- kernel RW, user NONE
 	assert(PGOFF(envs) == 0);
-	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U);
+	boot_map_region(kern_pgdir, UENVS, PTSIZE, PADDR(envs), PTE_U | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -272,7 +330,7 @@ init_memory(void)
 	//     Permissions: kernel RW, user NONE
 	assert(PGOFF(bootstack) == 0);
 	boot_map_region(kern_pgdir, KSTACKTOP - KSTKSIZE, 
-			KSTKSIZE, PADDR(bootstack), PTE_W);
+			KSTKSIZE, PADDR(bootstack), PTE_W | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE.
@@ -281,13 +339,17 @@ init_memory(void)
 	// We might not have 2^32 - KERNBASE bytes of physical memory, but
 	// we just set up the mapping anyway.
 	// Permissions: kernel RW, user NONE
-	boot_map_region(kern_pgdir, KERNBASE, KERNSIZE, 0, PTE_W);
+	//
+	// The mappings that are the same in every address space are global,
+	// so that they stay in the TLB when we switch between envs.
+	boot_map_region(kern_pgdir, KERNBASE, KERNSIZE, 0, PTE_W | PTE_G);
 
 	// make sure the MMIO region is directly accessible
 	boot_map_region(kern_pgdir, MMIOBASE, MMIOLIM - MMIOBASE, 
-					MMIOBASE, PTE_W);
+					MMIOBASE, PTE_W | PTE_G);
 
-	// set up the mapping for the LFB used in graphics
+	// set up the mapping for the LFB used in graphics. It isn't global,
+	// since sys_map_lfb maps it differently for the graphics env.
 	if (have_graphics) {
 		size_t bytes_needed = ROUNDUP(lfb_size, PGSIZE);
 		boot_map_region(kern_pgdir, (uintptr_t) LFB_BASE,
@@ -309,6 +371,8 @@ init_memory(void)
 	// kern_pgdir wrong.
 	lcr3(PADDR(kern_pgdir));
 
+	// all of physical memory is mapped now, so the rest can be handed out.
+	page_init(0);
 	check_page_free_list(0);
 
 	// entry.S set the really important flags in cr0 (including enabling
@@ -324,6 +388,23 @@ init_memory(void)
 	checks_done = 1;
 }
 
+// Enable 4MB pages and global pages on this CPU, if it has them. Every
+// CPU must do so before it loads kern_pgdir.
+void
+init_memory_percpu(void)
+{
+	uint32_t edx;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	have_pse = !!(edx & CPUID_PSE);
+	if (have_pse)
+		lcr4(rcr4() | CR4_PSE);
+
+	// without PGE the CPU simply ignores PTE_G.
+	if (edx & CPUID_PGE)
+		lcr4(rcr4() | CR4_PGE);
+}
+
 // Modify mappings in kern_pgdir to support SMP
 //   - Map the per-CPU stacks in the region [KSTACKTOP-PTSIZE, KSTACKTOP)
 //
@@ -335,7 +416,8 @@ mem_init_mp(void)
 		uintptr_t stack_top = KSTACKTOP - i*PERSTACK_SIZE;
 		uintptr_t stack_bot = stack_top - KSTKSIZE;
 		physaddr_t stack_pa = PADDR(percpu_kstacks[i]);
-		boot_map_region(kern_pgdir, stack_bot, KSTKSIZE, stack_pa, PTE_W);
+		boot_map_region(kern_pgdir, stack_bot, KSTKSIZE, stack_pa, 
+				PTE_W | PTE_G);
 
 		// Note that the area [stack_bot - KSTKGAP, stack_bot] is not mapped;
 		// it functions as a guard page. This way if a stack overflows, we'll
@@ -346,126 +428,425 @@ mem_init_mp(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept by a buddy allocator:
+// a free block is merged with its buddy, the other half of the block twice
+// its size, as soon as that is free too.
 // --------------------------------------------------------------
 
+// The end of the memory handed out by boot_alloc.
+static physaddr_t boot_alloc_mem_end;
+
+static void page_free_locked(struct PageInfo *pageinfo, int order);
+
+// whether the physical page at 'addr' is free once the kernel is set up.
+static bool
+page_is_free_at_boot(physaddr_t addr)
+{
+	// mark physical page 0 as in use
+	if (addr == 0)
+		return 0;
+
+	// the range [IOPHYSMEM, EXTPHYSMEM] is reserved for IO
+	if (addr >= IOPHYSMEM && addr < EXTPHYSMEM)
+		return 0;
+
+	// the page at MPENTRY_PADDR is used to store the code responsible for
+	// initializing non-boot processors (APs), so we should never hand it
+	// out. 
+	if (addr == MPENTRY_PADDR)
+		return 0;
+
+	// the kernel should not be mapped.
+	// it ends after its bss section, but the memory after that could have
+	// been allocated by boot_init, so we must not mark that as free,
+	// either.
+	if (addr >= KERNPHYSBASE && addr < boot_alloc_mem_end)
+		return 0;
+
+	// the MMIO region is allocated by dedicated functions
+	if (addr >= MMIOBASE && addr < MMIOLIM)
+		return 0;
+
+	// the LFB used for graphics should never be handed out
+	if (addr >= mode_info.framebuffer && addr < mode_info.framebuffer + lfb_size)
+		return 0;
+
+	return 1;
+}
+
 //
-// Initialize page structure and memory free list.
+// Initialize page structure and memory free lists.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
 // allocator functions below to allocate and deallocate physical
-// memory via the page_free_list.
+// memory.
+//
+// page_alloc writes to the pages it hands out, and entry_pgdir only maps
+// the first 4MB of physical memory. So page_init(1) only adds the free pages
+// in there, and page_init(0) adds the rest once kern_pgdir is loaded.
 //
 void
-page_init(void)
+page_init(bool only_low_memory)
 {
-	physaddr_t boot_alloc_mem_end = PADDR(boot_alloc(0));
-	boot_alloc_should_not_be_called = 1;
+	size_t i, first = 0, last = npages;
+
+	if (only_low_memory) {
+		boot_alloc_mem_end = PADDR(boot_alloc(0));
+		boot_alloc_should_not_be_called = 1;
+		last = MIN(npages, PGNUM(PTSIZE));
+	} else
+		first = PGNUM(PTSIZE);
 
-	// add the pages which represent valid free memory to the free list
+	// add the pages which represent valid free memory to the free lists
 	// however some ranges are in use (e.g. because the kernel is there) so we
-	// should avoid allocating those.
+	// should avoid allocating those. Freeing the pages one by one merges them
+	// into blocks as large as possible.
+	for (i = first; i < last; i++) {
+		if (!page_is_free_at_boot(page2pa(&pages[i])))
+			continue;
 
-	// NOTE: we *cannot* actually touch the physical pages yet! We are still
-	// using our rudimentary page table, which only maps 0-0x400000. The rest
-	// will be mapped soon.
-	size_t i;
-	for (i = 0; i < npages; i++) {
-		struct PageInfo * pageinfo = &pages[i];
+		pages[i].pp_link = MAGIC1;
+		pages[i].pp_ref = 0;
+		page_free_locked(&pages[i], 0);
+	}
+}
 
-		physaddr_t addr = page2pa(pageinfo);
+// Takes a free block of 2^order pages off the free lists, with page_lock
+// held. Returns NULL if no free block is large enough.
+static struct PageInfo *
+page_alloc_locked(int order)
+{
+	struct PageInfo *pginfo;
+	int n, i;
 
-		// mark physical page 0 as in use
-		if (addr == 0)
-			continue;
+	assert (order >= 0 && order <= PAGE_MAX_ORDER);
 
-		// the range [IOPHYSMEM, EXTPHYSMEM] is reserved for IO
-		if (addr >= IOPHYSMEM && addr < EXTPHYSMEM)
-			continue;
+	// take the smallest free block that is large enough...
+	for (n = order; n <= PAGE_MAX_ORDER && !page_free_lists[n]; n++)
+		;
+	if (n > PAGE_MAX_ORDER)
+		return NULL;
 
-		// the page at MPENTRY_PADDR is used to store the code responsible for
-		// initializing non-boot processors (APs), so we should never hand it
-		// out. 
-		if (addr == MPENTRY_PADDR)
-			continue;
+	pginfo = page_free_lists[n];
+	if (pginfo->pp_ref != MAGIC2 || pginfo->pp_order != n)
+		panic("bad free block: 0x%x", pginfo);
+	free_list_remove(pginfo, n);
 
-		// the kernel should not be mapped.
-		// it ends after its bss section, but the memory after that could have
-		// been allocated by boot_init, so we must not mark that as free,
-		// either.
-		if (addr >= KERNPHYSBASE && addr < boot_alloc_mem_end)
-			continue;
+	// ...and give back its upper halves until it has the right size.
+	while (n > order) {
+		n--;
+		free_list_push(pginfo + (1 << n), n);
+	}
 
-		// the MMIO region is allocated by dedicated functions
-		if (addr >= MMIOBASE && addr < MMIOLIM)
-			continue;
+	// page_free checks these to catch invalid frees.
+	for (i = 0; i < (1 << order); i++) {
+		pginfo[i].pp_link = MAGIC1;
+		pginfo[i].pp_ref = 0;
+	}
+
+	return pginfo;
+}
 
-		// the LFB used for graphics should never be handed out
-		if (addr >= mode_info.framebuffer && addr < mode_info.framebuffer + lfb_size)
+// Puts all pages of 'mag' back on the free lists, with page_lock held.
+static void
+mag_drain_locked(struct PageMagazine *mag)
+{
+	struct PageInfo *pginfo;
+
+	while (mag->pm_len) {
+		pginfo = mag->pm_pages[--mag->pm_len];
+		pginfo->pp_link = MAGIC1;
+		pginfo->pp_ref = 0;
+		page_free_locked(pginfo, 0);
+	}
+}
+
+// Puts the pages of the magazines and of the zero pool back on the free
+// lists, with page_lock held, so they can be allocated from any CPU, and
+// merge into larger blocks again. A magazine whose CPU is using it right
+// now is skipped. Returns whether any page went back.
+static bool
+page_drain_locked(void)
+{
+	struct PageInfo *pginfo;
+	bool drained = zero_pool != NULL;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (!spin_trylock(&magazines[i].pm_lock))
 			continue;
+		drained |= magazines[i].pm_len > 0;
+		mag_drain_locked(&magazines[i]);
+		spin_unlock(&magazines[i].pm_lock);
+	}
 
-		pageinfo->pp_ref = MAGIC2;
-		pageinfo->pp_link = page_free_list;
-		page_free_list = pageinfo;
+	while ((pginfo = zero_pool)) {
+		zero_pool = pginfo->pp_link;
+		pginfo->pp_link = MAGIC1;
+		pginfo->pp_ref = 0;
+		page_free_locked(pginfo, 0);
 	}
+	zero_pool_len = 0;
+
+	return drained;
+}
+
+// Fills freshly allocated pages as asked for by alloc_flags.
+static void
+page_fill(struct PageInfo *pginfo, int order, int alloc_flags)
+{
+	void * mem = page2kva(pginfo);
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(mem, '\0', PGSIZE << order);
+	else if (ENABLE_PAGE_POISONING)
+		// fill it with nonsense to catch uninitialized variable usage early
+		memset(mem, '\x42', PGSIZE << order);
 }
 
 //
-// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
-// returned physical page with '\0' bytes.  Does NOT increment the reference
-// count of the page - the caller must do these if necessary (either explicitly
-// or via page_insert).
+// Allocates 2^order physically contiguous pages, starting at a multiple of
+// 2^order pages. If (alloc_flags & ALLOC_ZERO), fills them with '\0' bytes.
+// Does NOT increment the reference counts of the pages - the caller must do
+// these if necessary (either explicitly or via page_insert).
+//
+// Each of the pages counts as allocated by itself, so they may be freed one
+// by one later.
+//
+// Returns the first page, or NULL if no free block is large enough.
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pginfo;
+
+	// free pages in the magazines and the zero pool can't be part of a
+	// block, so put them back and look again before giving up.
+	spin_lock(&page_lock);
+	if (!(pginfo = page_alloc_locked(order)) && page_drain_locked())
+		pginfo = page_alloc_locked(order);
+	spin_unlock(&page_lock);
+
+	// the pages are ours now, so they can be filled without holding the lock.
+	if (pginfo)
+		page_fill(pginfo, order, alloc_flags);
+	
+	return pginfo;
+}
+
+// Takes a page from this CPU's magazine, refilling it from the free lists
+// if it is empty. Returns NULL if out of free memory.
+static struct PageInfo *
+mag_alloc(void)
+{
+	struct PageMagazine *mag = &magazines[cpunum()];
+	struct PageInfo *pginfo = NULL;
+
+	spin_lock(&mag->pm_lock);
+	if (!mag->pm_len) {
+		spin_lock(&page_lock);
+		while (mag->pm_len < MAG_BATCH && (pginfo = page_alloc_locked(0))) {
+			pginfo->pp_link = NULL;
+			pginfo->pp_ref = MAGIC3;
+			mag->pm_pages[mag->pm_len++] = pginfo;
+		}
+		spin_unlock(&page_lock);
+	}
+
+	if (mag->pm_len) {
+		pginfo = mag->pm_pages[--mag->pm_len];
+		pginfo->pp_link = MAGIC1;
+		pginfo->pp_ref = 0;
+	}
+	spin_unlock(&mag->pm_lock);
+	return pginfo;
+}
+
+// Puts a page into this CPU's magazine. If it is full, its oldest pages go
+// back to the free lists first; the most recently freed ones are the most
+// likely to be in the cache still.
+static void
+mag_free(struct PageInfo *pginfo)
+{
+	struct PageMagazine *mag = &magazines[cpunum()];
+	int i;
+
+	spin_lock(&mag->pm_lock);
+	if (mag->pm_len == MAG_SIZE) {
+		spin_lock(&page_lock);
+		for (i = 0; i < MAG_BATCH; i++) {
+			mag->pm_pages[i]->pp_link = MAGIC1;
+			mag->pm_pages[i]->pp_ref = 0;
+			page_free_locked(mag->pm_pages[i], 0);
+		}
+		spin_unlock(&page_lock);
+
+		mag->pm_len -= MAG_BATCH;
+		memmove(&mag->pm_pages[0], &mag->pm_pages[MAG_BATCH], 
+				mag->pm_len * sizeof(mag->pm_pages[0]));
+	}
+
+	pginfo->pp_link = NULL;
+	pginfo->pp_ref = MAGIC3;
+	mag->pm_pages[mag->pm_len++] = pginfo;
+	spin_unlock(&mag->pm_lock);
+}
+
+// Takes a page from the zero pool, or returns NULL if it is empty.
+static struct PageInfo *
+zero_pool_take(void)
+{
+	struct PageInfo *pginfo;
+
+	if (!zero_pool)
+		return NULL;
+
+	spin_lock(&page_lock);
+	if ((pginfo = zero_pool)) {
+		zero_pool = pginfo->pp_link;
+		zero_pool_len--;
+		pginfo->pp_link = MAGIC1;
+		pginfo->pp_ref = 0;
+	}
+	spin_unlock(&page_lock);
+
+	return pginfo;
+}
+
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// Allocates a physical page.  If (alloc_flags & ALLOC_ZERO), fills the entire
+// returned physical page with '\0' bytes; such pages come from the zero pool
+// when possible. Does NOT increment the reference count of the page - the
+// caller must do these if necessary (either explicitly or via page_insert).
 //
 // Returns NULL if out of free memory.
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	struct PageInfo * pginfo = take_pageinfo();
-	if (!pginfo) {
-		if (!checks_done)
-			return NULL;
-		// for now panic, I'd rather know if this happens..
-		panic("low-memory conditions!"); 
-		// return NULL;
+	struct PageInfo * pginfo;
+
+	// the boot-time checks count on all free pages being on the free lists.
+	if (!checks_done)
+		return page_alloc_order(0, alloc_flags);
+
+	if ((alloc_flags & ALLOC_ZERO) && (pginfo = zero_pool_take()))
+		return pginfo;
+
+	if ((pginfo = mag_alloc())) {
+		page_fill(pginfo, 0, alloc_flags);
+		return pginfo;
 	}
-	
-	if (pginfo->pp_ref != MAGIC2)
-		panic("bad take_pageinfo: 0x%x", pginfo);
 
-	pginfo->pp_link = MAGIC1;
-	pginfo->pp_ref = 0;
-	
-	void * mem = page2kva(pginfo);
-	
-	if (alloc_flags & ALLOC_ZERO)
-		memset(mem, '\0', PGSIZE);
-	else
-		// fill it with nonsense to catch uninitialized variable usage early
-		memset(mem, '\x42', PGSIZE);
-	
+	// the last free pages may be in the zero pool or the magazines of
+	// other CPUs.
+	spin_lock(&page_lock);
+	if (page_drain_locked())
+		pginfo = page_alloc_locked(0);
+	spin_unlock(&page_lock);
+
+	if (pginfo)
+		page_fill(pginfo, 0, alloc_flags);
 	return pginfo;
 }
 
 //
-// Return a page to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Zeroes a free page ahead of time and puts it in the zero pool, where
+// page_alloc(ALLOC_ZERO) finds it. Idle CPUs call this from sched_halt().
+// Returns 0 if the pool is full or no page is free.
 //
-void
-page_free(struct PageInfo *pageinfo)
+bool
+page_prezero(void)
+{
+	struct PageInfo *pginfo;
+
+	if (!checks_done || zero_pool_len >= ZERO_POOL_MAX)
+		return 0;
+
+	spin_lock(&page_lock);
+	pginfo = page_alloc_locked(0);
+	spin_unlock(&page_lock);
+
+	if (!pginfo)
+		return 0;
+
+	memset(page2kva(pginfo), '\0', PGSIZE);
+
+	spin_lock(&page_lock);
+	pginfo->pp_ref = MAGIC3;
+	pginfo->pp_link = zero_pool;
+	zero_pool = pginfo;
+	zero_pool_len++;
+	spin_unlock(&page_lock);
+
+	return 1;
+}
+
+// Panics unless pageinfo is an allocated page nobody refers to.
+static void
+page_check_free(struct PageInfo *pageinfo)
 {
 	if (pageinfo->pp_link != MAGIC1)
 		panic("invalid free: 0x%x (bad pp_link)", pageinfo);
-	
+
 	if (pageinfo->pp_ref != 0)
 		panic("invalid free: 0x%x (bad pp_ref: %d)", 
 			pageinfo, pageinfo->pp_ref);
-	
-	check_not_in_page_free_list(pageinfo);
-	pageinfo->pp_link = page_free_list;
-	pageinfo->pp_ref = MAGIC2;
-	page_free_list = pageinfo;
+}
+
+// page_free_order() with page_lock held. Each merge takes one step up the
+// orders, so this doesn't depend on the number of free pages.
+static void
+page_free_locked(struct PageInfo *pageinfo, int order)
+{
+	size_t pgnum = pageinfo - pages, buddy;
+	int i;
+
+	assert (pgnum % (1 << order) == 0 && pgnum + (1 << order) <= npages);
+
+	for (i = 0; i < (1 << order); i++) {
+		page_check_free(&pageinfo[i]);
+		pageinfo[i].pp_link = NULL;
+		pageinfo[i].pp_ref = MAGIC3;
+	}
+
+	for (; order < PAGE_MAX_ORDER; order++) {
+		buddy = pgnum ^ (1 << order);
+		if (buddy >= npages || pages[buddy].pp_ref != MAGIC2 || 
+			pages[buddy].pp_order != order)
+			break;
+
+		free_list_remove(&pages[buddy], order);
+		pages[buddy].pp_ref = MAGIC3;
+		pgnum &= ~(1 << order);
+	}
+
+	free_list_push(&pages[pgnum], order);
+}
+
+//
+// Return the 2^order pages starting at pageinfo, as allocated by
+// page_alloc_order, to the free lists.
+//
+void
+page_free_order(struct PageInfo *pageinfo, int order)
+{
+	spin_lock(&page_lock);
+	page_free_locked(pageinfo, order);
+	spin_unlock(&page_lock);
+}
+
+//
+// Return a page to this CPU's magazine, or the free lists.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+void
+page_free(struct PageInfo *pageinfo)
+{
+	if (!checks_done) {
+		page_free_order(pageinfo, 0);
+		return;
+	}
+
+	page_check_free(pageinfo);
+	mag_free(pageinfo);
 }
 
 //
@@ -475,25 +856,55 @@ page_free(struct PageInfo *pageinfo)
 void
 page_decref(struct PageInfo* pinfo)
 {
+	bool unused;
+
+	spin_lock(&page_lock);
+
 	if (pinfo->pp_ref == 0)
 		panic("decref on already-free page: 0x%x", pinfo);
 
 	assert (pinfo >= pages && pinfo <= &pages[npages]);
 	assert (pinfo->pp_ref <= MAGIC2); // will detect underflows
 
-	if (--pinfo->pp_ref == 0)
+	unused = (--pinfo->pp_ref == 0);
+
+	spin_unlock(&page_lock);
+
+	// nobody else refers to the page, so nobody can take it meanwhile.
+	if (unused)
 		page_free(pinfo);
 	
 	// TODO: add scrambling (with memset of junk values) to freed pages to
 	// catch use-after-frees.
 }
 
+//
+// Drop a reference to a page, unless it is the last one. Returns whether
+// it did; if not, the caller holds the only reference, and should free the
+// page along with whatever it keeps track of.
+//
+bool
+page_decref_shared(struct PageInfo *pinfo)
+{
+	bool dropped;
+
+	spin_lock(&page_lock);
+	assert (pinfo->pp_ref > 0 && pinfo->pp_ref <= MAGIC2);
+	if ((dropped = (pinfo->pp_ref > 1)))
+		pinfo->pp_ref--;
+	spin_unlock(&page_lock);
+
+	return dropped;
+}
+
 void page_incref(struct PageInfo* pinfo) {
 	assert (pinfo >= pages && pinfo <= &pages[npages]);
 
+	spin_lock(&page_lock);
 	if (++pinfo->pp_ref >= MAGIC2) {
 		panic("page_incref overflow: 0x%x", pinfo);
 	}
+	spin_unlock(&page_lock);
 }
 
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
@@ -508,12 +919,35 @@ void page_incref(struct PageInfo* pinfo) {
 //	the page is cleared,
 //	and pgdir_walk returns a pointer into the new page table page.
 //
+// If 'va' lies in a 4MB page, and create == false, pgdir_walk returns the
+// page directory entry, which has PTE_PS set. Otherwise the 4MB page is
+// split into a page table of 4KB pages first, so that the caller can change
+// just one of them.
+//
 pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
 	// find the PTE at the first level of the tree
 	pde_t *pte = &pgdir[PDX(va)];
 
+	if (*pte & PTE_PS) {
+		if (!create)
+			return pte;
+
+		struct PageInfo *pinfo = page_alloc(0);
+		if (!pinfo)
+			return NULL;
+
+		page_incref(pinfo);
+		pte_t *pt = page2kva(pinfo);
+		int i;
+
+		for (i = 0; i < NPTENTRIES; i++)
+			pt[i] = (*pte & ~(PTSIZE - 1)) + i * PGSIZE + 
+				(PTE_FLAGS(*pte) & ~PTE_PS);
+		*pte = page2pa(pinfo) | PTE_P | PTE_W | PTE_U;
+	}
+
 	// if the PTE is not present, try to create it
 	if (!(*pte & PTE_P)) {
 		if (!create)
@@ -553,10 +987,16 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
-static void
+// Where va and pa are both 4MB-aligned, and the CPU has 4MB pages, whole
+// 4MB pages are mapped with a single page directory entry each; these
+// replace 4MB pages mapped there before, but not page tables.
+//
+void
 boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa, 
 				int perm)
 {
+	pde_t *pde;
+
 	// alignment checks
 	assert(PGOFF(size) == 0);
 	assert(PGOFF(va) == 0);
@@ -565,12 +1005,27 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa,
 
 	// fix the PTEs one at a time, looking up each and creating it if needed
 	size_t offset;
-	for (offset = 0; offset < size; offset += PGSIZE) {
+	for (offset = 0; offset < size; ) {
+		pde = &pgdir[PDX(va + offset)];
+		if (have_pse && (va + offset) % PTSIZE == 0 && 
+			(pa + offset) % PTSIZE == 0 && size - offset >= PTSIZE && 
+			(!(*pde & PTE_P) || (*pde & PTE_PS))) {
+			*pde = (pa + offset) | perm | PTE_PS | PTE_P;
+			offset += PTSIZE;
+			continue;
+		}
+
 		pte_t *pte = pgdir_walk(pgdir, (void *) (va + offset), 1);
 		if (!pte)
 			panic("boot_map_region allocation failed");
 		*pte = (pa + offset) | perm | PTE_P;
+		offset += PGSIZE;
 	}
+
+	if (perm & PTE_G)
+		tlb_flush_global();
+	else
+		tlb_flush(pgdir);
 }
 
 //
@@ -598,6 +1053,42 @@ boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, physaddr_t pa,
 //
 int
 page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
+{
+	struct PageInfo *old;
+	int result;
+
+	if ((result = page_replace(pgdir, pp, va, perm, &old)))
+		return result;
+
+	// the old page must be out of every TLB before it can be freed, and
+	// handed out again.
+	tlb_invalidate(pgdir, va);
+	if (old)
+		page_decref(old);
+	return 0;
+}
+
+//
+// Like page_insert, but leave it to the caller to flush the TLB afterwards,
+// e.g. with tlb_flush once a whole batch of mappings has been changed. The
+// page mapped at 'va' before, if any, is stored in *old_store; the caller
+// drops its reference with page_decref once the TLB has been flushed.
+//
+int
+page_insert_noflush(pde_t *pgdir, struct PageInfo *pp, void *va, int perm,
+					struct PageInfo **old_store)
+{
+	return page_replace(pgdir, pp, va, perm, old_store);
+}
+
+//
+// Map 'pp' at 'va' like page_insert, but without flushing the TLB or
+// dropping the reference of the page mapped there before. That page, if
+// any, is stored in *old_store.
+//
+static int
+page_replace(pde_t *pgdir, struct PageInfo *pp, void *va, int perm,
+			 struct PageInfo **old_store)
 {
 	// find the PTE, creating its page table if needed
 	pte_t *pte = pgdir_walk(pgdir, va, 1);
@@ -606,19 +1097,15 @@ page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm)
 	if (!pte) 
 		return -E_NO_MEM;
 
-	// update the refcnt early, so that if 'pp' is removed by 
-	// page_remove, it will not get freed.
+	// update the refcnt early, so that if 'pp' is already mapped at 'va',
+	// dropping the old mapping's reference will not free it.
 	page_incref(pp);
 
-	// in case there is already a page mapped at va, remove it.
-	// note that this flushes the TLB.
-	page_remove(pgdir, va);
+	*old_store = page_lookup(pgdir, va, NULL);
 
 	// set up the mapping to 'pa'
 	physaddr_t pa = page2pa(pp);
 	*pte = pa | perm | PTE_P;
-
-	tlb_invalidate(pgdir, va); // TODO think about whether this is needed
 	return 0;
 }
 
@@ -644,6 +1131,13 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 	if (pte_store)
 		*pte_store = pte;
 
+	// 4MB pages map device memory or the kernel's own, which have no
+	// reference counts.
+	if (*pte & PTE_PS) {
+		physaddr_t pa = (*pte & ~(PTSIZE - 1)) + PTX(va) * PGSIZE;
+		return PGNUM(pa) < npages ? pa2page(pa) : NULL;
+	}
+
 	physaddr_t pa = PTE_ADDR(*pte);
 	struct PageInfo * result = pa2page(pa);
 	assert (result->pp_ref > 0);
@@ -667,23 +1161,170 @@ page_remove(pde_t *pgdir, void *va)
 {
 	pte_t *pte = NULL;
 	struct PageInfo *pinfo = page_lookup(pgdir, va, &pte);
+
 	if (!pinfo)
 		return;
-	if (!(*pte & PTE_P))
-		return;
-	
-	// decref and free if pp_refcnt reaches 0
-	page_decref(pinfo);
 
-	// invalidate the PTE
-	assert(pte);
+	// as in page_insert, flush before the page can be freed.
 	*pte = 0;
 	tlb_invalidate(pgdir, va);
+	page_decref(pinfo);
+}
+
+//
+// Like page_remove, but leave it to the caller to flush the TLB afterwards.
+// Returns the page that was unmapped, or NULL. It still holds the mapping's
+// reference, which the caller drops with page_decref once the TLB has been
+// flushed.
+//
+struct PageInfo *
+page_remove_noflush(pde_t *pgdir, void *va)
+{
+	pte_t *pte = NULL;
+	struct PageInfo *pinfo = page_lookup(pgdir, va, &pte);
+
+	if (pinfo)
+		*pte = 0;
+	return pinfo;
+}
+
+//
+// Return the pgdir lock of page directory 'pgdir'; see pgdir_locks.
+//
+static struct spinlock *
+pgdir_lockp(pde_t *pgdir)
+{
+	return &pgdir_locks[PGNUM(PADDR(pgdir)) % NPGDIRLOCK];
+}
+
+void
+pgdir_lock(pde_t *pgdir)
+{
+	spin_lock(pgdir_lockp(pgdir));
+}
+
+void
+pgdir_unlock(pde_t *pgdir)
+{
+	spin_unlock(pgdir_lockp(pgdir));
+}
+
+//
+// Take the pgdir locks of two page directories, which may be the same one
+// or share a lock, in address order so that two CPUs can't deadlock.
+//
+void
+pgdir_lock_pair(pde_t *a, pde_t *b)
+{
+	struct spinlock *la = pgdir_lockp(a), *lb = pgdir_lockp(b);
+
+	if (la > lb) {
+		struct spinlock *tmp = la;
+		la = lb;
+		lb = tmp;
+	}
+
+	spin_lock(la);
+	if (lb != la)
+		spin_lock(lb);
+}
+
+void
+pgdir_unlock_pair(pde_t *a, pde_t *b)
+{
+	struct spinlock *la = pgdir_lockp(a), *lb = pgdir_lockp(b);
+
+	spin_unlock(la);
+	if (lb != la)
+		spin_unlock(lb);
 }
 
 //
-// Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// Load the page directory 'pgdir' on this CPU. Every switch between
+// address spaces goes through here, so that tlb_shootdown knows which
+// CPUs may hold TLB entries for which user page directory.
+//
+void
+pgdir_load(pde_t *pgdir)
+{
+	// lcr3 serializes, so other CPUs see cpu_pgdir before we can fill
+	// the TLB from 'pgdir'; and we forget it only once we're off it.
+	if (pgdir == kern_pgdir) {
+		lcr3(PADDR(kern_pgdir));
+		thiscpu->cpu_pgdir = NULL;
+	} else {
+		thiscpu->cpu_pgdir = pgdir;
+		lcr3(PADDR(pgdir));
+	}
+}
+
+// TLB shootdown requests, in a CPU's cpu_tlb_req. A request for a single
+// page is its address with TLB_REQ_PAGE set; requests that arrive while
+// another is pending become TLB_REQ_ALL.
+#define TLB_REQ_PAGE	0x1
+#define TLB_REQ_ALL	0x2
+
+//
+// Carry out this CPU's pending TLB shootdown request, if any. Called on
+// IRQ_TLB, and by CPUs that spin with interrupts disabled, which could
+// otherwise hold up the CPU waiting for them in tlb_shootdown forever.
+//
+void
+tlb_shootdown_poll(void)
+{
+	volatile uint32_t *req = &thiscpu->cpu_tlb_req;
+	uint32_t r;
+
+	// the request is cleared only once it is done; if another came in
+	// meanwhile, the cmpxchg fails and we go again.
+	while ((r = *req) != 0) {
+		if (r == TLB_REQ_ALL)
+			lcr3(rcr3());
+		else
+			invlpg((void *) (r & ~TLB_REQ_PAGE));
+		cmpxchg(req, r, 0);
+	}
+}
+
+//
+// Make the other CPUs that have 'pgdir' loaded carry out request 'req',
+// and wait until they have. If no other CPU has it loaded, this is free.
+//
+static void
+tlb_shootdown(pde_t *pgdir, uint32_t req)
+{
+	struct CpuInfo *c;
+	uint32_t targets = 0;
+	int i;
+
+	if (pgdir == kern_pgdir || ncpu == 1)
+		return;
+
+	// our page table updates must be visible before we look at which CPUs
+	// use 'pgdir'; see pgdir_load.
+	__sync_synchronize();
+
+	for (i = 0; i < ncpu; i++) {
+		c = &cpus[i];
+		if (c == thiscpu || c->cpu_pgdir != pgdir)
+			continue;
+		if (cmpxchg(&c->cpu_tlb_req, 0, req) != 0)
+			xchg(&c->cpu_tlb_req, TLB_REQ_ALL);
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_TLB);
+		targets |= 1 << i;
+	}
+
+	// a target may be shooting down entries of ours at the same time.
+	for (i = 0; i < ncpu; i++)
+		while ((targets & (1 << i)) && cpus[i].cpu_tlb_req) {
+			tlb_shootdown_poll();
+			asm volatile("pause");
+		}
+}
+
+//
+// Invalidate a TLB entry, on this CPU if the page tables being edited
+// are the ones currently in use, and on any other CPU using them.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
@@ -691,6 +1332,36 @@ tlb_invalidate(pde_t *pgdir, void *va)
 	// Flush the entry only if we're modifying the current address space.
 	if (!curenv || curenv->env_pgdir == pgdir)
 		invlpg(va);
+	tlb_shootdown(pgdir, ROUNDDOWN((uint32_t) va, PGSIZE) | TLB_REQ_PAGE);
+}
+
+//
+// Flush all of the TLB's entries for 'pgdir' on every CPU that uses it;
+// for after a batch of page_insert_noflush and page_remove_noflush calls,
+// which thus costs one IPI per CPU rather than one per page.
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	if (!curenv || curenv->env_pgdir == pgdir)
+		lcr3(rcr3());
+	tlb_shootdown(pgdir, TLB_REQ_ALL);
+}
+
+//
+// Flush all of this processor's TLB entries, including global ones, which
+// survive a reload of cr3. Needed after changing mappings marked PTE_G.
+//
+void
+tlb_flush_global(void)
+{
+	uint32_t cr4 = rcr4();
+
+	if (cr4 & CR4_PGE) {
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		lcr3(rcr3());
 }
 
 //
@@ -719,7 +1390,7 @@ mmio_map_region(physaddr_t pa, size_t size)
 	
 	// set cache-disable and write-through, so that the MMIO pages won't
 	// get cached by the CPU
-	int perm = PTE_PCD | PTE_PWT | PTE_W;
+	int perm = PTE_PCD | PTE_PWT | PTE_W | PTE_G;
 
 	// insert each of the pages into the kernel page table
 	boot_map_region(kern_pgdir, base, size, pa, perm);
@@ -748,34 +1419,52 @@ static uintptr_t user_mem_check_addr;
 int
 user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 {
-	void * cur;
-	const void * end = ROUNDUP(va + len, PGSIZE);
-	pte_t *pte = NULL;
+	uintptr_t cur = (uintptr_t) va;
+	uintptr_t end = cur + len;
+	pde_t pde;
+	pte_t pte;
 
 	perm |= PTE_P;
 
-	for (cur = (void *) va; cur < end; cur += PGSIZE) {
+	// is any of it in kernel land? This also catches ranges that wrap.
+	if (end < cur || end > ULIM) {
+		cprintf("user_mem_check failed (high addr)\n");
+		cur = MAX(cur, ULIM);
+		goto bad;
+	}
 
-		// is it in kernel land?
-		if (cur >= (void *) ULIM) {
-			cprintf("user_mem_check failed (high addr)\n");
-			goto bad;
+	// the page tables are walked by hand, rather than with page_lookup(),
+	// and each page directory entry is only looked at once.
+	pde = 0;
+	for (; cur < end; cur = ROUNDDOWN(cur, PGSIZE) + PGSIZE) {
+
+		if (cur == (uintptr_t) va || PTX(cur) == 0) {
+			pde = env->env_pgdir[PDX(cur)];
+			if ((pde & perm) != perm) {
+				cprintf("user_mem_check failed (not present)\n");
+				goto bad;
+			}
+
+			// a 4MB page is checked as a whole.
+			if (pde & PTE_PS) {
+				cur = ROUNDDOWN(cur, PTSIZE) + PTSIZE - PGSIZE;
+				continue;
+			}
 		}
 
-		// look it up in the page table
-		struct PageInfo* pageinfo = page_lookup(env->env_pgdir, cur, &pte);
+		pte = ((pte_t *) KADDR(PTE_ADDR(pde)))[PTX(cur)];
 
 		// is it not present?
-		if (!pageinfo) {
+		if (!(pte & PTE_P)) {
 			cprintf("user_mem_check failed (not present)\n");
 			goto bad;
 		}
 
 		// are the permissions wrong?
-		if ((*pte & perm) != perm) {
+		if ((pte & perm) != perm) {
 			cprintf("user_mem_check failed "
 					"(bad perms; perm: 0x%x, pte: 0x%x)\n",
-					perm, *pte);
+					perm, pte);
 			goto bad;
 		}
 	}
@@ -783,8 +1472,7 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 	return 0;
 
 bad:
-	user_mem_check_addr = 
-		(uintptr_t) ((cur == va) ? cur : ROUNDDOWN(cur, PGSIZE));
+	user_mem_check_addr = (cur == (uintptr_t) va) ? cur : ROUNDDOWN(cur, PGSIZE);
 	return -E_FAULT;
 }
 
@@ -801,6 +1489,7 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 	if (user_mem_check(env, va, len, perm | PTE_U) < 0) {
 		cprintf("[%08x] user_mem_check assertion failure for "
 			"va %08x\n", env->env_id, user_mem_check_addr);
+		spin_lock(env_lock(env));
 		env_destroy(env);	// might not return
 	}
 }
@@ -810,62 +1499,97 @@ user_mem_assert(struct Env *env, const void *va, size_t len, int perm)
 // Checking functions.
 // --------------------------------------------------------------
 
+// Returns the number of free pages.
+static int
+count_free_pages(void)
+{
+	struct PageInfo *pp;
+	int order, nfree = 0;
+
+	for (order = 0; order <= PAGE_MAX_ORDER; order++)
+		for (pp = page_free_lists[order]; pp; pp = pp->pp_link)
+			nfree += 1 << order;
+	return nfree;
+}
+
+// Allocates all free memory, so that the checks below can run out of it.
+// Returns the blocks, chained through pp_prev, which isn't used while they
+// are allocated.
+static struct PageInfo *
+steal_free_pages(void)
+{
+	struct PageInfo *pp, *stolen = NULL;
+	int order;
+
+	for (order = PAGE_MAX_ORDER; order >= 0; order--)
+		while ((pp = page_alloc_order(order, 0))) {
+			pp->pp_order = order;
+			pp->pp_prev = stolen;
+			stolen = pp;
+		}
+	return stolen;
+}
+
+// Frees the blocks taken by steal_free_pages().
+static void
+return_free_pages(struct PageInfo *stolen)
+{
+	struct PageInfo *next;
+
+	for (; stolen; stolen = next) {
+		next = stolen->pp_prev;
+		page_free_order(stolen, stolen->pp_order);
+	}
+}
+
 //
-// Check that the pages on the page_free_list are reasonable.
+// Check that the pages on the page_free_lists are reasonable.
 //
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *pp, *block;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	int nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
-
-	if (!page_free_list)
-		panic("'page_free_list' is a null pointer!");
-
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
-
-	// if there's a page that shouldn't be on the free list,
-	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	int order, i;
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
-
-		// (new test for lab 4)
-		assert(page2pa(pp) != MPENTRY_PADDR);
-
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+	for (order = 0; order <= PAGE_MAX_ORDER; order++) {
+		for (block = page_free_lists[order]; block; block = block->pp_link) {
+			// check that we didn't corrupt the free lists themselves
+			assert(block >= pages);
+			assert(block + (1 << order) <= pages + npages);
+			assert(((char *) block - (char *) pages) % sizeof(*block) == 0);
+			assert((block - pages) % (1 << order) == 0);
+			assert(block->pp_ref == MAGIC2 && block->pp_order == order);
+
+			for (i = 0; i < (1 << order); i++) {
+				pp = block + i;
+				assert(i == 0 || pp->pp_ref == MAGIC3);
+
+				// if there's a page that shouldn't be free, try to
+				// make sure it eventually causes trouble.
+				if (PDX(page2pa(pp)) < pdx_limit)
+					memset(page2kva(pp), 0x97, 128);
+
+				// check a few pages that shouldn't be free
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || 
+					   (char *) page2kva(pp) >= first_free_page);
+
+				// (new test for lab 4)
+				assert(page2pa(pp) != MPENTRY_PADDR);
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
 	}
 
 	assert(nfree_basemem > 0);
@@ -890,8 +1614,7 @@ check_page_alloc(void)
 		panic("'pages' is a null pointer!");
 
 	// check number of free pages
-	for (pp = page_free_list, nfree = 0; pp; pp = pp->pp_link)
-		++nfree;
+	nfree = count_free_pages();
 
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
@@ -907,8 +1630,7 @@ check_page_alloc(void)
 	assert(page2pa(pp2) < npages*PGSIZE);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -936,17 +1658,23 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
 	page_free(pp1);
 	page_free(pp2);
 
+	// blocks are aligned to their size, and their pages may be freed one by
+	// one, after which they merge again.
+	assert((pp = page_alloc_order(2, 0)));
+	assert((pp - pages) % 4 == 0);
+	assert(pp[3].pp_link == MAGIC1);
+	for (i = 0; i < 4; i++)
+		page_free(&pp[i]);
+
 	// number of free pages should be the same
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		--nfree;
-	assert(nfree == 0);
+	assert(count_free_pages() == nfree);
 }
 
 //
@@ -1033,6 +1761,8 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 	pgdir = &pgdir[PDX(va)];
 	if (!(*pgdir & PTE_P))
 		return ~0;
+	if (*pgdir & PTE_PS)
+		return (*pgdir & ~(PTSIZE - 1)) + PTX(va) * PGSIZE;
 	p = (pte_t*) KADDR(PTE_ADDR(*pgdir));
 	if (!(p[PTX(va)] & PTE_P))
 		return ~0;
@@ -1063,8 +1793,7 @@ check_page(void)
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	fl = steal_free_pages();
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -1184,7 +1913,7 @@ check_page(void)
 	pp0->pp_ref = 0;
 
 	// give free list back
-	page_free_list = fl;
+	return_free_pages(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -54,19 +54,40 @@ enum {
 };
 
 void	init_memory(void);
+void	init_memory_percpu(void);
 
-void	page_init(void);
+// The largest block page_alloc_order hands out: 2^10 pages, or 4MB.
+#define PAGE_MAX_ORDER	10
+
+void	page_init(bool only_low_memory);
 struct PageInfo *page_alloc(int alloc_flags);
+struct PageInfo *page_alloc_order(int order, int alloc_flags);
 void	page_free(struct PageInfo *pp);
+void	page_free_order(struct PageInfo *pp, int order);
+bool	page_prezero(void);
 int	page_insert(pde_t *pgdir, struct PageInfo *pp, void *va, int perm);
+int	page_insert_noflush(pde_t *pgdir, struct PageInfo *pp, void *va,
+			    int perm, struct PageInfo **old_store);
 void	page_remove(pde_t *pgdir, void *va);
+struct PageInfo *page_remove_noflush(pde_t *pgdir, void *va);
 struct PageInfo *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
+bool	page_decref_shared(struct PageInfo *pp);
 void page_incref(struct PageInfo* pinfo);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_flush_global(void);
+void	tlb_shootdown_poll(void);
+void	pgdir_load(pde_t *pgdir);
+void	pgdir_lock(pde_t *pgdir);
+void	pgdir_unlock(pde_t *pgdir);
+void	pgdir_lock_pair(pde_t *a, pde_t *b);
+void	pgdir_unlock_pair(pde_t *a, pde_t *b);
 
 void *	mmio_map_region(physaddr_t pa, size_t size);
+void	boot_map_region(pde_t *pgdir, uintptr_t va, size_t size, 
+			physaddr_t pa, int perm);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
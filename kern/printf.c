@@ -5,6 +5,15 @@
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/spinlock.h>
+
+// Serializes console output so that messages from different CPUs don't get
+// interleaved (or corrupt the console's cursor state).
+static struct spinlock cons_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "cons_lock"
+#endif
+};
 
 static void
 putch(int ch, int *cnt)
@@ -17,8 +26,16 @@ int
 vcprintf(const char *fmt, va_list ap)
 {
 	int cnt = 0;
+	extern const char *panicstr;
+
+	// once we panic, the lock may be held by a halted CPU or by ourselves.
+	bool locking = !panicstr;
 
+	if (locking)
+		spin_lock(&cons_lock);
 	vprintfmt((void*)putch, &cnt, fmt, ap);
+	if (locking)
+		spin_unlock(&cons_lock);
 	return cnt;
 }
 
@@ -4,30 +4,378 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/sched.h>
+#include <kern/cpu.h>
+#include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
+#include <kern/syscall.h>
 
-void sched_halt(void);
+void sched_halt(void) __attribute__((noreturn));
 
-// look circularly through 'envs' starting after 'curenv' until we find a
-// runnable environment.
-struct Env * get_next_runnable_env() {
-	int i, offset = curenv ? (curenv - envs) : 0;
-	for (i = 0; i < NENV; i++) {
-		struct Env * env = &envs[(i + offset) % NENV];
-		if (env->env_status == ENV_RUNNABLE)
-			return env;
+// Length of a time slice, in microseconds
+#define TIME_SLICE	10000
+
+// Protects the run queues of all CPUs. Lock order: an env's env_lock comes
+// before ipc_lock, futex_lock, timer_lock, sched_lock, and then page_lock
+// and cons_lock.
+static struct spinlock sched_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "sched_lock"
+#endif
+};
+
+static void
+rq_push(struct RunQueue *rq, struct Env *e)
+{
+	assert (!e->env_rq);
+
+	e->env_rq = rq;
+	e->env_rq_next = NULL;
+	e->env_rq_prev = rq->rq_tail;
+	if (rq->rq_tail)
+		rq->rq_tail->env_rq_next = e;
+	else
+		rq->rq_head = e;
+	rq->rq_tail = e;
+	rq->rq_len++;
+}
+
+static void
+rq_remove(struct Env *e)
+{
+	struct RunQueue *rq = e->env_rq;
+
+	assert (rq && rq->rq_len > 0);
+
+	if (e->env_rq_prev)
+		e->env_rq_prev->env_rq_next = e->env_rq_next;
+	else
+		rq->rq_head = e->env_rq_next;
+	if (e->env_rq_next)
+		e->env_rq_next->env_rq_prev = e->env_rq_prev;
+	else
+		rq->rq_tail = e->env_rq_prev;
+	rq->rq_len--;
+
+	e->env_rq = NULL;
+	e->env_rq_next = e->env_rq_prev = NULL;
+}
+
+// Is some env waiting for a CPU, on any run queue? We read the queue
+// lengths without sched_lock, as a hint.
+static bool
+envs_waiting(void)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_rq.rq_len)
+			return 1;
+	return 0;
+}
+
+// Send a halted CPU to look at the run queues, so that it can steal the env
+// we just queued. Halted CPUs have no timer of their own running, see
+// sched_halt().
+static void
+wake_idle_cpu(void)
+{
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		if (&cpus[i] == thiscpu || cpus[i].cpu_status != CPU_HALTED)
+			continue;
+		lapic_ipi_cpu(cpus[i].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+		return;
+	}
+}
+
+// The body of sched_set_status; an env that becomes runnable is queued on
+// CPU 'c'.
+static void
+set_status_on(struct Env *e, unsigned status, struct CpuInfo *c)
+{
+	assert (spin_holding(env_lock(e)));
+
+	// an env that sleeps, waits to send, or waits for a notification or a
+	// futex is ENV_NOT_RUNNABLE; if anything
+	// else happens to it, it's no longer waiting.
+	if (e->env_tw && status != ENV_NOT_RUNNABLE)
+		timer_remove(e);
+	if (e->env_ipc_waitq && status != ENV_NOT_RUNNABLE)
+		ipc_cancel_send(e);
+	if (e->env_futex_q && status != ENV_NOT_RUNNABLE)
+		futex_cancel(e);
+	if (status != ENV_NOT_RUNNABLE)
+		e->env_notify_waiting = 0;
+
+	spin_lock(&sched_lock);
+
+	if (e->env_rq)
+		rq_remove(e);
+
+	e->env_status = status;
+
+	if (status == ENV_RUNNABLE)
+		rq_push(&c->cpu_rq, e);
+
+	spin_unlock(&sched_lock);
+
+	if (status != ENV_RUNNABLE)
+		return;
+
+	// we'll arm our own timer on the way back to userland (see
+	// sched_arm_timer), but an idle CPU could take the env right away.
+	if (c == thiscpu)
+		wake_idle_cpu();
+	else
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+}
+
+//
+// Change the status of env e, keeping the run queues in sync. An env is
+// on a run queue exactly when its status is ENV_RUNNABLE. Envs that become
+// runnable are queued on the current CPU, which is usually the one that
+// just woke them up and so has their state in its cache.
+// The caller must hold env_lock(e).
+//
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	set_status_on(e, status, thiscpu);
+}
+
+//
+// Make the new env e runnable on the least loaded CPU, rather than on ours.
+// This is for threads, which have nothing in our cache that the thread
+// creating them doesn't need more, and should run alongside it.
+// The caller must hold env_lock(e).
+//
+void
+sched_spread(struct Env *e)
+{
+	struct CpuInfo *best = thiscpu;
+	int i, load, best_load = -1;
+
+	// the loads are read without sched_lock, as a hint.
+	for (i = 0; i < ncpu; i++) {
+		if (cpus[i].cpu_status == CPU_UNUSED)
+			continue;
+		load = cpus[i].cpu_rq.rq_len + (cpus[i].cpu_status != CPU_HALTED);
+		if (best_load < 0 || load < best_load) {
+			best = &cpus[i];
+			best_load = load;
+		}
+	}
+
+	set_status_on(e, ENV_RUNNABLE, best);
+}
+
+// Take an env off 'rq' for this CPU to run, scanning from the head or the
+// tail. Envs whose lock is busy are being changed by someone else right now,
+// so we skip them rather than wait, which would invert the lock order.
+// Called with sched_lock held.
+static struct Env *
+rq_claim(struct RunQueue *rq, bool from_tail)
+{
+	struct Env *e;
+
+	for (e = from_tail ? rq->rq_tail : rq->rq_head; e; 
+		 e = from_tail ? e->env_rq_prev : e->env_rq_next) {
+		if (!spin_trylock(env_lock(e)))
+			continue;
+
+		assert (e->env_status == ENV_RUNNABLE);
+		rq_remove(e);
+		e->env_status = ENV_RUNNING;
+		spin_unlock(env_lock(e));
+		return e;
 	}
 	return NULL;
 }
 
-// This function implements simple round-robin scheduling.
+// take the environment that has waited longest on this CPU's queue.
+static struct Env *
+pop_local_env(void)
+{
+	return rq_claim(&thiscpu->cpu_rq, 0);
+}
+
+// our own queue is empty, so take work from the busiest other CPU. We take
+// from the tail of its queue since those envs would have waited the longest
+// there anyway.
+static struct Env *
+steal_env(void)
+{
+	struct RunQueue *victim = NULL;
+	int i;
+
+	for (i = 0; i < ncpu; i++) {
+		struct RunQueue *rq = &cpus[i].cpu_rq;
+		if (rq == &thiscpu->cpu_rq || !rq->rq_len)
+			continue;
+		if (!victim || rq->rq_len > victim->rq_len)
+			victim = rq;
+	}
+
+	if (!victim)
+		return NULL;
+
+	return rq_claim(victim, 1);
+}
+
+//
+// This CPU has switched off the page directory of 'e', the env it was
+// running, so the env may now run elsewhere: put it back on our queue if it
+// is still runnable, or free it if someone killed it meanwhile.
+//
+void
+sched_put_prev(struct Env *e)
+{
+	spin_lock(env_lock(e));
+	if (e->env_status == ENV_RUNNING)
+		sched_set_status(e, ENV_RUNNABLE);
+	else if (e->env_status == ENV_DYING)
+		env_free(e);
+	spin_unlock(env_lock(e));
+}
+
+//
+// Block curenv, whose env_lock the caller holds, and run something else.
+// The caller has recorded what curenv waits for; whoever wakes it takes the
+// lock and makes it runnable again. We leave curenv's address space before
+// dropping the lock, since after that another CPU may run it, or free it.
+//
+void
+sched_block(void)
+{
+	struct Env *e = curenv;
+
+	assert (spin_holding(env_lock(e)));
+
+	// we were killed while on our way here; don't go to sleep.
+	if (e->env_status == ENV_DYING)
+		env_destroy(e);
+
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+
+	pgdir_load(kern_pgdir);
+	curenv = NULL;
+	spin_unlock(env_lock(e));
+
+	sched_yield();
+}
+
+// Program this CPU's LAPIC timer to fire at time 'when' (in microseconds),
+// or not at all if 'when' is ~0.
+static void
+set_timer(uint64_t when)
+{
+	struct CpuInfo *c = thiscpu;
+	uint64_t now;
+
+	if (when == ~0ULL) {
+		if (c->cpu_timer_at) {
+			lapic_timer_stop();
+			c->cpu_timer_at = 0;
+		}
+		return;
+	}
+
+	if (when == c->cpu_timer_at)
+		return;
+
+	now = time_usec();
+	lapic_timer_oneshot(when > now ? MIN(when - now, 0xffffffffULL) : 0);
+	c->cpu_timer_at = when;
+}
+
+//
+// Program this CPU's timer on the way back to userland. Preempting the
+// env we are about to run is only worth it if some other env is waiting
+// for a CPU; otherwise we let it run until it blocks or yields. A 'fresh'
+// env, i.e. one we are switching to, gets a whole time slice rather than
+// what was left of the previous one. Either way the timer also has to fire
+// for the first env sleeping on this CPU's timer wheel.
+//
+void
+sched_arm_timer(bool fresh)
+{
+	struct CpuInfo *c = thiscpu;
+
+	if (!envs_waiting())
+		c->cpu_slice_end = 0;
+	else if (!c->cpu_slice_end || fresh)
+		c->cpu_slice_end = time_usec() + TIME_SLICE;
+
+	set_timer(MIN(c->cpu_slice_end ? c->cpu_slice_end : ~0ULL,
+		      timer_next()));
+}
+
+//
+// Block curenv like sched_block(), and run env e on this CPU right away
+// instead of picking the next env from the run queues. This is for IPC,
+// where curenv has just handed e some work and will wait for the answer.
+// The caller holds the env_locks of both curenv and e, which must be
+// blocked (ENV_NOT_RUNNABLE).
+//
+void
+sched_switch_to(struct Env *e)
+{
+	struct Env *old = curenv;
+
+	assert (e != old);
+	assert (spin_holding(env_lock(old)) && spin_holding(env_lock(e)));
+	assert (e->env_status == ENV_NOT_RUNNABLE);
+
+	// we were killed on our way here; e will run some other time.
+	if (old->env_status == ENV_DYING) {
+		sched_set_status(e, ENV_RUNNABLE);
+		spin_unlock(env_lock(e));
+		env_destroy(old);
+	}
+
+	sched_set_status(old, ENV_NOT_RUNNABLE);
+	sched_set_status(e, ENV_RUNNING);
+
+	// as in sched_block(), leave old's address space before dropping its
+	// lock; we go straight to e's rather than through kern_pgdir.
+	pgdir_load(e->env_pgdir);
+	curenv = NULL;
+	spin_unlock(env_lock(old));
+	spin_unlock(env_lock(e));
+
+	env_run(e);
+}
+
+// This function implements round-robin scheduling over per-CPU run queues.
 // It chooses a user environment and runs it. It never returns.
 void
 sched_yield(void)
 {
-	// Search through 'envs' for an ENV_RUNNABLE environment in
-	// circular fashion starting just after the env this CPU was
-	// last running.  Switch to the first such environment found.
-	struct Env * env = get_next_runnable_env();
+	struct Env *env;
+
+	// syscalls still under the big kernel lock may end up here.
+	unlock_kernel_if_held();
+
+	// senders whose receiver went away need to learn about it, and envs
+	// waiting for it to exit too.
+	ipc_wake_orphans();
+	futex_run_woken();
+
+	spin_lock(&sched_lock);
+
+	// Run the env at the head of this CPU's queue. The env we were running
+	// gets queued at the tail by env_run() if it is still runnable, so each
+	// queue is served round-robin.
+	env = pop_local_env();
+
+	// If our queue is empty, try to steal from another CPU.
+	if (!env)
+		env = steal_env();
+
+	spin_unlock(&sched_lock);
 
 	// If no envs are runnable, but the environment previously
 	// running on this CPU is still ENV_RUNNING, it's okay to
@@ -47,12 +395,16 @@ sched_yield(void)
 	sched_halt();
 }
 
-// Halt this CPU when there is nothing to do. Wait until the
-// timer interrupt wakes it up. This function never returns.
+// Halt this CPU when there is nothing to do. A halted CPU takes no timer
+// interrupts other than for the envs sleeping on its timer wheel; it sleeps
+// until one of those is due, until another CPU queues an env and sends it
+// IRQ_RESCHED, or until a device interrupt arrives. This function never
+// returns.
 //
 void
 sched_halt(void)
 {
+	struct Env *old = curenv;
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
@@ -64,6 +416,7 @@ sched_halt(void)
 			break;
 	}
 	if (i == NENV) {
+		lock_kernel();
 		cprintf("No runnable environments in the system!\n");
 		while (1)
 			monitor(NULL);
@@ -71,15 +424,30 @@ sched_halt(void)
 
 	// Mark that no environment is running on this CPU
 	curenv = NULL;
-	lcr3(PADDR(kern_pgdir));
+	pgdir_load(kern_pgdir);
+
+	// the env we were running is dying, or was left ENV_RUNNING by mistake;
+	// sort it out now that we're off its page directory.
+	if (old)
+		sched_put_prev(old);
+
+	// no env to preempt, but envs sleeping here must still be woken.
+	thiscpu->cpu_slice_end = 0;
+	set_timer(timer_next());
+
+	// use the idle time to zero pages for page_alloc(ALLOC_ZERO), until
+	// some env wants a CPU.
+	while (!envs_waiting() && page_prezero())
+		;
 
-	// Mark that this CPU is in the HALT state, so that when
-	// timer interupts come in, we know we should re-acquire the
-	// big kernel lock
+	// Mark that this CPU is in the HALT state
 	xchg(&thiscpu->cpu_status, CPU_HALTED);
 
-	// Release the big kernel lock as if we were "leaving" the kernel
-	unlock_kernel();
+	// An env may have been queued after we looked, by a CPU which then saw
+	// that we weren't halted and so didn't wake us. Wake ourselves; the
+	// interrupt arrives as soon as the halt loop enables interrupts.
+	if (envs_waiting())
+		lapic_ipi_cpu(thiscpu->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
 
 	// Reset stack pointer, enable interrupts and then halt.
 	asm volatile (
@@ -92,5 +460,6 @@ sched_halt(void)
 		"hlt\n"
 		"jmp 1b\n"
 	: : "a" (thiscpu->cpu_ts.ts_esp0));
+	panic("hlt loop exited");  /* mostly to placate the compiler */
 }
 
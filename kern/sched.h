@@ -6,7 +6,16 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_set_status(struct Env *e, unsigned status);
+void sched_spread(struct Env *e);
+void sched_put_prev(struct Env *e);
+void sched_arm_timer(bool fresh);
+void sched_block(void) __attribute__((noreturn));
+void sched_switch_to(struct Env *e) __attribute__((noreturn));
+
 #endif	// !JOS_KERN_SCHED_H
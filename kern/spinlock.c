@@ -8,6 +8,7 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/kdebug.h>
+#include <kern/pmap.h>
 
 // The big kernel lock
 struct spinlock kernel_lock = {
@@ -34,22 +35,22 @@ get_caller_pcs(uint32_t pcs[])
 	for (; i < 10; i++)
 		pcs[i] = 0;
 }
+#endif
 
 // Check whether this CPU is holding the lock.
-static int
-holding(struct spinlock *lock)
+int
+spin_holding(struct spinlock *lock)
 {
 	return lock->locked && lock->cpu == thiscpu;
 }
-#endif
 
 void
 __spin_initlock(struct spinlock *lk, char *name)
 {
 	lk->locked = 0;
+	lk->cpu = 0;
 #ifdef DEBUG_SPINLOCK
 	lk->name = name;
-	lk->cpu = 0;
 #endif
 }
 
@@ -61,21 +62,45 @@ void
 spin_lock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
-	if (holding(lk))
+	if (spin_holding(lk))
 		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
 #endif
 
 	// The xchg is atomic.
 	// It also serializes, so that reads after acquire are not
 	// reordered before it. 
-	while (xchg(&lk->locked, 1) != 0)
+	// The holder may be waiting for us to flush our TLB; see tlb_shootdown.
+	while (xchg(&lk->locked, 1) != 0) {
+		tlb_shootdown_poll();
 		asm volatile ("pause");
+	}
+
+	lk->cpu = thiscpu;
 
 	// Record info about lock acquisition for debugging.
 #ifdef DEBUG_SPINLOCK
+	get_caller_pcs(lk->pcs);
+#endif
+}
+
+// Try to acquire the lock once, without spinning.
+// Returns 1 if the lock was acquired, 0 otherwise.
+int
+spin_trylock(struct spinlock *lk)
+{
+#ifdef DEBUG_SPINLOCK
+	if (spin_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding", cpunum(), lk->name);
+#endif
+
+	if (xchg(&lk->locked, 1) != 0)
+		return 0;
+
 	lk->cpu = thiscpu;
+#ifdef DEBUG_SPINLOCK
 	get_caller_pcs(lk->pcs);
 #endif
+	return 1;
 }
 
 // Release the lock.
@@ -83,7 +108,7 @@ void
 spin_unlock(struct spinlock *lk)
 {
 #ifdef DEBUG_SPINLOCK
-	if (!holding(lk)) {
+	if (!spin_holding(lk)) {
 		int i;
 		uint32_t pcs[10];
 		// Nab the acquiring EIP chain before it gets released
@@ -104,8 +129,8 @@ spin_unlock(struct spinlock *lk)
 	}
 
 	lk->pcs[0] = 0;
-	lk->cpu = 0;
 #endif
+	lk->cpu = 0;
 
 	// The xchg instruction is atomic (i.e. uses the "lock" prefix) with
 	// respect to any other instruction which references the same memory.
@@ -9,11 +9,11 @@
 // Mutual exclusion lock.
 struct spinlock {
 	unsigned locked;       // Is the lock held?
+	struct CpuInfo *cpu;   // The CPU holding the lock.
 
 #ifdef DEBUG_SPINLOCK
 	// For debugging:
 	char *name;            // Name of lock.
-	struct CpuInfo *cpu;   // The CPU holding the lock.
 	uintptr_t pcs[10];     // The call stack (an array of program counters)
 	                       // that locked the lock.
 #endif
@@ -22,6 +22,8 @@ struct spinlock {
 void __spin_initlock(struct spinlock *lk, char *name);
 void spin_lock(struct spinlock *lk);
 void spin_unlock(struct spinlock *lk);
+int spin_trylock(struct spinlock *lk);
+int spin_holding(struct spinlock *lk);
 
 #define spin_initlock(lock)   __spin_initlock(lock, #lock)
 
@@ -45,4 +47,13 @@ unlock_kernel(void)
 	asm volatile("pause");
 }
 
+// Paths that still run under the big kernel lock can end up in env_run() or
+// sched_yield(), neither of which returns, so those drop it on their way out.
+static inline void
+unlock_kernel_if_held(void)
+{
+	if (spin_holding(&kernel_lock))
+		unlock_kernel();
+}
+
 #endif
@@ -14,21 +14,32 @@
 #include <kern/console.h>
 #include <kern/sched.h>
 #include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/futex.h>
 #include <kern/e1000.h>
+#include <kern/virtio_blk.h>
 #include <kern/copy.h>
+#include <kern/picirq.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
-// Destroys the environment on memory errors.
-static void
+// Returns 0 on success, -E_FAULT if the string can't be read.
+static int
 sys_cputs(const char *s, size_t len)
 {
-	// Check that the user has permission to read memory [s, s+len).
-	// Destroy the environment if not.
-	user_mem_assert(curenv, s, len, 0);
+	char buf[256];
+	size_t n;
+	int r;
 
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	// a thread of ours may unmap the string while we print it, so it is
+	// copied in piece by piece rather than read in place.
+	for (; len; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if ((r = copy_from_user(buf, (void *) s, n)))
+			return r;
+		cprintf("%.*s", n, buf);
+	}
+	return 0;
 }
 
 // Read a character from the system console without blocking.
@@ -59,6 +70,8 @@ sys_env_destroy(envid_t envid)
 
 	if ((r = envid2env(envid, &e, 1)) < 0)
 		return r;
+	if ((r = env_lock_checked(e, envid)) < 0)
+		return r;
 
 	env_destroy(e);
 	return 0;
@@ -85,7 +98,8 @@ sys_exofork(void)
 	if ((result = env_alloc(&env, pid)))
 		return result;
 	
-	env->env_status = ENV_NOT_RUNNABLE;
+	// env_alloc leaves the env ENV_NOT_RUNNABLE, which is what we want.
+	assert (env->env_status == ENV_NOT_RUNNABLE);
 
 	// the env should have the same register state as the parent
 	env->env_tf = curenv->env_tf;
@@ -96,6 +110,162 @@ sys_exofork(void)
 	return env->env_id;
 }
 
+// Create a child of curenv which is a copy of it: it gets the same
+// registers and page fault upcall, and a copy-on-write copy of curenv's
+// address space (see env_copy_vm). In the child, sys_fork returns 0. Unlike
+// with sys_exofork, the child is runnable right away.
+//
+// Returns envid of the child, or < 0 on error. Errors are those of
+// sys_exofork.
+static envid_t
+sys_fork(void)
+{
+	struct Env *env = NULL;
+	int result;
+
+	if ((result = env_alloc(&env, curenv->env_id)))
+		return result;
+	if ((result = env_lock_pair_checked(curenv, 0, env, env->env_id))) {
+		// only curenv could have destroyed the child, so it's still ours.
+		spin_lock(env_lock(env));
+		env_free(env);
+		spin_unlock(env_lock(env));
+		return result;
+	}
+
+	env->env_tf = curenv->env_tf;
+	env->env_tf.tf_regs.reg_eax = 0;
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env->env_xstacktop = curenv->env_xstacktop;
+
+	if ((result = env_copy_vm(curenv, env))) {
+		spin_unlock(env_lock(curenv));
+		env_free(env);
+		spin_unlock(env_lock(env));
+		return result;
+	}
+
+	sched_set_status(env, ENV_RUNNABLE);
+	env_unlock_pair(curenv, env);
+	return env->env_id;
+}
+
+// Adjust the chain of saved frame pointers, starting at 'ebp', in 'copy',
+// a copy of curenv's stack page at 'base', for the copy to be mapped 'delta'
+// bytes away. The chain is followed as long as it stays in the page.
+static void
+sfork_relocate_frames(uint32_t *copy, uintptr_t base, uintptr_t ebp,
+					  int32_t delta)
+{
+	uintptr_t next;
+
+	while (ebp >= base && ebp < base + PGSIZE && ebp % 4 == 0) {
+		next = copy[(ebp - base) / 4];
+		if (next <= ebp || next >= base + PGSIZE)
+			return;
+		copy[(ebp - base) / 4] = next + delta;
+		ebp = next;
+	}
+}
+
+// Create a thread of curenv: a child which shares curenv's address space
+// instead of getting a copy of it, but runs on a stack and exception stack
+// of its own, in the first free thread slot (see UTHREADSTACKTOP). The child
+// starts out with a copy of the stack page curenv is on, moved to the top of
+// its stack, so that it can return from the functions on it; pointers into
+// the stack other than the saved frame pointers are not adjusted. In the
+// child, sys_sfork returns 0. The child is runnable right away, preferably
+// on another CPU.
+//
+// Returns envid of the child, or < 0 on error. Errors are:
+//	-E_NO_FREE_ENV if no free environment or thread slot is left.
+//	-E_NO_MEM on memory exhaustion.
+//	-E_FAULT if curenv's stack pointer isn't on a mapped page.
+static envid_t
+sys_sfork(void)
+{
+	struct PageInfo *stack = NULL, *xstack = NULL;
+	struct Env *env = NULL;
+	uintptr_t base, top;
+	int32_t delta;
+	int slot, result;
+
+	if (!(stack = page_alloc(ALLOC_ZERO)))
+		return -E_NO_MEM;
+	if (!(xstack = page_alloc(ALLOC_ZERO))) {
+		page_free(stack);
+		return -E_NO_MEM;
+	}
+
+	// copy the stack before taking curenv's lock, which faults may need.
+	base = ROUNDDOWN(curenv->env_tf.tf_esp, PGSIZE);
+	if ((result = copy_from_user(page2kva(stack), (void *) base, PGSIZE)) ||
+		(result = env_alloc_thread(&env, curenv))) {
+		page_free(stack);
+		page_free(xstack);
+		return result;
+	}
+	if ((result = env_lock_pair_checked(curenv, 0, env, env->env_id))) {
+		// only curenv could have destroyed the thread, so it's still ours.
+		spin_lock(env_lock(env));
+		env_free(env);
+		spin_unlock(env_lock(env));
+		page_free(stack);
+		page_free(xstack);
+		return result;
+	}
+
+	// a slot is free while nothing is mapped at its stack.
+	pgdir_lock(curenv->env_pgdir);
+	for (slot = 1; slot < NTHREAD; slot++) {
+		top = UTHREADSTACKTOP(slot);
+		if (!page_lookup(curenv->env_pgdir, (void *) top - PGSIZE, NULL))
+			break;
+	}
+	if (slot == NTHREAD)
+		result = -E_NO_FREE_ENV;
+	else if (!(result = page_insert(curenv->env_pgdir, xstack, 
+						(void *) UTHREADXSTACKTOP(slot) - PGSIZE, 
+						PTE_P | PTE_U | PTE_W))) {
+		// from here on, unmapping the exception stack frees it.
+		xstack = NULL;
+		if ((result = page_insert(curenv->env_pgdir, stack, 
+						(void *) top - PGSIZE, PTE_P | PTE_U | PTE_W)))
+			page_remove(curenv->env_pgdir, 
+						(void *) UTHREADXSTACKTOP(slot) - PGSIZE);
+	}
+	pgdir_unlock(curenv->env_pgdir);
+
+	if (result) {
+		spin_unlock(env_lock(curenv));
+		env_free(env);
+		spin_unlock(env_lock(env));
+		if (xstack)
+			page_free(xstack);
+		page_free(stack);
+		return result;
+	}
+
+	delta = (top - PGSIZE) - base;
+	sfork_relocate_frames(page2kva(stack), base, 
+						  curenv->env_tf.tf_regs.reg_ebp, delta);
+
+	env->env_tf = curenv->env_tf;
+	env->env_tf.tf_regs.reg_eax = 0;
+	env->env_tf.tf_esp += delta;
+	if (env->env_tf.tf_regs.reg_ebp >= base && 
+		env->env_tf.tf_regs.reg_ebp < base + PGSIZE)
+		env->env_tf.tf_regs.reg_ebp += delta;
+
+	env->env_pgfault_upcall = curenv->env_pgfault_upcall;
+	env->env_xstacktop = UTHREADXSTACKTOP(slot);
+	env->env_thread_slot = slot;
+
+	sched_spread(env);
+	env_unlock_pair(curenv, env);
+	return env->env_id;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -103,6 +273,7 @@ sys_exofork(void)
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if status is not a valid status for an environment.
+//	-E_INVAL if envid is currently running (or dying) on some CPU.
 static int
 sys_env_set_status(envid_t envid, int status)
 {
@@ -114,9 +285,17 @@ sys_env_set_status(envid_t envid, int status)
 
 	if ((result = envid2env(envid, &env, 1)))
 		return result;
+	if ((result = env_lock_checked(env, envid)))
+		return result;
 	
-	env->env_status = status;
-	return 0;
+	if (env->env_status == ENV_RUNNABLE || 
+		env->env_status == ENV_NOT_RUNNABLE)
+		sched_set_status(env, status);
+	else
+		result = -E_INVAL;
+
+	spin_unlock(env_lock(env));
+	return result;
 }
 
 // Set envid's trap frame to 'tf'.
@@ -126,24 +305,30 @@ sys_env_set_status(envid_t envid, int status)
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
+//	-E_FAULT if tf can't be read.
 static int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
 	struct Env *env = NULL;
+	struct Trapframe ktf;
 	int result = 0;
 
-	// Remember to check whether the user has supplied us with a good address
-	user_mem_assert(curenv, tf, sizeof(*tf), 0);
-
+	// copy the Trapframe in before taking any lock, which faults may need.
+	if ((result = copy_from_user(&ktf, tf, sizeof(ktf))))
+		return result;
 
 	if ((result = envid2env(envid, &env, 1)))
 		return result;
+	if ((result = env_lock_checked(env, envid)))
+		return result;
 	
-	env->env_tf = *tf;
+	env->env_tf = ktf;
 
 	// make sure it runs with privilege level 3 and interrupts enabled
 	env->env_tf.tf_eflags = 0;
 	init_trapframe(&env->env_tf);
+
+	spin_unlock(env_lock(env));
 	return 0;
 }
 
@@ -167,7 +352,10 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	// make sure this is a valid user-space address
 	user_mem_assert(env, func, 1, PTE_U | PTE_P);
 
+	if ((result = env_lock_checked(env, envid)))
+		return result;
 	env->env_pgfault_upcall = func;
+	spin_unlock(env_lock(env));
 	return 0;
 }
 
@@ -209,11 +397,20 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	if ((result = envid2env(envid, &env, 1)))
 		return result;
 	
+	// zero the page before taking the env's lock
 	if (!(pinfo = page_alloc(ALLOC_ZERO)))
 		return -E_NO_MEM;
 	
+	if ((result = env_lock_checked(env, envid))) {
+		page_free(pinfo);
+		return result;
+	}
+
 	// page_insert increases the page refcnt on success
+	pgdir_lock(env->env_pgdir);
 	if ((result = page_insert(env->env_pgdir, pinfo, va, perm))) {
+		pgdir_unlock(env->env_pgdir);
+		spin_unlock(env_lock(env));
 		page_free(pinfo);
 		return result;
 	}
@@ -221,6 +418,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	assert (page_lookup(env->env_pgdir, va, NULL));
 	assert (pinfo->pp_ref == 1);
 
+	pgdir_unlock(env->env_pgdir);
+	spin_unlock(env_lock(env));
 	return 0;
 }
 
@@ -267,16 +466,26 @@ sys_page_map(envid_t src_envid, void *src_va,
 	if ((dst_perm & PTE_SYSCALL) != dst_perm)
 		return -E_INVAL;
 	
+	if ((result = env_lock_pair_checked(src_env, src_envid, 
+										dst_env, dst_envid)))
+		return result;
+
+	// other threads of either env mustn't unmap the page in between.
+	pgdir_lock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+
 	if (!(pinfo = page_lookup(src_env->env_pgdir, src_va, &pte)))
-		return -E_INVAL;
-	
-	assert (pinfo->pp_ref > 0);
+		result = -E_INVAL;
 	
 	// we do not allow setting a read-only page to be writable
-	if ((dst_perm & PTE_W) && !(*pte & PTE_W))
-		return -E_INVAL;
+	else if ((dst_perm & PTE_W) && !(*pte & PTE_W))
+		result = -E_INVAL;
 	
-	return page_insert(dst_env->env_pgdir, pinfo, dst_va, dst_perm);
+	else
+		result = page_insert(dst_env->env_pgdir, pinfo, dst_va, dst_perm);
+
+	pgdir_unlock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+	env_unlock_pair(src_env, dst_env);
+	return result;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -297,11 +506,122 @@ sys_page_unmap(envid_t envid, void *va)
 
 	if ((result = envid2env(envid, &env, 1)))
 		return result;
+	if ((result = env_lock_checked(env, envid)))
+		return result;
 	
+	pgdir_lock(env->env_pgdir);
 	page_remove(env->env_pgdir, va);
+	pgdir_unlock(env->env_pgdir);
+
+	spin_unlock(env_lock(env));
 	return 0;
 }
 
+// Apply one operation of sys_page_batch, without flushing the TLB. The
+// caller holds the locks of both envs and of their page directories. The
+// page unmapped or replaced by the operation, if any, is stored in
+// *old_store, for the caller to drop once it has flushed the TLB.
+static int
+page_op_apply(struct Env *src_env, struct Env *dst_env, struct PageOp *op,
+			  struct PageInfo **old_store)
+{
+	struct PageInfo *pinfo = NULL;
+	pte_t *pte = NULL;
+
+	*old_store = NULL;
+	if (op->po_op == PGOP_UNMAP) {
+		if (op->po_dst_va >= (void *) UTOP || PGOFF(op->po_dst_va) != 0)
+			return -E_INVAL;
+		*old_store = page_remove_noflush(dst_env->env_pgdir, op->po_dst_va);
+		return 0;
+	}
+
+	if (op->po_op == PGOP_PROTECT)
+		op->po_dst_va = op->po_va;
+	else if (op->po_op != PGOP_MAP)
+		return -E_INVAL;
+
+	// the same checks as in sys_page_map
+	if (op->po_va >= (void *) UTOP || PGOFF(op->po_va) != 0)
+		return -E_INVAL;
+	if (op->po_dst_va >= (void *) UTOP || PGOFF(op->po_dst_va) != 0)
+		return -E_INVAL;
+	if ((op->po_perm & (PTE_U | PTE_P)) != (PTE_U | PTE_P))
+		return -E_INVAL;
+	if ((op->po_perm & PTE_SYSCALL) != op->po_perm)
+		return -E_INVAL;
+
+	if (!(pinfo = page_lookup(src_env->env_pgdir, op->po_va, &pte)))
+		return -E_INVAL;
+	if ((op->po_perm & PTE_W) && !(*pte & PTE_W))
+		return -E_INVAL;
+
+	return page_insert_noflush(op->po_op == PGOP_MAP ? dst_env->env_pgdir :
+							   src_env->env_pgdir, 
+							   pinfo, op->po_dst_va, op->po_perm, old_store);
+}
+
+// Apply the 'nops' page mapping operations in 'ops' to the address spaces
+// of src_envid and dst_envid, in order, flushing the TLB only once at the
+// end. See struct PageOp for the operations; each one is checked like the
+// corresponding single syscall. nops may be at most PGOP_MAX.
+//
+// This is how fork and spawn copy an address space without a system call
+// for every page.
+//
+// Return 0 on success, < 0 on error; the operations before the one that
+// failed have been applied. Errors are those of sys_page_map and
+// sys_page_unmap, and:
+//	-E_INVAL if nops > PGOP_MAX, or an operation is unknown.
+//	-E_FAULT if ops can't be read.
+static int
+sys_page_batch(envid_t src_envid, envid_t dst_envid, struct PageOp *uops,
+			   size_t nops)
+{
+	struct PageOp ops[PGOP_MAX];
+	struct PageInfo *old[PGOP_MAX];
+	struct Env *src_env = NULL, *dst_env = NULL;
+	int result = 0;
+	size_t i, j;
+
+	if (nops > PGOP_MAX)
+		return -E_INVAL;
+
+	// take a copy first: the operations may well change the mapping of
+	// the pages that hold them.
+	if ((result = copy_from_user(ops, uops, nops * sizeof(struct PageOp))))
+		return result;
+
+	if ((result = envid2env(src_envid, &src_env, 1)))
+		return result;
+	if ((result = envid2env(dst_envid, &dst_env, 1)))
+		return result;
+	if ((result = env_lock_pair_checked(src_env, src_envid, 
+										dst_env, dst_envid)))
+		return result;
+
+	pgdir_lock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+
+	for (i = 0; i < nops && !result; i++)
+		result = page_op_apply(src_env, dst_env, &ops[i], &old[i]);
+
+	// the pages that were unmapped may only be freed, and handed out
+	// again, e.g. as page tables by a later operation, once they are out
+	// of every TLB.
+	if (i > 0) {
+		tlb_flush(src_env->env_pgdir);
+		if (dst_env->env_pgdir != src_env->env_pgdir)
+			tlb_flush(dst_env->env_pgdir);
+	}
+	for (j = 0; j < i; j++)
+		if (old[j])
+			page_decref(old[j]);
+
+	pgdir_unlock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+	env_unlock_pair(src_env, dst_env);
+	return result;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -342,63 +662,213 @@ sys_page_unmap(envid_t envid, void *va)
 //		address space.
 
 #define TRANSMITTING(va) (va < (void *) UTOP)
+
+// Protects the send queues of all envs (env_ipc_sendq, and env_ipc_waitq of
+// the envs on them), and the queue of orphaned senders below. Lock order:
+// env_locks come before ipc_lock, which comes before timer_lock.
+static struct spinlock ipc_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "ipc_lock"
+#endif
+};
+
+// Senders that were queued on an env which has been freed since. They get
+// woken up with -E_BAD_ENV by ipc_wake_orphans().
+static struct IpcQueue ipc_orphans;
+
+static void
+iq_push(struct IpcQueue *q, struct Env *e)
+{
+	assert (!e->env_ipc_waitq);
+
+	e->env_ipc_waitq = q;
+	e->env_ipc_waitq_next = NULL;
+	if (q->iq_tail)
+		q->iq_tail->env_ipc_waitq_next = e;
+	else
+		q->iq_head = e;
+	q->iq_tail = e;
+}
+
+static void
+iq_remove(struct Env *e)
+{
+	struct IpcQueue *q = e->env_ipc_waitq;
+	struct Env **pp, *prev = NULL;
+
+	assert (q);
+
+	for (pp = &q->iq_head; *pp != e; pp = &(*pp)->env_ipc_waitq_next)
+		prev = *pp;
+	*pp = e->env_ipc_waitq_next;
+	if (q->iq_tail == e)
+		q->iq_tail = prev;
+
+	e->env_ipc_waitq = NULL;
+	e->env_ipc_waitq_next = NULL;
+}
+
+//
+// Take env e, whose lock the caller holds, off the send queue it waits on,
+// if any; e.g. because it is being destroyed.
+//
+void
+ipc_cancel_send(struct Env *e)
+{
+	assert (spin_holding(env_lock(e)));
+
+	spin_lock(&ipc_lock);
+	if (e->env_ipc_waitq)
+		iq_remove(e);
+	spin_unlock(&ipc_lock);
+}
+
+//
+// Env e, whose lock the caller holds, is being freed. The senders queued on
+// it can't be woken up from here, since we'd need their locks as well, so
+// leave that to ipc_wake_orphans().
+//
+void
+ipc_orphan_senders(struct Env *e)
+{
+	struct Env *s;
+
+	assert (spin_holding(env_lock(e)));
+
+	spin_lock(&ipc_lock);
+	while ((s = e->env_ipc_sendq.iq_head)) {
+		iq_remove(s);
+		iq_push(&ipc_orphans, s);
+	}
+	spin_unlock(&ipc_lock);
+}
+
+//
+// Fail the sends of the senders orphaned by ipc_orphan_senders(). The
+// scheduler calls this, holding no env locks.
+//
+void
+ipc_wake_orphans(void)
+{
+	struct Env *e;
+
+	while ((e = ipc_orphans.iq_head)) {
+		spin_lock(env_lock(e));
+		spin_lock(&ipc_lock);
+		if (e->env_ipc_waitq != &ipc_orphans) {
+			// somebody else got to it first
+			spin_unlock(&ipc_lock);
+			spin_unlock(env_lock(e));
+			continue;
+		}
+		iq_remove(e);
+		spin_unlock(&ipc_lock);
+
+		e->env_tf.tf_regs.reg_eax = -E_BAD_ENV;
+		sched_set_status(e, ENV_RUNNABLE);
+		spin_unlock(env_lock(e));
+	}
+}
+
+// If env e, which is receiving from anyone, has bound its notifications to
+// IPC (see sys_bind_notify) and has some pending, hand them over as a
+// message from envid 0 whose value holds the bits, and return 1. The caller
+// holds e's lock.
+static bool
+ipc_take_notify(struct Env *e)
+{
+	if (!e->env_notify_bound || !e->env_notify_pending)
+		return 0;
+
+	e->env_ipc_from = 0;
+	e->env_ipc_value = e->env_notify_pending;
+	e->env_ipc_perm = 0;
+	e->env_notify_pending = 0;
+	return 1;
+}
+
+// Check that src_env may send the page at src_va with permissions perm, and
+// return it in *pinfo_store; see sys_ipc_try_send. The caller holds
+// src_env's lock.
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *src_va, unsigned perm)
+ipc_check_send(struct Env *src_env, void *src_va, unsigned perm,
+			   struct PageInfo **pinfo_store)
 {
-	struct Env *dst_env = NULL;
-	struct PageInfo* pinfo = NULL;
 	pte_t *pte = NULL;
+
+	*pinfo_store = NULL;
+
+	// if we're not sending a page, perm should be 0
+	if (!TRANSMITTING(src_va))
+		return perm ? -E_INVAL : 0;
+
+	if (PGOFF(src_va) != 0)
+		return -E_INVAL;
+
+	if (!(*pinfo_store = page_lookup(src_env->env_pgdir, src_va, &pte)))
+		// page must exist in src_env
+		return -E_INVAL;
+
+	if ((perm & PTE_SYSCALL) != perm)
+		// don't allow nonstandard permissions
+		return -E_INVAL;
+
+	if ((perm & PTE_W) && !(*pte & PTE_W))
+		// don't allow change from read-only to writable
+		return -E_INVAL;
+
+	if (!(perm & PTE_U) || !(perm & PTE_P))
+		// require setting user and present bits
+		return -E_INVAL;
+
+	return 0;
+}
+
+// The body of sys_ipc_try_send: hand a message from src_env to dst_env, but
+// leave it to the caller to make dst_env runnable. The caller holds the
+// locks of both.
+static int
+ipc_deliver_locked(struct Env *src_env, struct Env *dst_env, uint32_t value,
+				   void *src_va, unsigned perm)
+{
+	struct PageInfo* pinfo = NULL;
 	int result = 0;
 
-	if ((result = envid2env(envid, &dst_env, 0)))
-		return result;
-	
 	if (!dst_env->env_ipc_recving) {
 		return -E_IPC_NOT_RECV;
 	}
-	
-	// if curenv wants to send a page of data, do additional checks
-	if (TRANSMITTING(src_va)) {
-		if (PGOFF(src_va) != 0)
-			return -E_INVAL;
-
-		if (!(pinfo = page_lookup(curenv->env_pgdir, src_va, &pte)))
-			// page must exist in curenv
-			return -E_INVAL;
 
-		if ((perm & PTE_SYSCALL) != perm)
-			// don't allow nonstandard permissions
-			return -E_INVAL;
+	// dst_env may only be waiting for a reply from someone else
+	if (dst_env->env_ipc_recv_from &&
+		dst_env->env_ipc_recv_from != src_env->env_id) {
+		return -E_IPC_NOT_RECV;
+	}
 
-		if ((perm & PTE_W) && !(*pte & PTE_W))
-			// don't allow change from read-only to writable
-			return -E_INVAL;
+	// other threads of either env mustn't unmap the page in between.
+	pgdir_lock_pair(src_env->env_pgdir, dst_env->env_pgdir);
 
-		if (!(perm & PTE_U) || !(perm & PTE_P))
-			// require setting user and present bits
-			return -E_INVAL;
-	} 
-	// if we're not sending a page, perm should be 0
-	else if (perm) {
-		return -E_INVAL;
-	}
+	result = ipc_check_send(src_env, src_va, perm, &pinfo);
 
 	// if the recipient wants a page of data, and one is being sent, then
 	// update the mapping
-	if (TRANSMITTING(dst_env->env_ipc_dst_va) && TRANSMITTING(src_va)) {
+	if (!result && TRANSMITTING(dst_env->env_ipc_dst_va) && 
+		TRANSMITTING(src_va)) {
 		assert (pinfo);
 		assert (PGOFF(dst_env->env_ipc_dst_va) == 0);
-		if ((result = page_insert(dst_env->env_pgdir, pinfo, 
-							 dst_env->env_ipc_dst_va, perm)))
-			return result;
+		result = page_insert(dst_env->env_pgdir, pinfo, 
+							 dst_env->env_ipc_dst_va, perm);
 	}
 
+	pgdir_unlock_pair(src_env->env_pgdir, dst_env->env_pgdir);
+	if (result)
+		return result;
+
 
 	// if we get here, the send succeeds and we can update the values of
 	// dst_env
 	assert (dst_env->env_ipc_recving);
 	dst_env->env_ipc_recving = 0;
-	dst_env->env_ipc_from = curenv->env_id;
+	dst_env->env_ipc_from = src_env->env_id;
 	dst_env->env_ipc_value = value;
 
 	if (TRANSMITTING(dst_env->env_ipc_dst_va) && TRANSMITTING(src_va))
@@ -410,15 +880,169 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *src_va, unsigned perm)
 		// setting env_ipc_perm to 0.
 		dst_env->env_ipc_perm = 0;
 	
-	// make sure that the ipc_recv syscall in the dst_env returns 0, then mark
-	// it as runnable
-	assert (dst_env->env_status == ENV_NOT_RUNNABLE);
+	// make sure that the ipc_recv syscall in the dst_env returns 0
 	dst_env->env_tf.tf_regs.reg_eax = 0;
-	dst_env->env_status = ENV_RUNNABLE;
 
 	return 0;
 }
 
+// Queue curenv on the send queue of dst_env, which isn't receiving, and
+// block until dst_env picks the message up in ipc_recv_queued(). If 'call',
+// curenv then goes on to wait for dst_env's reply; see sys_ipc_call. The
+// caller holds the locks of both envs.
+static void __attribute__((noreturn))
+ipc_block_send(struct Env *dst_env, uint32_t value, void *src_va, 
+			   unsigned perm, bool call)
+{
+	assert (dst_env != curenv);
+
+	curenv->env_ipc_send_value = value;
+	curenv->env_ipc_send_va = src_va;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_call = call;
+
+	// if we are woken up some other way, the message wasn't sent.
+	curenv->env_tf.tf_regs.reg_eax = -E_IPC_NOT_RECV;
+
+	spin_lock(&ipc_lock);
+	iq_push(&dst_env->env_ipc_sendq, curenv);
+	spin_unlock(&ipc_lock);
+
+	spin_unlock(env_lock(dst_env));
+	sched_block();
+}
+
+//
+// curenv is about to block receiving, with env_ipc_dst_va and
+// env_ipc_recv_from set up: first take the oldest message it accepts off
+// its send queue, if any, and wake up the sender (unless that sender waits
+// for a reply now). The caller holds curenv's lock, which we may drop
+// for a while to take the sender's lock in the right order.
+// Returns 0 if a message was received, or -E_IPC_NOT_RECV if there are
+// none, in which case the caller can block without dropping the lock:
+// senders queue themselves only while holding it.
+//
+static int
+ipc_recv_queued(void)
+{
+	struct Env *src;
+	envid_t src_id;
+	int r;
+
+	assert (spin_holding(env_lock(curenv)));
+
+	if (!curenv->env_ipc_recv_from && ipc_take_notify(curenv))
+		return 0;
+
+	while (1) {
+		spin_lock(&ipc_lock);
+		for (src = curenv->env_ipc_sendq.iq_head; src; 
+			 src = src->env_ipc_waitq_next)
+			if (!curenv->env_ipc_recv_from ||
+				src->env_id == curenv->env_ipc_recv_from)
+				break;
+		src_id = src ? src->env_id : 0;
+		spin_unlock(&ipc_lock);
+
+		if (!src)
+			return -E_IPC_NOT_RECV;
+
+		// take the sender's lock; if that has to wait, take both locks in
+		// address order instead.
+		if (!spin_trylock(env_lock(src))) {
+			spin_unlock(env_lock(curenv));
+			if (env_lock_pair_checked(curenv, 0, src, src_id)) {
+				spin_lock(env_lock(curenv));
+				continue;
+			}
+		} else if (src->env_id != src_id) {
+			spin_unlock(env_lock(src));
+			continue;
+		}
+
+		// the queue may have changed while we didn't hold the locks.
+		spin_lock(&ipc_lock);
+		if (src->env_ipc_waitq != &curenv->env_ipc_sendq) {
+			spin_unlock(&ipc_lock);
+			spin_unlock(env_lock(src));
+			continue;
+		}
+		iq_remove(src);
+		spin_unlock(&ipc_lock);
+
+		curenv->env_ipc_recving = 1;
+		r = ipc_deliver_locked(src, curenv, src->env_ipc_send_value,
+							   src->env_ipc_send_va, src->env_ipc_send_perm);
+		if (r)
+			curenv->env_ipc_recving = 0;
+
+		if (!r && src->env_ipc_send_call) {
+			// the sender now waits for our reply
+			src->env_ipc_recving = 1;
+			src->env_ipc_recv_from = curenv->env_id;
+		} else {
+			src->env_tf.tf_regs.reg_eax = r;
+			sched_set_status(src, ENV_RUNNABLE);
+		}
+		spin_unlock(env_lock(src));
+
+		if (!r)
+			return 0;
+	}
+}
+
+static int
+sys_ipc_try_send(envid_t envid, uint32_t value, void *src_va, unsigned perm)
+{
+	struct Env *dst_env = NULL;
+	int result = 0;
+
+	if ((result = envid2env(envid, &dst_env, 0)))
+		return result;
+	if ((result = env_lock_pair_checked(curenv, 0, dst_env, envid)))
+		return result;
+
+	if (!(result = ipc_deliver_locked(curenv, dst_env, value, src_va, perm)))
+		sched_set_status(dst_env, ENV_RUNNABLE);
+
+	env_unlock_pair(curenv, dst_env);
+	return result;
+}
+
+// Like sys_ipc_try_send, but if envid isn't receiving, block until it is.
+// Senders waiting for the same env are served in FIFO order.
+//
+// Returns 0 once the message was received, or < 0 on error. The errors are
+// those of sys_ipc_try_send, except that instead of -E_IPC_NOT_RECV:
+//	-E_INVAL if envid is curenv itself.
+//	-E_BAD_ENV if envid is destroyed while we wait.
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *src_va, unsigned perm)
+{
+	struct Env *dst_env = NULL;
+	struct PageInfo *pinfo;
+	int result = 0;
+
+	if ((result = envid2env(envid, &dst_env, 0)))
+		return result;
+	if (dst_env == curenv)
+		return -E_INVAL;
+	if ((result = env_lock_pair_checked(curenv, 0, dst_env, envid)))
+		return result;
+
+	result = ipc_deliver_locked(curenv, dst_env, value, src_va, perm);
+	if (!result)
+		sched_set_status(dst_env, ENV_RUNNABLE);
+
+	// report bad arguments now rather than once we're picked up.
+	if (result == -E_IPC_NOT_RECV &&
+		!(result = ipc_check_send(curenv, src_va, perm, &pinfo)))
+		ipc_block_send(dst_env, value, src_va, perm, 0);
+
+	env_unlock_pair(curenv, dst_env);
+	return result;
+}
+
 // This syscall blocks waiting until another env sends the current one a
 // value. If (dst_va < UTOP) then curenv wants to receive a page of data at
 // that address. Otherwise only a value is transmitted.
@@ -431,14 +1055,133 @@ sys_ipc_recv(void *dst_va)
 	if (TRANSMITTING(dst_va) && PGOFF(dst_va) != 0)
 		return -E_INVAL;
 	
-	curenv->env_ipc_recving = 1;
+	spin_lock(env_lock(curenv));
+	curenv->env_ipc_recv_from = 0;
 	curenv->env_ipc_dst_va = dst_va;
-	curenv->env_status = ENV_NOT_RUNNABLE;
+
+	// a sender may be waiting for us already.
+	if (!ipc_recv_queued()) {
+		spin_unlock(env_lock(curenv));
+		return 0;
+	}
+
+	curenv->env_ipc_recving = 1;
 
 	// this function never returns; instead eax of curenv is set when another
 	// process does a sys_ipc_try_send. That's also when curenv will be
 	// scheduled back in.
-	sched_yield();
+	sched_block();
+}
+
+// Send a message to envid like sys_ipc_send, then block until envid, and
+// only envid, sends a reply; dst_va is as for sys_ipc_recv. Since envid is
+// about to work on our request, we switch to it directly instead of going
+// through the run queues. If envid isn't receiving, we queue up as
+// sys_ipc_send does.
+//
+// Returns 0 once the reply has arrived, or < 0 if the send fails; the
+// errors are those of sys_ipc_send and sys_ipc_recv.
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *src_va, unsigned perm,
+			 void *dst_va)
+{
+	struct Env *dst_env = NULL;
+	struct PageInfo *pinfo;
+	int result = 0;
+
+	if (TRANSMITTING(dst_va) && PGOFF(dst_va) != 0)
+		return -E_INVAL;
+
+	if ((result = envid2env(envid, &dst_env, 0)))
+		return result;
+	if (dst_env == curenv)
+		return -E_INVAL;
+	if ((result = env_lock_pair_checked(curenv, 0, dst_env, envid)))
+		return result;
+
+	curenv->env_ipc_recv_from = dst_env->env_id;
+	curenv->env_ipc_dst_va = dst_va;
+
+	result = ipc_deliver_locked(curenv, dst_env, value, src_va, perm);
+
+	// if dst_env isn't receiving, queue up; ipc_recv_queued() sets our
+	// env_ipc_recving once it has taken the message. Bad arguments are
+	// reported now rather than then.
+	if (result == -E_IPC_NOT_RECV &&
+		!(result = ipc_check_send(curenv, src_va, perm, &pinfo)))
+		ipc_block_send(dst_env, value, src_va, perm, 1);
+
+	if (result) {
+		env_unlock_pair(curenv, dst_env);
+		return result;
+	}
+
+	curenv->env_ipc_recving = 1;
+
+	// never returns; our eax is set by the reply.
+	sched_switch_to(dst_env);
+}
+
+// Reply to envid, which should be waiting in sys_ipc_call, and then wait for
+// the next message from anyone, as sys_ipc_recv(dst_va) does. The reply is
+// dropped if envid is not receiving, or has gone away; if envid is 0 there
+// is nothing to reply to. Only a client in sys_ipc_call is sure to be
+// receiving: one that sent its request with sys_ipc_try_send may not have
+// reached sys_ipc_recv yet, and then never gets the reply. When the reply
+// goes through and no other message is queued for us, we switch to envid
+// directly.
+//
+// Returns 0 once the next message has arrived, or < 0 if the arguments are
+// invalid or the reply can't be mapped, in which case nothing has been
+// received; see sys_ipc_try_send and sys_ipc_recv.
+static int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *src_va, unsigned perm,
+				   void *dst_va)
+{
+	struct Env *dst_env = NULL;
+	int result = 0;
+
+	if (TRANSMITTING(dst_va) && PGOFF(dst_va) != 0)
+		return -E_INVAL;
+
+	if (envid == 0 || envid2env(envid, &dst_env, 0) ||
+		env_lock_pair_checked(curenv, 0, dst_env, envid))
+		return sys_ipc_recv(dst_va);
+
+	result = ipc_deliver_locked(curenv, dst_env, value, src_va, perm);
+	if (result && result != -E_IPC_NOT_RECV) {
+		env_unlock_pair(curenv, dst_env);
+		return result;
+	}
+
+	// whether or not the reply went through, we receive as sys_ipc_recv()
+	// does from here on.
+	curenv->env_ipc_recv_from = 0;
+	curenv->env_ipc_dst_va = dst_va;
+
+	if (!result && !curenv->env_ipc_sendq.iq_head &&
+		!(curenv->env_notify_bound && curenv->env_notify_pending)) {
+		// nobody else is waiting for us, and nobody can queue up or notify
+		// us while we hold our lock.
+		curenv->env_ipc_recving = 1;
+		sched_switch_to(dst_env);
+	}
+
+	// the next request is waiting already; we'll take it, and the env we
+	// replied to will run some other time.
+	if (!result)
+		sched_set_status(dst_env, ENV_RUNNABLE);
+	if (dst_env != curenv)
+		spin_unlock(env_lock(dst_env));
+
+	if (!ipc_recv_queued()) {
+		spin_unlock(env_lock(curenv));
+		return 0;
+	}
+
+	// never returns; our eax is set by the next message.
+	curenv->env_ipc_recving = 1;
+	sched_block();
 }
 
 // Return the current time.
@@ -448,9 +1191,196 @@ sys_time_msec(void)
 	return time_msec();
 }
 
-static int sys_transmit(unsigned char *data, size_t length) {
-	user_mem_assert(curenv, data, length, 0);
+// Return the current time in microseconds. Only the low 32 bits fit in the
+// return value, so this wraps about every 71 minutes; callers should only
+// look at differences between two readings.
+static unsigned
+sys_time_usec(void)
+{
+	return time_usec();
+}
 
+// Block until sys_time_usec() reaches 'deadline'. Like sys_time_usec(),
+// this only looks at the low 32 bits, so the deadline must lie less than
+// half a wrap (about 35 minutes) ahead; one that has passed already
+// returns right away.
+// Returns 0.
+static int
+sys_sleep_until(unsigned deadline)
+{
+	uint64_t now = time_usec();
+	int32_t delta = deadline - (uint32_t) now;
+
+	if (delta <= 0)
+		return 0;
+
+	spin_lock(env_lock(curenv));
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	timer_add(curenv, now + delta);
+
+	// this function never returns; the timer wheel makes curenv runnable
+	// again once the deadline has passed.
+	sched_block();
+}
+
+//
+// Set 'bits' in the pending notifications of envid, and wake it up if it is
+// waiting for them in sys_wait_notify, or receiving with its notifications
+// bound to IPC (see sys_bind_notify). Notifications don't queue: bits that
+// are set already stay set. The caller must not hold any env locks.
+// Returns 0 on success, -E_BAD_ENV if envid doesn't exist.
+//
+int
+env_notify(envid_t envid, uint32_t bits)
+{
+	struct Env *e;
+	int r;
+
+	if ((r = envid2env(envid, &e, 0)))
+		return r;
+	if ((r = env_lock_checked(e, envid)))
+		return r;
+
+	e->env_notify_pending |= bits;
+	if (e->env_notify_waiting) {
+		e->env_tf.tf_regs.reg_eax = e->env_notify_pending;
+		e->env_notify_pending = 0;
+		sched_set_status(e, ENV_RUNNABLE);
+	} else if (e->env_ipc_recving && !e->env_ipc_recv_from &&
+			   ipc_take_notify(e)) {
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = 0;
+		sched_set_status(e, ENV_RUNNABLE);
+	}
+
+	spin_unlock(env_lock(e));
+	return 0;
+}
+
+// Notify envid of the events in 'bits' without blocking; see env_notify.
+// Return < 0 on error. Errors are:
+//	-E_BAD_ENV if envid doesn't currently exist.
+//	-E_INVAL if bits is 0.
+static int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	if (!bits)
+		return -E_INVAL;
+	return env_notify(envid, bits);
+}
+
+// If 'bind', pending notifications also end a sys_ipc_recv, or the receive
+// of sys_ipc_reply_recv, of curenv: they arrive as a message from envid 0,
+// whose value holds the bits. That lets an env which serves IPC requests
+// wait for notifications at the same time.
+// Returns 0.
+static int
+sys_bind_notify(bool bind)
+{
+	spin_lock(env_lock(curenv));
+	curenv->env_notify_bound = bind;
+	spin_unlock(env_lock(curenv));
+	return 0;
+}
+
+// Block until some notification bit is set for curenv, or until
+// sys_time_usec() reaches 'deadline' if that is nonzero; see
+// sys_sleep_until. Returns the bits that were set, and clears them, or 0 if
+// the deadline passed first.
+static uint32_t
+sys_wait_notify(unsigned deadline)
+{
+	uint64_t now = time_usec();
+	int32_t delta = deadline - (uint32_t) now;
+	uint32_t bits;
+
+	spin_lock(env_lock(curenv));
+	if ((bits = curenv->env_notify_pending) || (deadline && delta <= 0)) {
+		curenv->env_notify_pending = 0;
+		spin_unlock(env_lock(curenv));
+		return bits;
+	}
+
+	curenv->env_notify_waiting = 1;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	if (deadline)
+		timer_add(curenv, now + delta);
+
+	// this function never returns; env_notify, or the timer wheel once the
+	// deadline has passed, makes curenv runnable again.
+	sched_block();
+}
+
+// Block until another env wakes us up with sys_futex_wake on the word at
+// 'addr', provided that the word still holds 'val'; or until
+// sys_time_usec() reaches 'deadline' if that is nonzero, see
+// sys_sleep_until. The word is named by its physical address, so this also
+// works between envs sharing the page at different addresses. Wakeups may
+// be spurious, so callers check the word again.
+//
+// Returns 0 if woken up, < 0 on error. Errors are:
+//	-E_AGAIN if the word doesn't hold 'val'.
+//	-E_TIMEOUT if the deadline passed first.
+//	-E_INVAL if addr is not 4-byte aligned, or not in ordinary memory.
+//	-E_FAULT if addr is not mapped for curenv.
+static int
+sys_futex_wait(uint32_t *addr, uint32_t val, unsigned deadline)
+{
+	uint64_t now = time_usec();
+	int32_t delta = deadline - (uint32_t) now;
+	physaddr_t key;
+	int result;
+
+	if (deadline && delta <= 0)
+		return -E_TIMEOUT;
+
+	spin_lock(env_lock(curenv));
+	pgdir_lock(curenv->env_pgdir);
+	if (!(result = futex_key(curenv->env_pgdir, addr, &key)))
+		result = futex_queue(curenv, key, val);
+	pgdir_unlock(curenv->env_pgdir);
+	if (result) {
+		spin_unlock(env_lock(curenv));
+		return result;
+	}
+
+	curenv->env_tf.tf_regs.reg_eax = -E_TIMEOUT;
+	if (deadline)
+		timer_add(curenv, now + delta);
+
+	// this function never returns; sys_futex_wake, or the timer wheel once
+	// the deadline has passed, makes curenv runnable again.
+	sched_block();
+}
+
+// Wake up at most 'n' of the envs waiting in sys_futex_wait on the word at
+// 'addr', oldest first.
+//
+// Returns the number of envs woken up, or < 0 on error. Errors are:
+//	-E_INVAL if n < 0, or for 'addr' as in sys_futex_wait.
+//	-E_FAULT if addr is not mapped for curenv.
+static int
+sys_futex_wake(uint32_t *addr, int n)
+{
+	physaddr_t key;
+	int result;
+
+	if (n < 0)
+		return -E_INVAL;
+
+	pgdir_lock(curenv->env_pgdir);
+	result = futex_key(curenv->env_pgdir, addr, &key);
+	pgdir_unlock(curenv->env_pgdir);
+	if (result)
+		return result;
+
+	result = futex_wake(key, n);
+	futex_run_woken();
+	return result;
+}
+
+static int sys_transmit(unsigned char *data, size_t length) {
+	// a bad 'data' makes the copy fail with -E_FAULT.
 	if (!e1000_initialized)
 		return -E_NOT_SUPP;
 
@@ -459,8 +1389,7 @@ static int sys_transmit(unsigned char *data, size_t length) {
 }
 
 static int sys_receive(unsigned char *buf, size_t bufsize) {
-	user_mem_assert(curenv, buf, bufsize, 0);
-
+	// a bad 'buf' makes the copy fail with -E_FAULT.
 	if (!e1000_initialized)
 		return -E_NOT_SUPP;
 
@@ -499,37 +1428,32 @@ static int sys_map_lfb() {
 	
 	physaddr_t pa = mode_info.framebuffer;
 	size_t size = ROUNDUP(lfb_size, PGSIZE);
-	void *va = (void *) LFB_BASE;
-
-	size_t offset;
-	for (offset = 0; offset < lfb_size; offset += PGSIZE) {
-		pte_t *pte = pgdir_walk(curenv->env_pgdir, (void *) (va + offset), 1);
-		if (!pte)
-			panic("sys_map_lfb allocation failed");
-		*pte = (pa + offset) | PTE_U | PTE_W | PTE_P;
-	}
 
+	// this takes 4MB pages where the framebuffer is aligned well enough.
+	spin_lock(env_lock(curenv));
+	pgdir_lock(curenv->env_pgdir);
+	boot_map_region(curenv->env_pgdir, LFB_BASE, size, pa, PTE_U | PTE_W);
+	pgdir_unlock(curenv->env_pgdir);
+	spin_unlock(env_lock(curenv));
 	return 0;
 }
 
 static int sys_get_io_events(struct io_event *events_array, 
 							 size_t events_array_size) {
 
-	// TODO: handle integer overflows.
-	size_t length = events_array_size * sizeof(struct io_event);
-
-	user_mem_assert(curenv, events_array, length, PTE_W);
-
 	// take a number of events from the io_events queue, putting them into the
 	// events_array instead.
 
 	// TODO: only let the graphics process call this syscall
 
+	// from now on, tell curenv whenever new events arrive.
+	io_events_envid = curenv->env_id;
+
 	size_t num_to_drain = MIN(events_array_size, io_events_queue_cursize);
+	if (copy_to_user(events_array, io_events_queue, 
+					 num_to_drain * sizeof(struct io_event)))
+		return -E_FAULT;
 	io_events_queue_cursize -= num_to_drain;
-
-	copy_to_user(events_array, io_events_queue, 
-				 num_to_drain * sizeof(struct io_event));
 	
 	memmove(&io_events_queue[0], &io_events_queue[num_to_drain], 
 			io_events_queue_cursize * sizeof(struct io_event));
@@ -544,27 +1468,216 @@ static int sys_get_ide_io_base() {
 	return io_base;
 }
 
+static int sys_get_ide_bm_base() {
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+
+	return bm_base;
+}
+
+// From now on, notify curenv of the events in 'bits' whenever the IDE disk
+// raises an interrupt, i.e. finishes a command; see env_notify. Only the file
+// server may call this, so that it can block instead of polling the disk.
+// Returns 0 on success, -E_INVAL if bits is 0.
+static int sys_ide_set_notify(uint32_t bits) {
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	
+	if (!bits)
+		return -E_INVAL;
+
+	ide_notify_bits = bits;
+	ide_notify_envid = curenv->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<IRQ_IDE));
+	return 0;
+}
+
+static int sys_get_virtio_blk_io_base() {
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+
+	return virtio_blk_io_base;
+}
+
+// From now on, notify curenv of the events in 'bits' whenever the virtio
+// block device interrupts, i.e. has used some buffers; see env_notify. Only
+// the file server may call this.
+// Returns 0 on success, < 0 on error. Errors are:
+//	-E_INVAL if bits is 0.
+//	-E_NOT_SUPP if there is no device, or its IRQ line has no handler.
+static int sys_virtio_blk_set_notify(uint32_t bits) {
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	
+	if (!bits)
+		return -E_INVAL;
+	
+	if (!virtio_blk_io_base || virtio_blk_irq < IRQ_PCI_FIRST || 
+		virtio_blk_irq > IRQ_PCI_LAST)
+		return -E_NOT_SUPP;
+
+	virtio_blk_notify_bits = bits;
+	virtio_blk_notify_envid = curenv->env_id;
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<virtio_blk_irq));
+	return 0;
+}
+
+// Allocates npages physically contiguous, zeroed pages, maps them writable at
+// va and stores the physical address of the first one in *pa_store. Only the
+// file server may call this; it points the IDE controller at such memory,
+// e.g. its PRD table.
+static int sys_dma_alloc(void *va, size_t npages, physaddr_t *pa_store) {
+	struct PageInfo *pinfo;
+	physaddr_t pa;
+	int order, r;
+	size_t i, j;
+
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	
+	if (npages == 0 || npages > DMA_MAXPAGES || PGOFF(va) || 
+		(uintptr_t) va >= UTOP || UTOP - (uintptr_t) va < npages * PGSIZE)
+		return -E_INVAL;
+	
+	for (order = 0; (1 << order) < npages; order++)
+		;
+	if (!(pinfo = page_alloc_order(order, ALLOC_ZERO)))
+		return -E_NO_MEM;
+	pa = page2pa(pinfo);
+
+	// each page of the block counts as allocated by itself, so those we
+	// don't need go back right away.
+	for (i = npages; i < (1 << order); i++)
+		page_free(&pinfo[i]);
+
+	spin_lock(env_lock(curenv));
+	pgdir_lock(curenv->env_pgdir);
+	for (i = 0, r = 0; i < npages; i++)
+		if ((r = page_insert(curenv->env_pgdir, &pinfo[i], 
+							 va + i * PGSIZE, PTE_U | PTE_P | PTE_W)))
+			break;
+	
+	// undo a partial mapping: free the pages we didn't map, and unmap the
+	// others, which frees them.
+	if (r) {
+		for (j = i; j < npages; j++)
+			page_free(&pinfo[j]);
+		while (i > 0)
+			page_remove(curenv->env_pgdir, va + --i * PGSIZE);
+	}
+	pgdir_unlock(curenv->env_pgdir);
+	spin_unlock(env_lock(curenv));
+
+	if (r)
+		return r;
+	
+	return copy_to_user(pa_store, &pa, sizeof(pa));
+}
+
+// Stores the physical addresses of the npages pages mapped at va, which must
+// be page-aligned, in pa_store[]. Only the file server may call this, to
+// point the IDE controller straight at its block cache pages. The addresses
+// stay good only as long as the pages stay mapped.
+static int sys_page_phys(const void *va, size_t npages, physaddr_t *pa_store) {
+	physaddr_t pas[DMA_MAXPAGES];
+	struct PageInfo *pinfo;
+	size_t i;
+
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	
+	if (npages == 0 || npages > DMA_MAXPAGES || PGOFF(va) || 
+		(uintptr_t) va >= UTOP || UTOP - (uintptr_t) va < npages * PGSIZE)
+		return -E_INVAL;
+	
+	spin_lock(env_lock(curenv));
+	pgdir_lock(curenv->env_pgdir);
+	for (i = 0; i < npages; i++) {
+		if (!(pinfo = page_lookup(curenv->env_pgdir, 
+								  (void *) va + i * PGSIZE, NULL)))
+			break;
+		pas[i] = page2pa(pinfo);
+	}
+	pgdir_unlock(curenv->env_pgdir);
+	spin_unlock(env_lock(curenv));
+
+	if (i < npages)
+		return -E_INVAL;
+	
+	return copy_to_user(pa_store, pas, npages * sizeof(pas[0]));
+}
+
 static int sys_get_mode_info(struct vbe_mode_info * ptr) {
 	// will fail if the address is invalid.
-	copy_to_user(ptr, &mode_info, sizeof(mode_info));
-	return 0;
+	return copy_to_user(ptr, &mode_info, sizeof(mode_info));
+}
+
+// Syscalls that touch devices, the console input buffer or kern_pgdir, none
+// of which have locks of their own yet, still run under the big kernel lock.
+static int32_t
+syscall_locked(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
+{
+	switch (syscallno) {
+	case SYS_cgetc:
+		return sys_cgetc();
+	
+	case SYS_transmit:
+		return sys_transmit((void *) a1, (size_t) a2);
+
+	case SYS_receive:
+		return sys_receive((void *) a1, (size_t) a2);
+	
+	case SYS_v86:
+		return sys_v86();
+
+	case SYS_map_lfb:
+		return sys_map_lfb();
+
+	case SYS_get_io_events:
+		return sys_get_io_events((void *) a1, (size_t) a2);
+
+	case SYS_get_ide_io_base:
+		return sys_get_ide_io_base();
+
+	case SYS_get_ide_bm_base:
+		return sys_get_ide_bm_base();
+
+	case SYS_dma_alloc:
+		return sys_dma_alloc((void *) a1, (size_t) a2, (physaddr_t *) a3);
+
+	case SYS_page_phys:
+		return sys_page_phys((void *) a1, (size_t) a2, (physaddr_t *) a3);
+
+	case SYS_ide_set_notify:
+		return sys_ide_set_notify(a1);
+
+	case SYS_get_virtio_blk_io_base:
+		return sys_get_virtio_blk_io_base();
+
+	case SYS_virtio_blk_set_notify:
+		return sys_virtio_blk_set_notify(a1);
+
+	case SYS_get_mode_info:
+		return sys_get_mode_info((struct vbe_mode_info *) a1);
+
+	default:
+		return -E_NOSYS;
+
+	}
 }
 
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
+	int32_t result;
 	
 	// cprintf("syscall %d (0x%x, 0x%x, 0x%x, 0x%x, 0x%x)\n", 
 	// 	syscallno, a1, a2, a3, a4, a5);
 
 	switch (syscallno) {
 	case SYS_cputs:
-		sys_cputs((const char *) a1, a2);
-		return 0;
-	
-	case SYS_cgetc:
-		return sys_cgetc();
+		return sys_cputs((const char *) a1, a2);
 	
 	case SYS_getenvid:
 		return sys_getenvid();
@@ -591,45 +1704,65 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_page_unmap:
 		return sys_page_unmap(a1, (void *) a2);
 	
+	case SYS_page_batch:
+		return sys_page_batch(a1, a2, (struct PageOp *) a3, a4);
+	
+	case SYS_fork:
+		return sys_fork();
+	
+	case SYS_sfork:
+		return sys_sfork();
+	
+	case SYS_futex_wait:
+		return sys_futex_wait((uint32_t *) a1, a2, a3);
+	
+	case SYS_futex_wake:
+		return sys_futex_wake((uint32_t *) a1, a2);
+	
 	case SYS_env_set_pgfault_upcall:
 		return sys_env_set_pgfault_upcall(a1, (void *) a2);
 	
 	case SYS_ipc_try_send:
 		return sys_ipc_try_send(a1, a2, (void *) a3, a4);
 	
+	case SYS_ipc_send:
+		return sys_ipc_send(a1, a2, (void *) a3, a4);
+	
 	case SYS_ipc_recv:
 		return sys_ipc_recv((void *) a1);
 	
+	case SYS_ipc_call:
+		return sys_ipc_call(a1, a2, (void *) a3, a4, (void *) a5);
+	
+	case SYS_ipc_reply_recv:
+		return sys_ipc_reply_recv(a1, a2, (void *) a3, a4, (void *) a5);
+	
 	case SYS_env_set_trapframe:
 		return sys_env_set_trapframe(a1, (struct Trapframe *) a2);
 	
 	case SYS_time_msec:
 		return sys_time_msec();
 	
-	case SYS_transmit:
-		return sys_transmit((void *) a1, (size_t) a2);
-
-	case SYS_receive:
-		return sys_receive((void *) a1, (size_t) a2);
+	case SYS_time_usec:
+		return sys_time_usec();
+	
+	case SYS_sleep_until:
+		return sys_sleep_until(a1);
+	
+	case SYS_notify:
+		return sys_notify(a1, a2);
+	
+	case SYS_wait_notify:
+		return sys_wait_notify(a1);
+	
+	case SYS_bind_notify:
+		return sys_bind_notify(a1);
 	
-	case SYS_v86:
-		return sys_v86();
-
-	case SYS_map_lfb:
-		return sys_map_lfb();
-
-	case SYS_get_io_events:
-		return sys_get_io_events((void *) a1, (size_t) a2);
-
-	case SYS_get_ide_io_base:
-		return sys_get_ide_io_base();
-
-	case SYS_get_mode_info:
-		return sys_get_mode_info((struct vbe_mode_info *) a1);
-
 	default:
-		return -E_NOSYS;
+		lock_kernel();
+		result = syscall_locked(syscallno, a1, a2, a3, a4, a5);
+		unlock_kernel();
+		return result;
 
 	}
 }
-
@@ -5,6 +5,12 @@
 #endif
 
 #include <inc/syscall.h>
+#include <inc/env.h>
+
+void ipc_cancel_send(struct Env *e);
+void ipc_orphan_senders(struct Env *e);
+void ipc_wake_orphans(void);
+int env_notify(envid_t envid, uint32_t bits);
 
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
 
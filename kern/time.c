@@ -1,26 +1,41 @@
 #include <kern/time.h>
+#include <kern/kclock.h>
 #include <inc/assert.h>
+#include <inc/stdio.h>
+#include <inc/x86.h>
 
-static unsigned int ticks;
+// The time is read from the TSC, whose rate we measure against the PIT at
+// boot. We assume the TSCs of all CPUs tick at the same constant rate and
+// were reset together, as they are on machines with an invariant TSC and
+// in QEMU, so every CPU reads the same clock without drift.
+
+#define CALIBRATE_MSEC	20
+
+static uint64_t tsc_boot;	// TSC value when init_time() ran
+static uint32_t tsc_khz;	// TSC cycles per millisecond
 
 void
 init_time(void)
 {
-	ticks = 0;
+	tsc_khz = pit_measure_tsc(CALIBRATE_MSEC) / CALIBRATE_MSEC;
+	if (!tsc_khz)
+		panic("init_time: the TSC doesn't tick");
+	tsc_boot = read_tsc();
+	cprintf("TSC: %u kHz\n", tsc_khz);
 }
 
-// This should be called once per timer interrupt.  A timer interrupt
-// fires every 10 ms.
-void
-time_tick(void)
+// Microseconds since boot.
+uint64_t
+time_usec(void)
 {
-	ticks++;
-	if (ticks * 10 < ticks)
-		panic("time_tick: time overflowed");
+	uint64_t cycles = read_tsc() - tsc_boot;
+
+	// split the division so that cycles * 1000 can't overflow
+	return cycles / tsc_khz * 1000 + cycles % tsc_khz * 1000 / tsc_khz;
 }
 
 unsigned int
 time_msec(void)
 {
-	return ticks * 10;
+	return time_usec() / 1000;
 }
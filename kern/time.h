@@ -4,8 +4,10 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
 void init_time(void);
-void time_tick(void);
+uint64_t time_usec(void);
 unsigned int time_msec(void);
 
 #endif /* JOS_KERN_TIME_H */
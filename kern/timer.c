@@ -0,0 +1,199 @@
+// Timer wheels for environments sleeping until a deadline.
+//
+// Each CPU has a wheel of WHEEL_SLOTS lists; an env sleeping until time t
+// goes into slot (t / WHEEL_TICK) % WHEEL_SLOTS of the wheel of the CPU it
+// went to sleep on. That CPU programs its LAPIC timer for the earliest
+// deadline on its wheel (see sched_arm_timer), and runs the wheel when the
+// timer fires. Deadlines more than a lap ahead simply stay in their slot
+// until the wheel comes around to them again.
+
+#include <inc/assert.h>
+#include <kern/timer.h>
+#include <kern/time.h>
+#include <kern/sched.h>
+#include <kern/spinlock.h>
+#include <kern/cpu.h>
+#include <kern/env.h>
+
+// Protects the timer wheels of all CPUs. Lock order: an env's env_lock,
+// ipc_lock and futex_lock come before timer_lock, which comes before
+// sched_lock. timer_expire wakes envs up only after it has dropped
+// timer_lock, as that takes ipc_lock and futex_lock.
+static struct spinlock timer_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "timer_lock"
+#endif
+};
+
+static void
+tw_insert(struct TimerWheel *tw, struct Env *e)
+{
+	struct Env **slot;
+
+	assert (!e->env_tw);
+
+	// an empty wheel may not have been run for a while.
+	if (!tw->tw_len)
+		tw->tw_tick = time_usec() / WHEEL_TICK;
+
+	// the wheel has run past this deadline already, so it is due right
+	// away; file it under the current tick.
+	if (e->env_wakeup / WHEEL_TICK < tw->tw_tick)
+		e->env_wakeup = tw->tw_tick * WHEEL_TICK;
+
+	slot = &tw->tw_slots[(e->env_wakeup / WHEEL_TICK) % WHEEL_SLOTS];
+	e->env_tw = tw;
+	e->env_tw_prev = NULL;
+	e->env_tw_next = *slot;
+	if (*slot)
+		(*slot)->env_tw_prev = e;
+	*slot = e;
+	tw->tw_len++;
+}
+
+static void
+tw_remove(struct Env *e)
+{
+	struct TimerWheel *tw = e->env_tw;
+
+	assert (tw && tw->tw_len > 0);
+
+	if (e->env_tw_prev)
+		e->env_tw_prev->env_tw_next = e->env_tw_next;
+	else
+		tw->tw_slots[(e->env_wakeup / WHEEL_TICK) % WHEEL_SLOTS] =
+			e->env_tw_next;
+	if (e->env_tw_next)
+		e->env_tw_next->env_tw_prev = e->env_tw_prev;
+	tw->tw_len--;
+
+	e->env_tw = NULL;
+	e->env_tw_next = e->env_tw_prev = NULL;
+}
+
+//
+// Put env e to sleep on this CPU's wheel until time 'when', in microseconds.
+// The caller must hold env_lock(e), and block e afterwards.
+//
+void
+timer_add(struct Env *e, uint64_t when)
+{
+	assert (spin_holding(env_lock(e)));
+
+	spin_lock(&timer_lock);
+	e->env_wakeup = when;
+	tw_insert(&thiscpu->cpu_tw, e);
+	spin_unlock(&timer_lock);
+}
+
+//
+// Take env e off the wheel it sleeps on, if any, e.g. because it was woken
+// up early or destroyed. The caller must hold env_lock(e).
+//
+void
+timer_remove(struct Env *e)
+{
+	assert (spin_holding(env_lock(e)));
+
+	spin_lock(&timer_lock);
+	if (e->env_tw)
+		tw_remove(e);
+	spin_unlock(&timer_lock);
+}
+
+//
+// Wake up the envs on this CPU's wheel whose deadline has passed. They are
+// queued to run on this CPU.
+//
+void
+timer_expire(void)
+{
+	struct TimerWheel *tw = &thiscpu->cpu_tw;
+	uint64_t now = time_usec();
+	uint64_t now_tick = now / WHEEL_TICK;
+	struct Env *e, *next, *due = NULL;
+	bool busy;
+
+	spin_lock(&timer_lock);
+
+	// each slot is looked at once per lap at most.
+	if (now_tick >= tw->tw_tick + WHEEL_SLOTS)
+		tw->tw_tick = now_tick - WHEEL_SLOTS + 1;
+
+	while (tw->tw_len && tw->tw_tick <= now_tick) {
+		busy = 0;
+		for (e = tw->tw_slots[tw->tw_tick % WHEEL_SLOTS]; e; e = next) {
+			next = e->env_tw_next;
+			if (e->env_wakeup > now)
+				continue;
+
+			// someone is busy with this env; as in the scheduler we
+			// don't wait for its lock, which would invert the lock
+			// order. Try again on the next run.
+			if (!spin_trylock(env_lock(e))) {
+				busy = 1;
+				continue;
+			}
+
+			// keep its lock, so that it stays asleep until we wake it
+			// up below.
+			tw_remove(e);
+			e->env_tw_next = due;
+			due = e;
+		}
+
+		if (busy || tw->tw_tick == now_tick)
+			break;
+		tw->tw_tick++;
+	}
+
+	spin_unlock(&timer_lock);
+
+	// waking an env up cancels its futex wait or IPC send, which takes
+	// locks that come before timer_lock.
+	for (e = due; e; e = next) {
+		next = e->env_tw_next;
+		e->env_tw_next = NULL;
+		sched_set_status(e, ENV_RUNNABLE);
+		spin_unlock(env_lock(e));
+	}
+}
+
+//
+// Return the earliest deadline on this CPU's wheel, or ~0 if no env sleeps
+// here. It may lie in the past, if timer_expire() couldn't wake an env yet.
+//
+uint64_t
+timer_next(void)
+{
+	struct TimerWheel *tw = &thiscpu->cpu_tw;
+	uint64_t tick, best = ~0ULL;
+	struct Env *e;
+	int i;
+
+	// only this CPU adds to its wheel, so this can't miss a new entry.
+	if (!tw->tw_len)
+		return ~0ULL;
+
+	spin_lock(&timer_lock);
+
+	// the first slot that has an entry due in this lap holds the earliest
+	// deadline; entries from later laps are skipped on the way.
+	for (tick = tw->tw_tick; tw->tw_len && tick < tw->tw_tick + WHEEL_SLOTS;
+		 tick++) {
+		for (e = tw->tw_slots[tick % WHEEL_SLOTS]; e; e = e->env_tw_next)
+			if (e->env_wakeup / WHEEL_TICK <= tick)
+				best = MIN(best, e->env_wakeup);
+		if (best != ~0ULL)
+			goto out;
+	}
+
+	// everything is at least a lap away.
+	for (i = 0; tw->tw_len && i < WHEEL_SLOTS; i++)
+		for (e = tw->tw_slots[i]; e; e = e->env_tw_next)
+			best = MIN(best, e->env_wakeup);
+
+out:
+	spin_unlock(&timer_lock);
+	return best;
+}
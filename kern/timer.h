@@ -0,0 +1,14 @@
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/env.h>
+
+void timer_add(struct Env *e, uint64_t when);
+void timer_remove(struct Env *e);
+void timer_expire(void);
+uint64_t timer_next(void);
+
+#endif /* JOS_KERN_TIMER_H */
@@ -15,6 +15,11 @@
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
 #include <kern/time.h>
+#include <kern/timer.h>
+#include <kern/graphics.h>
+#include <kern/copy.h>
+#include <inc/ide.h>
+#include <kern/virtio_blk.h>
 
 /* For debugging, so print_trapframe can distinguish between printing
  * a saved trapframe and printing the current trapframe and print some
@@ -91,9 +96,20 @@ void trap_irq_mouse ();
 void trap_irq_serial ();
 void trap_irq_spurious ();
 void trap_irq_ide ();
+void trap_irq_pci0 ();
+void trap_irq_pci1 ();
+void trap_irq_pci2 ();
 void trap_irq_error ();
+void trap_irq_resched ();
+void trap_irq_tlb ();
 
 void trap_syscall (); 
+void sysenter_handler ();
+void sysenter_handler_end ();
+
+// Whether the env on this CPU single-stepped into sysenter_handler; see
+// trap_dispatch.
+static bool sysenter_stepping[NCPU];
 
 void badint (); 
 
@@ -140,7 +156,14 @@ init_idt(void)
 	SETGATE (idt[IRQ_OFFSET + IRQ_SERIAL], 0, GD_KT, trap_irq_serial, 0)
 	SETGATE (idt[IRQ_OFFSET + IRQ_SPURIOUS], 0, GD_KT, trap_irq_spurious, 0)
 	SETGATE (idt[IRQ_OFFSET + IRQ_IDE], 0, GD_KT, trap_irq_ide, 0)
+	// trapentry.S has a handler for each of the PCI IRQs.
+	static_assert(IRQ_PCI_LAST == IRQ_PCI_FIRST + 2);
+	SETGATE (idt[IRQ_OFFSET + IRQ_PCI_FIRST], 0, GD_KT, trap_irq_pci0, 0)
+	SETGATE (idt[IRQ_OFFSET + IRQ_PCI_FIRST + 1], 0, GD_KT, trap_irq_pci1, 0)
+	SETGATE (idt[IRQ_OFFSET + IRQ_PCI_LAST], 0, GD_KT, trap_irq_pci2, 0)
 	SETGATE (idt[IRQ_OFFSET + IRQ_ERROR], 0, GD_KT, trap_irq_error, 0)
+	SETGATE (idt[IRQ_OFFSET + IRQ_RESCHED], 0, GD_KT, trap_irq_resched, 0)
+	SETGATE (idt[IRQ_OFFSET + IRQ_TLB], 0, GD_KT, trap_irq_tlb, 0)
 
 	SETGATE (idt[T_SYSCALL], 0, GD_KT, trap_syscall, 3) // syscalls
 
@@ -173,6 +196,15 @@ init_idt_percpu(void)
 
 	// Load the IDT
 	lidt(&idt_pd);
+
+	// Let sysenter in, if this CPU has it. It lands on the same stack.
+	uint32_t edx;
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (edx & CPUID_SEP) {
+		wrmsr(MSR_SYSENTER_CS, GD_KT);
+		wrmsr(MSR_SYSENTER_ESP, stack_top);
+		wrmsr(MSR_SYSENTER_EIP, (uint32_t) sysenter_handler);
+	}
 }
 
 void
@@ -221,16 +253,73 @@ print_regs(struct PushRegs *regs)
 	cprintf("  eax  0x%08x\n", regs->reg_eax);
 }
 
+// If the page fault in tf was a write to a copy-on-write page of curenv
+// (see env_copy_vm), give curenv its own copy of the page and return 1.
+// When no other env maps the page anymore, curenv simply gets it writable.
+static bool
+page_fault_cow(struct Trapframe *tf, void *va)
+{
+	struct PageInfo *pinfo, *copy;
+	pte_t *pte = NULL;
+	bool done = 0;
+	int perm;
+
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) != (FEC_PR | FEC_WR) || 
+		va >= (void *) UTOP)
+		return 0;
+
+	va = ROUNDDOWN(va, PGSIZE);
+
+	// other threads sharing our page directory may be at the same page.
+	spin_lock(env_lock(curenv));
+	pgdir_lock(curenv->env_pgdir);
+	pinfo = page_lookup(curenv->env_pgdir, va, &pte);
+	if (pinfo && (*pte & PTE_W))
+		// one of them was first, so just try again.
+		done = 1;
+	else if (pinfo && (*pte & PTE_COW)) {
+		perm = ((*pte & PTE_SYSCALL) & ~PTE_COW) | PTE_W;
+		if (pinfo->pp_ref == 1) {
+			*pte = PTE_ADDR(*pte) | perm;
+			tlb_invalidate(curenv->env_pgdir, va);
+			done = 1;
+		} else if ((copy = page_alloc(0))) {
+			memcpy(page2kva(copy), page2kva(pinfo), PGSIZE);
+			if (!(done = !page_insert(curenv->env_pgdir, copy, va, perm)))
+				page_free(copy);
+		}
+	}
+	pgdir_unlock(curenv->env_pgdir);
+	spin_unlock(env_lock(curenv));
+
+	return done;
+}
+
 // this function handles processor exceptions based on their type.
 static void
 trap_dispatch(struct Trapframe *tf, bool trapped_from_kernel)
 {
 	// page faults are handled specially
 	if (tf->tf_trapno == T_PGFLT && !trapped_from_kernel) {
+		// copy-on-write faults are taken care of right here, without
+		// bothering the env's own handler.
+		if (page_fault_cow(tf, (void *) rcr2()))
+			return;
+
+		// the fault handler never returns.
 		page_fault_handler(tf);
 		return;
 	}
 
+	// a fault on user memory while copying it in or out of the kernel. The
+	// copy goes on once a copy-on-write page is resolved; otherwise it fails.
+	if (tf->tf_trapno == T_PGFLT && trapped_from_kernel && 
+		copy_user_faulted(tf)) {
+		if (!page_fault_cow(tf, (void *) rcr2()))
+			copy_user_fail(tf);
+		env_pop_tf(tf);
+	}
+
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
 	// IRQ line or other reasons. We don't care.
@@ -244,7 +333,9 @@ trap_dispatch(struct Trapframe *tf, bool trapped_from_kernel)
 	// normal breakpoints invoke the kernel monitor
 	if (tf->tf_trapno == T_BRKPT) {
 		struct Env *e = curenv;
+		lock_kernel();
 		curenv = NULL;
+		spin_lock(env_lock(e));
 		env_destroy(e);
 		monitor(tf); // never returns
 	}
@@ -253,14 +344,51 @@ trap_dispatch(struct Trapframe *tf, bool trapped_from_kernel)
 	// keyboard and must be handled here
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD ||
 		tf->tf_trapno == IRQ_OFFSET + IRQ_MOUSE) {
+		envid_t notify = 0;
+
+		lock_kernel();
 		drain_keyboard_and_mouse();
+		if (io_events_queue_cursize)
+			notify = io_events_envid;
+		unlock_kernel();
+		irq_eoi();
+
+		// wake up whoever drains the io events
+		if (notify)
+			env_notify(notify, IO_EVENTS_NOTIFY);
+		return;
+	}
+
+	// the disk finished a command; wake up the file server. Reading the
+	// drive's status, which it does anyway, lowers the interrupt line.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_IDE) {
+		envid_t notify = ide_notify_envid;
+
+		irq_eoi();
+		if (notify)
+			env_notify(notify, ide_notify_bits);
+		return;
+	}
+
+	// the virtio disk used some buffers; wake up the file server. Only
+	// its line is unmasked, but it may share that line with others.
+	if (tf->tf_trapno >= IRQ_OFFSET + IRQ_PCI_FIRST && 
+		tf->tf_trapno <= IRQ_OFFSET + IRQ_PCI_LAST &&
+		tf->tf_trapno == IRQ_OFFSET + virtio_blk_irq) {
+		envid_t notify = virtio_blk_notify_envid;
+		bool used = virtio_blk_intr();
+
 		irq_eoi();
+		if (used && notify)
+			env_notify(notify, virtio_blk_notify_bits);
 		return;
 	}
 
 	// console input appear on the serial port and must be handled here
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
+		lock_kernel();
 		drain_serial();
+		unlock_kernel();
 		irq_eoi();
 		return;
 	}
@@ -279,16 +407,42 @@ trap_dispatch(struct Trapframe *tf, bool trapped_from_kernel)
 		return;
 	}
 
-	// Handle clock interrupts by switching to the next process to be
-	// scheduled. Also record a time tick.
+	// Handle clock interrupts by waking up the envs whose sleep is over and
+	// switching to the next process to be scheduled. The timer is one-shot,
+	// so it is off again now.
 	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
-		// TODO what about multiple CPUs? Clock interrupts will happen on
-		// every CPU..
-		time_tick();
+		thiscpu->cpu_timer_at = 0;
+		if (thiscpu->cpu_slice_end && thiscpu->cpu_slice_end <= time_usec())
+			thiscpu->cpu_slice_end = 0;
+		timer_expire();
+		lapic_eoi();
+		sched_yield();
+	}
+
+	// Another CPU queued an env and wants us to come and get it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
 		lapic_eoi();
 		sched_yield();
 	}
 
+	// Another CPU changed the page tables we are running on.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		tlb_shootdown_poll();
+		lapic_eoi();
+		return;
+	}
+
+	// sysenter leaves the trap flag set, so an env that single-steps into
+	// it traps on the first instruction of sysenter_handler. Go on with
+	// the system call without it; sysenter_trap gives it back to the env.
+	if (tf->tf_trapno == T_DEBUG && trapped_from_kernel && 
+		tf->tf_eip >= (uintptr_t) sysenter_handler && 
+		tf->tf_eip < (uintptr_t) sysenter_handler_end) {
+		tf->tf_eflags &= ~FL_TF;
+		sysenter_stepping[cpunum()] = 1;
+		env_pop_tf(tf);
+	}
+
 	print_trapframe(tf);
 
 	// if we get an unhandled trap in kernel land, panic
@@ -296,6 +450,7 @@ trap_dispatch(struct Trapframe *tf, bool trapped_from_kernel)
 		panic("trap in kernel mode");
 	
 	// if we get an unhandled trap in user land, terminate the environment
+	spin_lock(env_lock(curenv));
 	env_destroy(curenv);
 }
 
@@ -314,12 +469,9 @@ trap(struct Trapframe *tf)
 
 	bool trapped_from_kernel = (tf->tf_cs & 3) != 3 || tf->tf_cs == GD_KT;
 
-	// Re-acquire the big kernel lock if we were halted in
-	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
-		assert (trapped_from_kernel); // otherwise we lock the kernel twice
-		lock_kernel();
-	}
+	// We may have been woken up from the halt loop in sched_halt().
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+		assert (trapped_from_kernel);
 
 	// Check that interrupts are disabled. This should always be the case once
 	// we're in kernel land. If this assertion fails, Don't "fix" it by
@@ -328,18 +480,17 @@ trap(struct Trapframe *tf)
 	// happen in kernel land, specifically timer interrupts?
 	// assert(!(read_eflags() & FL_IF));
 
+	// There is no big kernel lock on this path: syscalls and interrupts
+	// take the locks of the subsystems they touch. See syscall().
 	if (!trapped_from_kernel) {
-		lock_kernel();
-
 		// Garbage collect if current environment is a zombie.
 		// This happens when process A kills process B, and they are running
 		// on different CPUs; then process A just marks B as dying, and we
 		// only notice now that B has trapped.
 		assert (curenv);
 		if (curenv->env_status == ENV_DYING) {
-			env_free(curenv);
-			curenv = NULL;
-			sched_yield();
+			spin_lock(env_lock(curenv));
+			env_destroy(curenv);
 		}
 
 		// Copy trap frame (which is currently on the stack)
@@ -367,10 +518,76 @@ trap(struct Trapframe *tf)
 		sched_yield();
 }
 
+//
+// This function is called by sysenter_handler for system calls made with
+// sysenter. It does what trap() does for an int $T_SYSCALL, but builds
+// curenv's Trapframe from the few registers in 'frame'. The env is resumed
+// with sysexit if this returns, otherwise with an iret from the Trapframe,
+// so system calls which block or switch envs, or change the Trapframe of
+// the caller, work just the same.
+//
+int32_t
+sysenter_trap(struct SysenterFrame *frame)
+{
+	struct Trapframe *tf = &curenv->env_tf;
+	struct PushRegs *regs = &frame->sf_regs;
+	struct Trapframe entry;
+
+	extern char *panicstr;
+	if (panicstr)
+		asm volatile("hlt");
+
+	// sysexit can't restore the trap flag, so a single-stepping env goes
+	// back through the iret below, just as after int $T_SYSCALL.
+	if (sysenter_stepping[cpunum()]) {
+		sysenter_stepping[cpunum()] = 0;
+		frame->sf_eflags |= FL_TF;
+	}
+
+	if (curenv->env_status == ENV_DYING) {
+		spin_lock(env_lock(curenv));
+		env_destroy(curenv);
+	}
+
+	tf->tf_regs = *regs;
+	tf->tf_es = tf->tf_ds = GD_UD | 3;
+	tf->tf_trapno = T_SYSCALL;
+	tf->tf_err = 0;
+	tf->tf_eip = regs->reg_esi;
+	tf->tf_cs = GD_UT | 3;
+	tf->tf_eflags = frame->sf_eflags | FL_IF;
+	tf->tf_esp = regs->reg_ebp;
+	tf->tf_ss = GD_UD | 3;
+	last_tf = tf;
+	entry = *tf;
+
+	// there's no room for a fifth argument; see lib/syscall.c.
+	tf->tf_regs.reg_eax = syscall(regs->reg_eax, regs->reg_edx, 
+								  regs->reg_ecx, regs->reg_ebx, 
+								  regs->reg_edi, 0);
+
+	if (curenv->env_status != ENV_RUNNING)
+		sched_yield();
+
+	// sysexit restores no more than what we had on entry, so if the system
+	// call changed anything else, e.g. sys_env_set_trapframe(0, ...) or
+	// sys_v86, leave through env_run's iret.
+	entry.tf_regs.reg_eax = tf->tf_regs.reg_eax;
+	if (memcmp(&entry, tf, sizeof(entry)) || (tf->tf_eflags & FL_TF))
+		env_run(curenv);
+
+	// the rest of what env_run does when we return to the same env.
+	curenv->env_runs++;
+	unlock_kernel_if_held();
+	sched_arm_timer(0);
+	return tf->tf_regs.reg_eax;
+}
+
 // 
 // Call the environment's page fault upcall, if one exists.  Set up a
 // page fault stack frame on the user exception stack (below
-// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
+// curenv->env_xstacktop, which is UXSTACKTOP except in threads), then
+// branch to curenv->env_pgfault_upcall.
 //
 // The page fault upcall might cause another page fault, in which case
 // we branch to the page fault upcall recursively, pushing another
@@ -394,15 +611,16 @@ page_fault_handler(struct Trapframe *tf)
 		goto destroy_env;
 
 	// figure out where to put the new stack frame
+	uintptr_t xstacktop = curenv->env_xstacktop;
 	uintptr_t new_esp;
-	if (tf->tf_esp >= UXSTACKBASE && tf->tf_esp < UXSTACKTOP) {
+	if (tf->tf_esp >= xstacktop - PGSIZE && tf->tf_esp < xstacktop) {
 		// the page fault handler has faulted recursively; we will put the
 		// trap-time state below the old stack frame
 		new_esp = tf->tf_esp;
 	} else {
 		// normal fault; we will put the trap-time state below the top of the
 		// exception stack
-		new_esp = UXSTACKTOP;
+		new_esp = xstacktop;
 	}
 
 	// make sure there's space for the new trap-time state; if not, it's
@@ -413,35 +631,24 @@ page_fault_handler(struct Trapframe *tf)
 	user_mem_assert(curenv, (void *) new_esp - needed_size, 
 		needed_size, PTE_W);
 
-	// map the exception stack into our page table so we can modify it from
-	// kernel land
-	struct PageInfo *pinfo;
-	pinfo = page_lookup(curenv->env_pgdir, (void *) UXSTACKBASE, NULL);
-	assert (pinfo); // should exist since we just did user_mem_assert
-	// the UXSTACKBASE page should never be shared
-	assert (pinfo->pp_ref == 1); 
-
-	if (page_insert(kern_pgdir, pinfo, (void *) UXSTACKBASE, PTE_W))
+	// build the trap-time state here, then push it below an empty word. The
+	// copy can still fail if another thread unmaps the exception stack
+	// under us.
+	struct {
+		struct UTrapframe utf;
+		uint32_t empty;
+	} frame;
+	frame.utf.utf_fault_va = fault_va;
+	frame.utf.utf_err = tf->tf_err;
+	frame.utf.utf_regs = tf->tf_regs;
+	frame.utf.utf_eip = tf->tf_eip;
+	frame.utf.utf_eflags = tf->tf_eflags;
+	frame.utf.utf_esp = tf->tf_esp;
+	frame.empty = 0;
+
+	new_esp -= sizeof(frame);
+	if (copy_to_user((void *) new_esp, &frame, sizeof(frame)))
 		goto destroy_env;
-	assert (pinfo->pp_ref == 2);
-
-	// push empty word
-	new_esp -= sizeof(uint32_t);
-	*(uint32_t *) new_esp = 0;
-
-	// push UTrapFrame
-	new_esp -= sizeof(struct UTrapframe);
-	struct UTrapframe *utf = (struct UTrapframe *) new_esp;
-	utf->utf_fault_va = fault_va;
-	utf->utf_err = tf->tf_err;
-	utf->utf_regs = tf->tf_regs;
-	utf->utf_eip = tf->tf_eip;
-	utf->utf_eflags = tf->tf_eflags;
-	utf->utf_esp = tf->tf_esp;
-
-	// no need to keep the page around in the kernel page table
-	page_remove(kern_pgdir, (void *) UXSTACKBASE);
-	assert (pinfo->pp_ref == 1); 
 
 	// finally return to user-mode, but branch to the page fault handler
 	assert (tf == &curenv->env_tf);
@@ -453,6 +660,7 @@ destroy_env:
 	cprintf("[%08x] user fault va %08x ip %08x\n",
 		curenv->env_id, fault_va, tf->tf_eip);
 	print_trapframe(tf);
+	spin_lock(env_lock(curenv));
 	env_destroy(curenv); // never returns
 }
 
@@ -13,11 +13,18 @@
 extern struct Gatedesc idt[];
 extern struct Pseudodesc idt_pd;
 
+// The registers saved by sysenter_handler in trapentry.S.
+struct SysenterFrame {
+	struct PushRegs sf_regs;	// user's eip in reg_esi, esp in reg_ebp
+	uint32_t sf_eflags;
+} __attribute__((packed));
+
 void init_idt(void);
 void init_idt_percpu(void);
 void print_regs(struct PushRegs *regs);
 void print_trapframe(struct Trapframe *tf);
 void page_fault_handler(struct Trapframe *);
+int32_t sysenter_trap(struct SysenterFrame *frame);
 void backtrace(struct Trapframe *);
 
 #endif /* JOS_KERN_TRAP_H */
@@ -0,0 +1,33 @@
+#include <kern/virtio_blk.h>
+#include <inc/x86.h>
+
+/*
+	The kernel's part of the driver for QEMU's virtio block device, using
+	the legacy (virtio 0.9.5) PCI interface. The file server sets up the
+	virtqueue and issues the requests itself (see fs/virtio_blk.c); the
+	kernel only finds the device and forwards its interrupts.
+*/
+
+// the ISR status register, relative to virtio_blk_io_base. Reading it
+// returns and clears the interrupt bits, which lowers the IRQ line.
+#define VIRTIO_PCI_ISR		0x13
+#define VIRTIO_ISR_QUEUE	0x1
+
+// after finding a virtio block device on the PCI bus, this function finds
+// the port at which its registers are, and the IRQ line it uses.
+// pci_func_enable also lets it master the bus.
+int virtio_blk_attach(struct pci_func *pcif) {
+	pci_func_enable(pcif);
+	virtio_blk_io_base = pcif->reg_base[0];
+	virtio_blk_irq = pcif->irq_line;
+	return 1;
+}
+
+// Acknowledge an interrupt from the device. Returns whether the device
+// raised it because it used some buffers, rather than some other device
+// on the same line.
+bool virtio_blk_intr(void) {
+	if (!virtio_blk_io_base)
+		return 0;
+	return (inb(virtio_blk_io_base + VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE) != 0;
+}
@@ -0,0 +1,21 @@
+#ifndef JOS_KERN_VIRTIO_BLK_H
+#define JOS_KERN_VIRTIO_BLK_H
+
+#include <kern/pci.h>
+#include <kern/pcireg.h>
+#include <inc/env.h>
+
+int virtio_blk_attach(struct pci_func *pcif);
+bool virtio_blk_intr(void);
+
+// the port of the legacy virtio registers of the block device, or 0 if
+// there is none, and the IRQ line it interrupts on.
+uint32_t virtio_blk_io_base;
+uint8_t virtio_blk_irq;
+
+// the env to notify of the device's interrupts, and the bits to notify it
+// with; see sys_virtio_blk_set_notify.
+envid_t virtio_blk_notify_envid;
+uint32_t virtio_blk_notify_bits;
+
+#endif	// !JOS_KERN_VIRTIO_BLK_H
@@ -24,8 +24,8 @@ fsipc(unsigned type, void *dstva)
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U, dstva,
+			NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -183,3 +183,23 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Get the counters of the file server's block cache
+int
+fs_cache_stats(struct BcStats *stats)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_CACHE_STATS, NULL)) < 0)
+		return r;
+	*stats = fsipcbuf.cacheStatsRet;
+	return 0;
+}
+
+// Have the file server write back and empty its block cache, so that the
+// next reads go to the disk
+int
+fs_drop_cache(void)
+{
+	return fsipc(FSREQ_DROP_CACHE, NULL);
+}
+
@@ -6,13 +6,16 @@ void init_fonts() {
 	font_10x18 = &_font_10x18;
 }
 
+// the display server, which we notify after drawing
+static envid_t displayserver;
+
 /* 
  * any program which uses graphics must call this function first
  */
 void init_graphics() {
 	// receive the canvas from the display server
 	Canvas *tmp = CANVAS_BASE - PGSIZE;
-	if (ipc_recv(NULL, tmp, NULL))
+	if (ipc_recv(&displayserver, tmp, NULL))
 		panic("ipc_recv failure in init_graphics");
 
 	// immediately move the canvas into the global variable, so that the
@@ -42,6 +45,10 @@ void draw_pixel(const int x, const int y, const int color) {
 // continuously receive events from the display server and process them
 void event_loop(void (*process_event)(struct graphics_event *)) {
 	while (1) {
+		// we may have drawn something since we last got here; let the
+		// display server know so it redraws the screen.
+		sys_notify(displayserver, DS_NOTIFY_REDRAW);
+
 		ipc_recv(NULL, SHARE_PAGE, NULL);
 		struct graphics_event *ev = (struct graphics_event *) SHARE_PAGE;
 		process_event(ev);
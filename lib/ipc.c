@@ -44,8 +44,8 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// If 'toenv' isn't receiving, this blocks in the kernel until it is.
+// It panics on any error.
 void
 ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 {
@@ -57,18 +57,69 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 		perm = 0;
 	}
 
-	while (1) {
-		error = sys_ipc_try_send(to_env, val, pg, perm);
-		if (error == 0) {
-			break;
-		} 
-		else if (error == -E_IPC_NOT_RECV) {
-			sys_yield();
-		} 
-		else {
-			panic("sys_ipc_try_send returned %d ('%e')", error, error);
-		}
+	if ((error = sys_ipc_send(to_env, val, pg, perm)))
+		panic("sys_ipc_send returned %d ('%e')", error, error);
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv', like
+// ipc_send, and wait for its reply, like ipc_recv with 'rcv_pg' and
+// 'perm_store'. Messages from other envs wait until the reply is in.
+// Returns the value of the reply.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int error;
+
+	if (pg == NULL) {
+		pg = (void *) -1;
+		perm = 0;
+	}
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) -1;
+
+	if ((error = sys_ipc_call(to_env, val, pg, perm, rcv_pg)))
+		panic("sys_ipc_call returned %d ('%e')", error, error);
+
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Reply 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env', which
+// should be waiting in ipc_call, then receive the next message as ipc_recv
+// does. If 'to_env' is 0, or not receiving, the reply is dropped.
+// This is the main loop of a server: one system call per request.
+// On error, *from_env_store is 0 like for a notification, and the error is
+// returned; nothing has been received then.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int32_t error;
+
+	if (pg == NULL) {
+		pg = (void *) -1;
+		perm = 0;
+	}
+	if (rcv_pg == NULL)
+		rcv_pg = (void *) -1;
+
+	error = sys_ipc_reply_recv(to_env, val, pg, perm, rcv_pg);
+
+	if (error) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		return error;
 	}
+
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
 }
 
 // Find the first environment of the given type.  We'll use this to
@@ -1,8 +1,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-#define PTE_COW		0x800
-
 // prints a map showing the process's address space
 // useful for debugging.
 void print_process_mappings() {
@@ -39,3 +37,38 @@ void print_process_mappings() {
 
 	cprintf("----------------------------\n", sys_getenvid());
 }
+
+// Start a batch of page mapping operations from us to env 'dst'.
+void page_batch_init(struct PageBatch *b, envid_t dst) {
+	b->pb_dst = dst;
+	b->pb_nops = 0;
+}
+
+// Queue up an operation, see struct PageOp; it is applied by the next
+// page_batch_flush(), which happens right away if the batch is full.
+// Returns 0 on success, < 0 if that flush fails.
+int page_batch_add(struct PageBatch *b, int op, void *va, void *dst_va,
+				   int perm) {
+	int r;
+
+	if (b->pb_nops == PGOP_MAX && (r = page_batch_flush(b)))
+		return r;
+
+	b->pb_ops[b->pb_nops].po_op = op;
+	b->pb_ops[b->pb_nops].po_va = va;
+	b->pb_ops[b->pb_nops].po_dst_va = dst_va;
+	b->pb_ops[b->pb_nops].po_perm = perm;
+	b->pb_nops++;
+	return 0;
+}
+
+// Apply the queued operations with a single system call.
+// Returns 0 on success, < 0 on error.
+int page_batch_flush(struct PageBatch *b) {
+	int r = 0;
+
+	if (b->pb_nops)
+		r = sys_page_batch(0, b->pb_dst, b->pb_ops, b->pb_nops);
+	b->pb_nops = 0;
+	return r;
+}
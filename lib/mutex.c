@@ -0,0 +1,87 @@
+// Mutexes and condition variables.
+//
+// They work between the threads of an env (see sfork), and between envs
+// that share the page they are on. Neither side makes a system call as
+// long as nobody has to wait: a mutex only goes to the kernel once it is
+// contended, and then remembers that in its state so that unlocking it
+// wakes a waiter up.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+//
+// Lock 'm', sleeping until it is free.
+//
+void
+mutex_lock(struct mutex *m)
+{
+	uint32_t state;
+
+	if ((state = cmpxchg(&m->m_state, 0, 1)) == 0)
+		return;
+
+	// mark the mutex contended before we go to sleep on it; if it turns
+	// out to be free by then, we have it, marked contended just in case.
+	if (state != 2)
+		state = xchg(&m->m_state, 2);
+	while (state != 0) {
+		sys_futex_wait(&m->m_state, 2, 0);
+		state = xchg(&m->m_state, 2);
+	}
+}
+
+//
+// Lock 'm' if it is free. Returns whether we got it.
+//
+bool
+mutex_trylock(struct mutex *m)
+{
+	return cmpxchg(&m->m_state, 0, 1) == 0;
+}
+
+//
+// Unlock 'm', which we hold, and wake up one of its waiters if there may be
+// any.
+//
+void
+mutex_unlock(struct mutex *m)
+{
+	if (xchg(&m->m_state, 0) == 2)
+		sys_futex_wake(&m->m_state, 1);
+}
+
+//
+// Unlock 'm', which we hold, and wait until 'c' is signalled; then lock 'm'
+// again. As usual, the caller checks its condition again afterwards, since
+// the wakeup may be spurious.
+//
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	uint32_t seq = c->c_seq;
+
+	// a signal after this point changes c_seq, so we don't sleep through it.
+	mutex_unlock(m);
+	sys_futex_wait(&c->c_seq, seq, 0);
+	mutex_lock(m);
+}
+
+//
+// Wake up one of the envs waiting on 'c'.
+//
+void
+cond_signal(struct cond *c)
+{
+	__sync_fetch_and_add(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, 1);
+}
+
+//
+// Wake up all the envs waiting on 'c'.
+//
+void
+cond_broadcast(struct cond *c)
+{
+	__sync_fetch_and_add(&c->c_seq, 1);
+	sys_futex_wake(&c->c_seq, NENV);
+}
@@ -8,25 +8,65 @@
 #define REQVA		0x0ffff000
 union Nsipc nsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Our socket rings; see inc/ns.h.
+#define NSRING_SEND	((struct ring *) 0xCFE00000)
+#define NSRING_RECV	((struct ring *) 0xCFF00000)
+
+// The env whose rings the network server knows about. A child inherits
+// the rings, but sets up its own on its first send or recv.
+static envid_t nsring_owner;
+
 // Send an IP request to the network server, and wait for a reply.
-// The request body should be in nsipcbuf, and parts of the response
-// may be written back to nsipcbuf.
 // type: request code, passed as the simple integer IPC value.
+// pg: page to pass along, or NULL.
 // Returns 0 if successful, < 0 on failure.
 static int
-nsipc(unsigned type)
+nscall(unsigned type, void *pg)
 {
 	static envid_t nsenv;
 	if (nsenv == 0)
 		nsenv = ipc_find_env(ENV_TYPE_NS);
 
-	static_assert(sizeof(nsipcbuf) == PGSIZE);
-
 	if (debug)
 		cprintf("[%08x] nsipc %d\n", thisenv->env_id, type);
 
-	ipc_send(nsenv, type, &nsipcbuf, PTE_P|PTE_W|PTE_U);
-	return ipc_recv(NULL, NULL, NULL);
+	return ipc_call(nsenv, type, pg, PTE_P|PTE_W|PTE_U, NULL, NULL);
+}
+
+// Send a request whose body is in nsipcbuf, and wait for a reply. Parts
+// of the response may be written back to nsipcbuf.
+static int
+nsipc(unsigned type)
+{
+	static_assert(sizeof(nsipcbuf) == PGSIZE);
+	return nscall(type, &nsipcbuf);
+}
+
+// Set up our socket rings and pass them to the network server, unless
+// that has been done already.
+static int
+nsring_setup(void)
+{
+	int i, r;
+
+	if (nsring_owner == thisenv->env_id)
+		return 0;
+
+	// ring_init maps fresh pages over any rings of our parent.
+	if ((r = ring_init(NSRING_SEND, NSRING_SLOTS, NSRING_SLOT_SIZE, 1, 1)) < 0
+		|| (r = ring_init(NSRING_RECV, NSRING_SLOTS, NSRING_SLOT_SIZE, 
+						  1, 1)) < 0)
+		return r;
+
+	for (i = 0; i < 2 * NSRING_PAGES; i++) {
+		void *pg = (void *) (i < NSRING_PAGES ? NSRING_SEND : NSRING_RECV)
+			+ (i % NSRING_PAGES) * PGSIZE;
+		if ((r = nscall(NSREQ_RING, pg)) < 0)
+			return r;
+	}
+
+	nsring_owner = thisenv->env_id;
+	return 0;
 }
 
 int
@@ -85,32 +125,64 @@ nsipc_listen(int s, int backlog)
 	return nsipc(NSREQ_LISTEN);
 }
 
+// Like send and recv, at most NSRING_SLOTS * NSRING_MAXDATA bytes go
+// through the rings per call. The network server empties the send ring
+// before it replies, and we take everything off the receive ring before
+// we return, so both rings are empty between calls.
 int
 nsipc_recv(int s, void *mem, int len, unsigned int flags)
 {
-	int r;
-
-	nsipcbuf.recv.req_s = s;
-	nsipcbuf.recv.req_len = len;
-	nsipcbuf.recv.req_flags = flags;
-
-	if ((r = nsipc(NSREQ_RECV)) >= 0) {
-		assert(r < 1600 && r <= len);
-		memmove(mem, nsipcbuf.recvRet.ret_buf, r);
+	struct Nsring_msg *m;
+	int r, n, got;
+
+	if ((r = nsring_setup()) < 0)
+		return r;
+
+	m = ring_write_slot(NSRING_SEND, 0);
+	m->m_s = s;
+	m->m_len = MIN(len, NSRING_SLOTS * NSRING_MAXDATA);
+	m->m_flags = flags;
+	ring_write_done(NSRING_SEND);
+
+	if ((r = nscall(NSREQ_RECV, NULL)) < 0)
+		return r;
+
+	assert(r <= len);
+	for (n = 0; n < r; n += got) {
+		// the slot belongs to the network server again after
+		// ring_read_done, so take what we need from it first.
+		m = ring_read_slot(NSRING_RECV, 0);
+		assert(m);
+		got = m->m_len;
+		assert(got > 0 && got <= r - n);
+		memmove(mem + n, m->m_data, got);
+		ring_read_done(NSRING_RECV);
 	}
-
 	return r;
 }
 
 int
 nsipc_send(int s, const void *buf, int size, unsigned int flags)
 {
-	nsipcbuf.send.req_s = s;
-	assert(size < 1600);
-	memmove(&nsipcbuf.send.req_buf, buf, size);
-	nsipcbuf.send.req_size = size;
-	nsipcbuf.send.req_flags = flags;
-	return nsipc(NSREQ_SEND);
+	struct Nsring_msg *m;
+	int r, n;
+
+	if ((r = nsring_setup()) < 0)
+		return r;
+
+	size = MIN(size, NSRING_SLOTS * NSRING_MAXDATA);
+	n = 0;
+	do {
+		m = ring_write_slot(NSRING_SEND, 0);
+		m->m_s = s;
+		m->m_len = MIN(size - n, NSRING_MAXDATA);
+		m->m_flags = flags;
+		memmove(m->m_data, buf + n, m->m_len);
+		n += m->m_len;
+		ring_write_done(NSRING_SEND);
+	} while (n < size);
+
+	return nscall(NSREQ_SEND, NULL);
 }
 
 int
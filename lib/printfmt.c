@@ -37,6 +37,8 @@ static const char * const error_string[MAXERROR] =
 	[E_NOT_SUPP]	= "operation not supported",
 
 	[E_NOSYS]		= "no such syscall",
+	[E_AGAIN]		= "try again",
+	[E_TIMEOUT]		= "timed out",
 };
 
 /*
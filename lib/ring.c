@@ -0,0 +1,152 @@
+// Single-producer, single-consumer rings of fixed-size slots.
+//
+// A ring is mapped PTE_SHARE, so it is shared with the envs that are forked
+// or spawned after ring_init(). One env fills slots and another takes them,
+// without any system calls as long as neither has to wait. A side that has
+// to wait leaves its envid in the ring and sleeps in sys_wait_notify; the
+// other side rings that doorbell with sys_notify once it has made progress.
+// A side that is busy gets no notifications, so a consumer which keeps up
+// takes many messages per wakeup.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+static inline void *
+ring_slot(struct ring *r, uint32_t i)
+{
+	return (void *) r + PGSIZE + (i % r->r_nslots) * r->r_slotsize;
+}
+
+//
+// Set up a ring of 'nslots' slots of 'slotsize' bytes at 'r', which must be
+// page-aligned, allocating the pages it needs. The consumer is woken up
+// with notification bit 'cons_bit', the producer with 'prod_bit'.
+// Returns 0 on success, < 0 on error.
+//
+int
+ring_init(struct ring *r, size_t nslots, size_t slotsize, uint32_t cons_bit,
+		  uint32_t prod_bit)
+{
+	size_t size = PGSIZE + ROUNDUP(nslots * slotsize, PGSIZE);
+	size_t offset;
+	int result;
+
+	if (PGOFF(r) || !nslots || !slotsize || !cons_bit || !prod_bit)
+		return -E_INVAL;
+
+	for (offset = 0; offset < size; offset += PGSIZE)
+		if ((result = sys_page_alloc(0, (void *) r + offset, 
+									 PTE_P | PTE_U | PTE_W | PTE_SHARE)))
+			return result;
+
+	r->r_head = r->r_tail = 0;
+	r->r_cons_waiter = r->r_prod_waiter = 0;
+	r->r_cons_bit = cons_bit;
+	r->r_prod_bit = prod_bit;
+	r->r_nslots = nslots;
+	r->r_slotsize = slotsize;
+	return 0;
+}
+
+// Wake up the env sleeping on '*waiter', if any.
+static void
+ring_doorbell(volatile uint32_t *waiter, uint32_t bit)
+{
+	envid_t w;
+
+	// xchg also orders our update of head or tail before the read of
+	// *waiter; see ring_wait.
+	if ((w = xchg(waiter, 0)))
+		sys_notify(w, bit);
+}
+
+// Wait until ready(r) holds, or just arm the doorbell if !wait. Returns
+// whether ready(r) holds.
+static bool
+ring_wait(struct ring *r, bool (*ready)(struct ring *), 
+		  volatile uint32_t *waiter, uint32_t bit, bool wait)
+{
+	uint32_t other = 0;
+	bool ok;
+
+	while (!(ok = ready(r))) {
+		// leave our envid for the other side first, then look again: either
+		// it sees our envid, or we see its progress.
+		xchg(waiter, thisenv->env_id);
+		if ((ok = ready(r)) || !wait)
+			break;
+
+		// notifications for anything else are handed back below.
+		other |= sys_wait_notify(0) & ~bit;
+	}
+
+	if (other)
+		sys_notify(0, other);
+	return ok;
+}
+
+static bool
+ring_nonempty(struct ring *r)
+{
+	return r->r_head != r->r_tail;
+}
+
+static bool
+ring_nonfull(struct ring *r)
+{
+	return r->r_head - r->r_tail != r->r_nslots;
+}
+
+//
+// Return the next slot to read, or NULL if the ring is empty and !wait; the
+// consumer is then notified once something arrives. With 'wait', sleep
+// until there is something to read.
+//
+void *
+ring_read_slot(struct ring *r, bool wait)
+{
+	if (!ring_wait(r, ring_nonempty, &r->r_cons_waiter, r->r_cons_bit, wait))
+		return NULL;
+
+	// don't read the slot before we have seen head move past it.
+	asm volatile("" ::: "memory");
+	return ring_slot(r, r->r_tail);
+}
+
+//
+// Hand the slot from ring_read_slot() back to the producer.
+//
+void
+ring_read_done(struct ring *r)
+{
+	asm volatile("" ::: "memory");
+	r->r_tail++;
+	ring_doorbell(&r->r_prod_waiter, r->r_prod_bit);
+}
+
+//
+// Return the next slot to fill, or NULL if the ring is full and !wait; the
+// producer is then notified once there is room. With 'wait', sleep until
+// there is room.
+//
+void *
+ring_write_slot(struct ring *r, bool wait)
+{
+	if (!ring_wait(r, ring_nonfull, &r->r_prod_waiter, r->r_prod_bit, wait))
+		return NULL;
+
+	asm volatile("" ::: "memory");
+	return ring_slot(r, r->r_head);
+}
+
+//
+// Pass the slot from ring_write_slot() on to the consumer.
+//
+void
+ring_write_done(struct ring *r)
+{
+	// the contents of the slot must be in place before head moves.
+	asm volatile("" ::: "memory");
+	r->r_head++;
+	ring_doorbell(&r->r_cons_waiter, r->r_cons_bit);
+}
@@ -310,8 +310,11 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 static int
 copy_shared_pages(envid_t cid)
 {
+	static struct PageBatch batch;
 	int i, j, r;
 
+	page_batch_init(&batch, cid);
+
 	// walk over the page directory, finding pages which are shared, and copy
 	// those to the child
 	for (i = 0; i < NPDENTRIES; i++) {
@@ -331,11 +334,12 @@ copy_shared_pages(envid_t cid)
 				continue;
 
 			void * va = (void *) (page_number * PGSIZE);
-			if ((r = sys_page_map(0, va, cid, va, pte & PTE_SYSCALL)))
+			if ((r = page_batch_add(&batch, PGOP_MAP, va, va, 
+									pte & PTE_SYSCALL)))
 				return r;
 		}
 	}
 
-	return 0;
+	return page_batch_flush(&batch);
 }
 
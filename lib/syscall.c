@@ -1,12 +1,45 @@
 // System call stubs.
 
 #include <inc/syscall.h>
+#include <inc/x86.h>
 #include <inc/lib.h>
 
+// 1 if the CPU has sysenter, which the kernel then sets up for us, 0 if it
+// hasn't, -1 until we have asked.
+static int have_sysenter = -1;
+
 static inline int32_t
 syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
 {
 	int32_t ret;
+	uint32_t edx, ecx;
+
+	if (have_sysenter < 0) {
+		cpuid(1, NULL, NULL, NULL, &edx);
+		have_sysenter = !!(edx & CPUID_SEP);
+	}
+
+	// Fast system call: sysenter doesn't save the return address and stack
+	// pointer, so we pass them in SI and BP, with BP saved on the stack.
+	// That leaves no room for a fifth parameter. On the way back, sysexit
+	// takes them from DX and CX, so those two are clobbered.
+	if (have_sysenter && !a5) {
+		asm volatile("pushl %%ebp\n"
+			     "movl %%esp, %%ebp\n"
+			     "leal 1f, %%esi\n"
+			     "sysenter\n"
+			     "1: popl %%ebp\n"
+			     : "=a" (ret),
+			       "=d" (edx),
+			       "=c" (ecx)
+			     : "a" (num),
+			       "1" (a1),
+			       "2" (a2),
+			       "b" (a3),
+			       "D" (a4)
+			     : "esi", "cc", "memory");
+		goto out;
+	}
 
 	// Generic system call: pass system call number in AX,
 	// up to five parameters in DX, CX, BX, DI, SI.
@@ -31,6 +64,7 @@ syscall(int num, int check, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		       "S" (a5)
 		     : "cc", "memory");
 
+out:
 	if(check && ret > 0)
 		panic("syscall %d returned %d (> 0)", num, ret);
 
@@ -85,6 +119,26 @@ sys_page_unmap(envid_t envid, void *va)
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_batch(envid_t src_envid, envid_t dst_envid, struct PageOp *ops,
+			   size_t nops)
+{
+	return syscall(SYS_page_batch, 0, src_envid, dst_envid, (uint32_t) ops,
+				   nops, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+envid_t
+sys_sfork(void)
+{
+	return syscall(SYS_sfork, 0, 0, 0, 0, 0, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -111,18 +165,81 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm,
+		       (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm,
+		   void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 1, envid, value, (uint32_t) srcva,
+		       perm, (uint32_t) dstva);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
+unsigned int
+sys_time_usec(void)
+{
+	return (unsigned int) syscall(SYS_time_usec, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_sleep_until(unsigned int deadline)
+{
+	return syscall(SYS_sleep_until, 0, deadline, 0, 0, 0, 0);
+}
+
+int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_notify, 0, envid, bits, 0, 0, 0);
+}
+
+uint32_t
+sys_wait_notify(unsigned int deadline)
+{
+	return syscall(SYS_wait_notify, 0, deadline, 0, 0, 0, 0);
+}
+
+int
+sys_bind_notify(bool bind)
+{
+	return syscall(SYS_bind_notify, 0, bind, 0, 0, 0, 0);
+}
+
+int
+sys_futex_wait(volatile uint32_t *addr, uint32_t val, unsigned int deadline)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, val, deadline, 0, 0);
+}
+
+int
+sys_futex_wake(volatile uint32_t *addr, int n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
 int
 sys_transmit(void *addr, size_t length) {
 	return syscall(SYS_transmit, 0, (uint32_t) addr, length, 0, 0, 0);
@@ -149,6 +266,32 @@ unsigned int sys_get_ide_io_base() {
 	return (unsigned int) syscall(SYS_get_ide_io_base, 0, 0, 0, 0, 0, 0);
 }
 
+unsigned int sys_get_ide_bm_base() {
+	return (unsigned int) syscall(SYS_get_ide_bm_base, 0, 0, 0, 0, 0, 0);
+}
+
+int sys_dma_alloc(void *va, size_t npages, physaddr_t *pa_store) {
+	return syscall(SYS_dma_alloc, 0, (uint32_t) va, (uint32_t) npages, 
+				   (uint32_t) pa_store, 0, 0);
+}
+
+int sys_page_phys(const void *va, size_t npages, physaddr_t *pa_store) {
+	return syscall(SYS_page_phys, 0, (uint32_t) va, (uint32_t) npages, 
+				   (uint32_t) pa_store, 0, 0);
+}
+
+int sys_ide_set_notify(uint32_t bits) {
+	return syscall(SYS_ide_set_notify, 0, bits, 0, 0, 0, 0);
+}
+
+unsigned int sys_get_virtio_blk_io_base() {
+	return (unsigned int) syscall(SYS_get_virtio_blk_io_base, 0, 0, 0, 0, 0, 0);
+}
+
+int sys_virtio_blk_set_notify(uint32_t bits) {
+	return syscall(SYS_virtio_blk_set_notify, 0, bits, 0, 0, 0, 0);
+}
+
 int sys_get_mode_info(struct vbe_mode_info *p) {
 	return syscall(SYS_get_mode_info, 0, (uint32_t) p, 0, 0, 0, 0);
 }
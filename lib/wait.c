@@ -1,13 +1,15 @@
 #include <inc/lib.h>
 
-// Waits until 'envid' exits.
+// Waits until 'envid' exits. The kernel wakes up the envs waiting on the
+// status of an env once it is freed.
 void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	unsigned status;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	while (e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		sys_futex_wait((volatile uint32_t *) &e->env_status, status, 0);
 }
@@ -31,12 +31,45 @@ thread_wakeup(volatile uint32_t *addr) {
     }
 }
 
+// Is tc in thread_wait() with nothing to wake it up yet?
+static int
+thread_blocked(struct thread_context *tc) {
+    if (!tc->tc_waiting || tc->tc_wakeup)
+	return 0;
+    if (tc->tc_wait_addr && *tc->tc_wait_addr != tc->tc_wait_val)
+	return 0;
+    return 1;
+}
+
+// If every thread is blocked in thread_wait(), none of them can wake
+// another before one times out, so we might as well sleep in the kernel
+// until then instead of yielding around in circles. Returns the deadline
+// to sleep until, or 0 if some thread can run.
+static uint32_t
+thread_all_blocked(void) {
+    struct thread_context *tc;
+    uint32_t msec = cur_tc->tc_wait_msec;
+
+    if (!thread_blocked(cur_tc))
+	return 0;
+    for (tc = thread_queue.tq_first; tc; tc = tc->tc_queue_link) {
+	if (!thread_blocked(tc))
+	    return 0;
+	msec = MIN(msec, tc->tc_wait_msec);
+    }
+    return msec;
+}
+
 void
 thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
     uint32_t s = sys_time_msec();
     uint32_t p = s;
+    uint32_t until;
 
     cur_tc->tc_wait_addr = addr;
+    cur_tc->tc_wait_val = val;
+    cur_tc->tc_wait_msec = msec;
+    cur_tc->tc_waiting = 1;
     cur_tc->tc_wakeup = 0;
 
     while (p < msec) {
@@ -47,10 +80,17 @@ thread_wait(volatile uint32_t *addr, uint32_t val, uint32_t msec) {
 	if (cur_tc->tc_wakeup)
 	    break;
 
-	thread_yield();
+	// sleep at most a second at a time so that the microsecond
+	// deadline can't wrap
+	until = thread_all_blocked();
+	if (until > p)
+	    sys_sleep_until(sys_time_usec() + MIN(until - p, 1000) * 1000);
+	else
+	    thread_yield();
 	p = sys_time_msec();
     }
 
+    cur_tc->tc_waiting = 0;
     cur_tc->tc_wait_addr = 0;
     cur_tc->tc_wakeup = 0;
 }
@@ -44,11 +44,9 @@
 
 #include <netif/etharp.h>
 
-#define PKTMAP		0x10000000
-
 struct jif {
     struct eth_addr *ethaddr;
-    envid_t envid;
+    struct ring *txring;	/* to the output env */
 };
 
 static void
@@ -80,14 +78,13 @@ low_level_init(struct netif *netif)
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
-    int r = sys_page_alloc(0, (void *)PKTMAP, PTE_U|PTE_W|PTE_P);
-    if (r < 0)
-	panic("jif: could not allocate page of memory");
-    struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
-
     struct jif *jif;
     jif = netif->state;
 
+    /* waits for the output env if the ring is full */
+    struct jif_pkt *pkt = ring_write_slot(jif->txring, 1);
+    int maxsize = jif->txring->r_slotsize - sizeof(struct jif_pkt);
+
     char *txbuf = pkt->jp_data;
     int txsize = 0;
     struct pbuf *q;
@@ -96,7 +93,7 @@ low_level_output(struct netif *netif, struct pbuf *p)
 	   time. The size of the data in each pbuf is kept in the ->len
 	   variable. */
 
-	if (txsize + q->len > 2000)
+	if (txsize + q->len > maxsize)
 	    panic("oversized packet, fragment %d txsize %d\n", q->len, txsize);
 	memcpy(&txbuf[txsize], q->payload, q->len);
 	txsize += q->len;
@@ -104,8 +101,7 @@ low_level_output(struct netif *netif, struct pbuf *p)
 
     pkt->jp_len = txsize;
 
-    ipc_send(jif->envid, NSREQ_OUTPUT, (void *)pkt, PTE_P|PTE_W|PTE_U);
-    sys_page_unmap(0, (void *)pkt);
+    ring_write_done(jif->txring);
 
     return ERR_OK;
 }
@@ -222,7 +218,6 @@ err_t
 jif_init(struct netif *netif)
 {
     struct jif *jif;
-    envid_t *output_envid; 
 
     jif = mem_malloc(sizeof(struct jif));
 
@@ -231,7 +226,7 @@ jif_init(struct netif *netif)
 	return ERR_MEM;
     }
 
-    output_envid = (envid_t *)netif->state;
+    jif->txring = (struct ring *)netif->state;
 
     netif->state = jif;
     netif->output = jif_output;
@@ -239,7 +234,6 @@ jif_init(struct netif *netif)
     memcpy(&netif->name[0], "en", 2);
 
     jif->ethaddr = (struct eth_addr *)&(netif->hwaddr[0]);
-    jif->envid = *output_envid; 
 
     low_level_init(netif);
 
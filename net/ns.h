@@ -13,6 +13,26 @@
 #define QUEUE_SIZE	20
 #define REQVA		(0x0ffff000 - QUEUE_SIZE * PGSIZE)
 
+// Rings that carry packets from the input env to the network server, and
+// from the network server to the output env; see lib/ring.c. The network
+// server sets them up before it forks those envs. Each slot holds a struct
+// jif_pkt.
+#define RX_RING		((struct ring *) 0x11000000)
+#define TX_RING		((struct ring *) 0x11100000)
+#define PKT_RING_SLOTS	64
+#define PKT_SLOT_SIZE	2048
+
+// Notification bits of the rings. The network server is told about new
+// packets on the RX ring with NS_NOTIFY_RX, and about room on the TX ring
+// with NS_NOTIFY_TX; the input and output envs only use NS_NOTIFY_RX.
+#define NS_NOTIFY_RX	0x1
+#define NS_NOTIFY_TX	0x2
+
+// Where the network server maps the socket rings of its clients; see
+// inc/ns.h. Each client gets its send ring followed by its receive ring.
+#define CLIENTVA	0x12000000
+#define NS_MAXCLIENTS	32
+
 /* timer.c */
 void timer(envid_t ns_envid, uint32_t initial_to);
 
@@ -3,31 +3,20 @@
 
 extern union Nsipc nsipcbuf;
 
-#define PKTMAP		0x10000000
-
 void
 output(envid_t ns_envid)
 {
-	int r;
-	struct jif_pkt *pkt = (struct jif_pkt *)PKTMAP;
-	envid_t from_envid = 0;
+	struct jif_pkt *pkt;
 
 	binaryname = "ns_output";
 
 	while (1) {
-		// read a packet from the network server
-		if ((r = ipc_recv(&from_envid, (void *) pkt, NULL)) != NSREQ_OUTPUT) {
-			cprintf("warning: output env got an invalid request\n");
-			continue;
-		}
-
-		if (from_envid != ns_envid) {
-			cprintf("warning: output env got IPC from unexpected env %d\n",
-					from_envid);
-			continue;
-		}
+		// take the next packet from the network server, sleeping while
+		// there is none
+		pkt = ring_read_slot(TX_RING, 1);
 
 		// send the packet to the device driver
 		sys_transmit(&pkt->jp_data, pkt->jp_len);
+		ring_read_done(TX_RING);
 	}
 }
@@ -47,6 +47,31 @@ static envid_t timer_envid;
 static envid_t input_envid;
 static envid_t output_envid;
 
+// Replies of finished requests, which the serve loop sends before it waits
+// for the next request; the last one goes along with that wait, see
+// ipc_reply_recv().
+#define NREPLIES 16
+
+struct reply {
+	envid_t whom;
+	int32_t r;
+};
+
+static struct reply replies[NREPLIES];
+static int nreplies;
+
+static void
+queue_reply(envid_t whom, int32_t r)
+{
+	if (nreplies == NREPLIES) {
+		ipc_send(whom, r, 0, 0);
+		return;
+	}
+	replies[nreplies].whom = whom;
+	replies[nreplies].r = r;
+	nreplies++;
+}
+
 static bool buse[QUEUE_SIZE];
 static int next_i(int i) { return (i+1) % QUEUE_SIZE; }
 static int prev_i(int i) { return (i ? i-1 : QUEUE_SIZE-1); }
@@ -142,7 +167,7 @@ serve_init(uint32_t ipaddr, uint32_t netmask, uint32_t gw)
 	thread_wait(&done, 0, (uint32_t)~0);
 	lwip_core_lock();
 
-	lwip_init(&nif, &output_envid, ipaddr, netmask, gw);
+	lwip_init(&nif, TX_RING, ipaddr, netmask, gw);
 
 	start_timer(&t_arp, &etharp_tmr, "arp timer", ARP_TMR_INTERVAL);
 	start_timer(&t_tcpf, &tcp_fasttmr, "tcp f timer", TCP_FAST_INTERVAL);
@@ -174,13 +199,187 @@ process_timer(envid_t envid) {
 	now = sys_time_msec();
 
 	to = TIMER_INTERVAL - (now - start);
-	ipc_send(envid, to, 0, 0);
+	queue_reply(envid, to);
+}
+
+// whether rx_thread is running
+static bool rx_running;
+
+// Feed the packets which the input env has put on the RX ring to lwIP. Once
+// the ring is empty, its doorbell is armed, and the serve loop starts us
+// again when it goes off.
+static void
+rx_thread(uint32_t arg) {
+	struct jif_pkt *pkt;
+
+	while ((pkt = ring_read_slot(RX_RING, 0))) {
+		jif_input(&nif, pkt);
+		ring_read_done(RX_RING);
+	}
+	rx_running = 0;
+}
+
+static void
+start_rx_thread(void) {
+	if (rx_running)
+		return;
+	rx_running = 1;
+	thread_create(0, "rx_thread", rx_thread, 0);
+}
+
+// Clients whose socket rings we have mapped; see inc/ns.h.
+struct client {
+	envid_t c_envid;	// 0 if the entry is unused
+	int c_npages;		// Ring pages mapped so far
+	int c_busy;			// Send and recv requests in progress
+};
+
+static struct client clients[NS_MAXCLIENTS];
+
+// Ring 0 is c's send ring, ring 1 its receive ring.
+static struct ring *
+client_ring(struct client *c, int i)
+{
+	return (struct ring *) (CLIENTVA + 
+		((c - clients) * 2 + i) * NSRING_PAGES * PGSIZE);
+}
+
+// Whether the client has exited, so its entry can be reused.
+static bool
+client_gone(struct client *c)
+{
+	const volatile struct Env *e = &envs[ENVX(c->c_envid)];
+	return e->env_id != c->c_envid || e->env_status == ENV_FREE;
+}
+
+// Map page 'pg' as the next page of the rings of 'whom'.
+static int
+client_add_page(envid_t whom, void *pg)
+{
+	struct client *c, *spare = NULL;
+	int r;
+
+	for (c = clients; c < clients + NS_MAXCLIENTS; c++) {
+		if (c->c_envid == whom)
+			break;
+		if (!spare && (!c->c_envid || (!c->c_busy && client_gone(c))))
+			spare = c;
+	}
+	if (c == clients + NS_MAXCLIENTS) {
+		if (!(c = spare))
+			return -E_NO_MEM;
+		c->c_envid = whom;
+		c->c_npages = 0;
+		c->c_busy = 0;
+	}
+
+	// the client starts over, e.g. after an error.
+	if (c->c_npages == 2 * NSRING_PAGES)
+		c->c_npages = 0;
+
+	if ((r = sys_page_map(0, pg, 0, 
+						  (void *) client_ring(c, 0) + c->c_npages * PGSIZE,
+						  PTE_P | PTE_U | PTE_W)) < 0) {
+		c->c_envid = 0;
+		return r;
+	}
+	c->c_npages++;
+	return 0;
+}
+
+// Return the client 'whom' if all of its ring pages are mapped, or NULL.
+static struct client *
+client_lookup(envid_t whom)
+{
+	struct client *c;
+	int i;
+
+	for (c = clients; c < clients + NS_MAXCLIENTS; c++) {
+		if (c->c_envid != whom || c->c_npages != 2 * NSRING_PAGES)
+			continue;
+		// the client can write its rings; at least keep us inside them.
+		for (i = 0; i < 2; i++)
+			if (client_ring(c, i)->r_nslots != NSRING_SLOTS ||
+				client_ring(c, i)->r_slotsize != NSRING_SLOT_SIZE)
+				return NULL;
+		return c;
+	}
+	return NULL;
+}
+
+// Whether there is a message on ring 'r'. We look before ring_read_slot(),
+// which would arm the doorbell, as the client never waits for us.
+static bool
+ring_ready(struct ring *r)
+{
+	return r->r_head != r->r_tail;
+}
+
+// Send the data on c's send ring. Returns the number of bytes sent, or
+// the error of the first send if none were.
+static int
+serve_send(struct client *c)
+{
+	struct ring *sr = client_ring(c, 0);
+	struct Nsring_msg *m;
+	int i, r, n = 0, err = 0;
+
+	for (i = 0; i < NSRING_SLOTS && ring_ready(sr); i++) {
+		m = ring_read_slot(sr, 0);
+		if (!err) {
+			if (m->m_len < 0 || m->m_len > NSRING_MAXDATA)
+				r = -E_INVAL;
+			else
+				r = lwip_send(m->m_s, m->m_data, m->m_len, m->m_flags);
+			if (r < 0)
+				err = r;
+			else
+				n += r;
+		}
+		ring_read_done(sr);
+	}
+	return n ? n : err;
+}
+
+// Receive what the message on c's send ring asks for onto c's receive
+// ring. Only the first recv may block; after that we take what has
+// arrived already, for as long as it fills whole slots.
+static int
+serve_recv(struct client *c)
+{
+	struct ring *sr = client_ring(c, 0);
+	struct ring *rr = client_ring(c, 1);
+	struct Nsring_msg *m;
+	unsigned int flags;
+	int s, len, want, r, n = 0;
+
+	if (!ring_ready(sr))
+		return -E_INVAL;
+	m = ring_read_slot(sr, 0);
+	s = m->m_s;
+	len = m->m_len;
+	flags = m->m_flags;
+	ring_read_done(sr);
+
+	while (n < len && (m = ring_write_slot(rr, 0))) {
+		want = MIN(len - n, NSRING_MAXDATA);
+		if ((r = lwip_recv(s, m->m_data, want, flags)) <= 0)
+			return n ? n : r;
+		m->m_len = r;
+		ring_write_done(rr);
+		n += r;
+		if (r < want)
+			break;
+		flags |= MSG_DONTWAIT;
+	}
+	return n;
 }
 
 struct st_args {
 	int32_t reqno;
 	uint32_t whom;
-	union Nsipc *req;
+	union Nsipc *req;	// NULL for requests through the client's rings
+	struct client *client;
 };
 
 static void
@@ -217,23 +416,15 @@ serve_thread(uint32_t a) {
 		r = lwip_listen(req->listen.req_s, req->listen.req_backlog);
 		break;
 	case NSREQ_RECV:
-		// Note that we read the request fields before we
-		// overwrite it with the response data.
-		r = lwip_recv(req->recv.req_s, req->recvRet.ret_buf,
-			      req->recv.req_len, req->recv.req_flags);
+		r = serve_recv(args->client);
 		break;
 	case NSREQ_SEND:
-		r = lwip_send(req->send.req_s, &req->send.req_buf,
-			      req->send.req_size, req->send.req_flags);
+		r = serve_send(args->client);
 		break;
 	case NSREQ_SOCKET:
 		r = lwip_socket(req->socket.req_domain, req->socket.req_type,
 				req->socket.req_protocol);
 		break;
-	case NSREQ_INPUT:
-		jif_input(&nif, (void *)&req->pkt);
-		r = 0;
-		break;
 	default:
 		cprintf("Invalid request code %d from %08x\n", args->whom, args->req);
 		r = -E_INVAL;
@@ -246,11 +437,13 @@ serve_thread(uint32_t a) {
 		perror(buf);
 	}
 
-	if (args->reqno != NSREQ_INPUT)
-		ipc_send(args->whom, r, 0, 0);
+	queue_reply(args->whom, r);
 
-	put_buffer(args->req);
-	sys_page_unmap(0, (void*) args->req);
+	if (req) {
+		put_buffer(req);
+		sys_page_unmap(0, (void*) req);
+	} else
+		args->client->c_busy--;
 	free(args);
 }
 
@@ -258,23 +451,56 @@ void
 serve(void) {
 	int32_t reqno;
 	uint32_t whom;
-	int i, perm;
+	struct reply last;
+	struct client *c;
+	int i, r, perm;
 	void *va;
 
+	// the rings' doorbells end our waits for requests; see below.
+	sys_bind_notify(1);
+	start_rx_thread();
+
 	while (1) {
-		// ipc_recv will block the entire process, so we flush
+		// ipc_reply_recv will block the entire process, so we flush
 		// all pending work from other threads.  We limit the
 		// number of yields in case there's a rogue thread.
 		for (i = 0; thread_wakeups_pending() && i < 32; ++i)
 			thread_yield();
 
+		last.whom = 0;
+		last.r = 0;
+		if (nreplies) {
+			for (i = 0; i < nreplies - 1; i++)
+				ipc_send(replies[i].whom, replies[i].r, 0, 0);
+			last = replies[nreplies - 1];
+			nreplies = 0;
+		}
+
 		perm = 0;
 		va = get_buffer();
-		reqno = ipc_recv((int32_t *) &whom, (void *) va, &perm);
+		reqno = ipc_reply_recv(last.whom, last.r, 0, 0,
+				       (int32_t *) &whom, (void *) va, &perm);
 		if (debug) {
 			cprintf("ns req %d from %08x\n", reqno, whom);
 		}
 
+		// the reply couldn't be sent, and nothing was received.
+		if (whom == 0 && reqno < 0) {
+			cprintf("ns: reply to %08x failed: %e\n", last.whom, reqno);
+			put_buffer(va);
+			continue;
+		}
+
+		// a notification: the input env has put packets on the RX ring. A
+		// full TX ring is waited for in ring_write_slot(), which keeps any
+		// other notification bits for us.
+		if (whom == 0) {
+			if (reqno & NS_NOTIFY_RX)
+				start_rx_thread();
+			put_buffer(va);
+			continue;
+		}
+
 		// first take care of requests that do not contain an argument page
 		if (reqno == NSREQ_TIMER) {
 			process_timer(whom);
@@ -282,8 +508,26 @@ serve(void) {
 			continue;
 		}
 
-		// All remaining requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		if (reqno == NSREQ_RING) {
+			r = (perm & PTE_P) ? client_add_page(whom, va) : -E_INVAL;
+			sys_page_unmap(0, va);
+			put_buffer(va);
+			queue_reply(whom, r);
+			continue;
+		}
+
+		// send and recv go through the client's rings; all remaining
+		// requests must contain an argument page
+		c = NULL;
+		if (reqno == NSREQ_SEND || reqno == NSREQ_RECV) {
+			put_buffer(va);
+			va = NULL;
+			if (!(c = client_lookup(whom))) {
+				queue_reply(whom, -E_INVAL);
+				continue;
+			}
+			c->c_busy++;
+		} else if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n", whom);
 			continue; // just leave it hanging...
 		}
@@ -297,6 +541,7 @@ serve(void) {
 		args->reqno = reqno;
 		args->whom = whom;
 		args->req = va;
+		args->client = c;
 
 		thread_create(0, "serve_thread", serve_thread, (uint32_t)args);
 		thread_yield(); // let the thread created run
@@ -318,6 +563,13 @@ umain(int argc, char **argv)
 
 	binaryname = "ns";
 
+	// set up the packet rings before forking, so they get shared
+	if (ring_init(RX_RING, PKT_RING_SLOTS, PKT_SLOT_SIZE, 
+				  NS_NOTIFY_RX, NS_NOTIFY_RX) < 0 ||
+		ring_init(TX_RING, PKT_RING_SLOTS, PKT_SLOT_SIZE, 
+				  NS_NOTIFY_RX, NS_NOTIFY_TX) < 0)
+		panic("could not allocate the packet rings");
+
 	// fork off the timer thread which will send us periodic messages
 	timer_envid = fork();
 	if (timer_envid < 0)
@@ -328,7 +580,7 @@ umain(int argc, char **argv)
 	}
 
 	// fork off the input thread which will poll the NIC driver for input
-	// packets
+	// packets and put them on the RX ring
 	input_envid = fork();
 	if (input_envid < 0)
 		panic("error forking");
@@ -337,8 +589,8 @@ umain(int argc, char **argv)
 		return;
 	}
 
-	// fork off the output thread that will send the packets to the NIC
-	// driver
+	// fork off the output thread that will send the packets from the TX
+	// ring to the NIC driver
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
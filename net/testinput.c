@@ -4,8 +4,6 @@
 static envid_t output_envid;
 static envid_t input_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
-
 
 static void
 announce(void)
@@ -19,10 +17,7 @@ announce(void)
 	uint8_t mac[6] = {0x52, 0x54, 0x00, 0x12, 0x34, 0x56};
 	uint32_t myip = inet_addr(IP);
 	uint32_t gwip = inet_addr(DEFAULT);
-	int r;
-
-	if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-		panic("sys_page_map: %e", r);
+	struct jif_pkt *pkt = ring_write_slot(TX_RING, 1);
 
 	struct etharp_hdr *arp = (struct etharp_hdr*)pkt->jp_data;
 	pkt->jp_len = sizeof(*arp);
@@ -39,8 +34,7 @@ announce(void)
 	memset(arp->dhwaddr.addr,  0x00,  ETHARP_HWADDR_LEN);
 	memcpy(arp->dipaddr.addrw, &gwip, 4);
 
-	ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
-	sys_page_unmap(0, pkt);
+	ring_write_done(TX_RING);
 }
 
 static void
@@ -72,6 +66,12 @@ umain(int argc, char **argv)
 
 	binaryname = "testinput";
 
+	if ((r = ring_init(RX_RING, PKT_RING_SLOTS, PKT_SLOT_SIZE, 
+					   NS_NOTIFY_RX, NS_NOTIFY_RX)) < 0 ||
+		(r = ring_init(TX_RING, PKT_RING_SLOTS, PKT_SLOT_SIZE, 
+					   NS_NOTIFY_RX, NS_NOTIFY_TX)) < 0)
+		panic("ring_init: %e", r);
+
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
@@ -92,19 +92,11 @@ umain(int argc, char **argv)
 	announce();
 
 	while (1) {
-		envid_t whom;
-		int perm;
-
-		int32_t req = ipc_recv((int32_t *)&whom, pkt, &perm);
-		if (req < 0)
-			panic("ipc_recv: %e", req);
-		if (whom != input_envid)
-			panic("IPC from unexpected environment %08x", whom);
-		if (req != NSREQ_INPUT)
-			panic("Unexpected IPC %d", req);
+		struct jif_pkt *pkt = ring_read_slot(RX_RING, 1);
 
 		hexdump("input: ", pkt->jp_data, pkt->jp_len);
 		cprintf("\n");
+		ring_read_done(RX_RING);
 
 		// Only indicate that we're waiting for packets once
 		// we've received the ARP reply
@@ -6,17 +6,20 @@
 
 static envid_t output_envid;
 
-static struct jif_pkt *pkt = (struct jif_pkt*)REQVA;
-
 
 void
 umain(int argc, char **argv)
 {
 	envid_t ns_envid = sys_getenvid();
+	struct jif_pkt *pkt;
 	int i, r;
 
 	binaryname = "testoutput";
 
+	if ((r = ring_init(TX_RING, PKT_RING_SLOTS, PKT_SLOT_SIZE, 
+					   NS_NOTIFY_RX, NS_NOTIFY_TX)) < 0)
+		panic("ring_init: %e", r);
+
 	output_envid = fork();
 	if (output_envid < 0)
 		panic("error forking");
@@ -30,17 +33,15 @@ umain(int argc, char **argv)
 		sys_yield();
 
 	for (i = 0; i < TESTOUTPUT_COUNT; i++) {
-		if ((r = sys_page_alloc(0, pkt, PTE_P|PTE_U|PTE_W)) < 0)
-			panic("sys_page_alloc: %e", r);
+		pkt = ring_write_slot(TX_RING, 1);
 		pkt->jp_len = snprintf(pkt->jp_data,
-				       PGSIZE - sizeof(pkt->jp_len),
+				       PKT_SLOT_SIZE - sizeof(pkt->jp_len),
 				       "Packet %02d", i);
 		cprintf("Transmitting packet %d\n", i);
-		ipc_send(output_envid, NSREQ_OUTPUT, pkt, PTE_P|PTE_W|PTE_U);
-		sys_page_unmap(0, pkt);
+		ring_write_done(TX_RING);
 	}
 
-	// Spin for a while, just in case IPC's or packets need to be flushed
+	// Spin for a while, just in case packets need to be flushed
 	for (i = 0; i < TESTOUTPUT_COUNT*2; i++)
 		sys_yield();
 }
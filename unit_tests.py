@@ -1,5 +1,5 @@
 #!/usr/bin/python2.7
-import os, subprocess, select, time
+import os, re, subprocess, select, time
 
 
 
@@ -40,9 +40,65 @@ def test_pingpong(o):
 	return all(s in o for s in 
 		[" got %d from " % i for i in range(11)])
 
+def test_pingpongs(o):
+	# each thread must see its own Env through thisenv
+	lines = re.findall(r"(\w+) got (\d+) from \w+ \(thisenv is \w+ (\w+)\)", o)
+	return set(int(n) for _, n, _ in lines) == set(range(11)) and \
+		all(me == env for me, _, env in lines)
+
 def test_myipc(o):
 	return "parent is OK" in o and "child is OK" in o
 
+def test_stresslock(o):
+	return "stresslock: OK" in o and \
+		all("stresslock: pair %d OK" % i in o for i in range(4))
+
+def test_testtimeusec(o):
+	return "testtimeusec: OK" in o
+
+def test_testsleep(o):
+	return "testsleep: OK" in o and \
+		all("testsleep: %d ms sleeper woke up" % d in o
+			for d in [100, 200, 300])
+
+def test_ipcbench(o):
+	return "ipcbench: OK" in o
+
+def test_testsendq(o):
+	return "testsendq: messages arrived in order" in o and \
+		"testsendq: OK" in o
+
+def test_testnotify(o):
+	return "testnotify: deadline OK" in o and "testnotify: OK" in o
+
+def test_testring(o):
+	return "testring: OK" in o
+
+def test_testbatch(o):
+	return "testbatch: OK" in o
+
+def test_testkfork(o):
+	return "testkfork: OK" in o
+
+def test_testcopyuser(o):
+	return "testcopyuser: OK" in o
+
+def test_testshootdown(o):
+	return "testshootdown: child faulted" in o and "testshootdown: OK" in o
+
+def test_testfutex(o):
+	return "testfutex: mutex OK" in o and "testfutex: OK" in o
+
+def test_testbcache(o):
+	return "testbcache: data OK" in o and "testbcache: OK" in o
+
+def test_testsync(o):
+	return "testsync: data OK" in o and "testsync: OK" in o
+
+def test_testsysenter(o):
+	return "testsysenter: return values OK" in o and \
+		"testsysenter: trapframe OK" in o and "testsysenter: OK" in o
+
 tests_table = [
 	
 	("myipc", test_myipc),
@@ -52,6 +108,26 @@ tests_table = [
 	("forktree", test_forktree),
 	("myfork", test_myfork),
 	("pingpong", test_pingpong),
+	("pingpongs", test_pingpongs),
+	("stresslock", test_stresslock),
+	("testtimeusec", test_testtimeusec),
+	("testsleep", test_testsleep),
+	("ipcbench", test_ipcbench),
+	("testsendq", test_testsendq),
+	("testnotify", test_testnotify),
+	("testring", test_testring),
+	("testbatch", test_testbatch),
+	("testkfork", test_testkfork),
+	("testcopyuser", test_testcopyuser),
+	("testshootdown", test_testshootdown),
+	("testfutex", test_testfutex),
+	("testbcache", test_testbcache),
+	("testsysenter", test_testsysenter),
+	("testsync", test_testsync),
+
+	# the same file system tests on the virtio disk
+	("testbcache", test_testbcache, ["VIRTIO_BLK=1"]),
+	("testsync", test_testsync, ["VIRTIO_BLK=1"]),
 
 ]
 
@@ -73,8 +149,8 @@ def green(text):
 def red(text):
 	return RED + text + NC
 
-def make_qemu_proc(progname):
-	cmd = ["make", "run-%s-nox" % progname]
+def make_qemu_proc(progname, makeargs=[]):
+	cmd = ["make"] + makeargs + ["run-%s-nox" % progname]
 	return subprocess.Popen(cmd, stdout=subprocess.PIPE,
 								 stderr=subprocess.STDOUT,
 								 stdin=subprocess.PIPE)
@@ -83,8 +159,8 @@ def has_data(f):
 	r, w, e = select.select([f], [], [], 0)
 	return f in r
 
-def run_test(progname, validate, timeout=5):
-	proc = make_qemu_proc(progname)
+def run_test(progname, validate, makeargs=[], timeout=5):
+	proc = make_qemu_proc(progname, makeargs)
 	output = ""
 	begin_time = time.time()
 	while True:
@@ -114,12 +190,17 @@ def run_tests(tests):
 	successes = 0
 	failures = 0
 	
-	for progname, validate in tests:
-		if run_test(progname, validate):
-			report_success(progname)
+	for test in tests:
+		# an optional third element holds variables for make, e.g. to
+		# boot with another disk
+		progname, validate = test[:2]
+		makeargs = test[2] if len(test) > 2 else []
+		name = " ".join([progname] + makeargs)
+		if run_test(progname, validate, makeargs):
+			report_success(name)
 			successes += 1
 		else:
-			report_failure(progname)
+			report_failure(name)
 			failures += 1
 	
 	print "---------------------"
@@ -0,0 +1,93 @@
+// IPC round-trip benchmark: a client sends a value to an echo server, which
+// sends it back incremented. We time this with the separate send and recv
+// calls, and with ipc_call/ipc_reply_recv, which need one system call per
+// side and switch directly to the other env.
+
+#include <inc/lib.h>
+
+#define ROUNDS 1000
+#define RUNS 3
+
+static void
+echo_send_recv(void)
+{
+	envid_t whom;
+	uint32_t v;
+
+	while (1) {
+		v = ipc_recv(&whom, 0, 0);
+		ipc_send(whom, v + 1, 0, 0);
+	}
+}
+
+static void
+echo_reply_recv(void)
+{
+	envid_t whom = 0;
+	uint32_t v = 0;
+
+	while (1)
+		v = ipc_reply_recv(whom, v + 1, 0, 0, &whom, 0, 0);
+}
+
+static envid_t
+start_server(void (*server)(void))
+{
+	envid_t envid;
+
+	if ((envid = fork()) < 0)
+		panic("fork: %e", envid);
+	if (envid == 0) {
+		server();
+		exit();
+	}
+	return envid;
+}
+
+// Time ROUNDS round trips to the given echo server, using ipc_call if
+// 'call', else ipc_send and ipc_recv.
+static unsigned
+bench(void (*server)(void), bool call)
+{
+	envid_t envid = start_server(server);
+	unsigned start = sys_time_usec();
+	uint32_t i, v;
+
+	for (i = 0; i < ROUNDS; i++) {
+		if (call)
+			v = ipc_call(envid, i, 0, 0, 0, 0);
+		else {
+			ipc_send(envid, i, 0, 0);
+			v = ipc_recv(0, 0, 0);
+		}
+		if (v != i + 1)
+			panic("ipcbench: sent %u, got back %u", i, v);
+	}
+	start = sys_time_usec() - start;
+	sys_env_destroy(envid);
+	return start;
+}
+
+void
+umain(int argc, char **argv)
+{
+	unsigned t_send_recv = ~0U, t_call = ~0U;
+	int i;
+
+	// the best of a few runs each, to keep noise from other envs out.
+	for (i = 0; i < RUNS; i++) {
+		t_send_recv = MIN(t_send_recv, bench(echo_send_recv, 0));
+		t_call = MIN(t_call, bench(echo_reply_recv, 1));
+	}
+
+	cprintf("ipcbench: send/recv: %u us for %d round trips\n",
+		t_send_recv, ROUNDS);
+	cprintf("ipcbench: call/reply_recv: %u us for %d round trips\n",
+		t_call, ROUNDS);
+
+	// call/reply_recv does half the system calls, and switches to the
+	// other env directly; allow some slack for timer noise all the same.
+	if (t_call > t_send_recv + t_send_recv / 10)
+		panic("ipcbench: call/reply_recv is no faster than send/recv");
+	cprintf("ipcbench: OK\n");
+}
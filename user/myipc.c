@@ -6,16 +6,10 @@
 #define PAGE ((void *) 0x40001000)
 
 void sleep(int sec) {
-	unsigned now = sys_time_msec();
-	unsigned end = now + sec * 1000;
+	int r;
 
-	if ((int)now < 0 && (int)now > -MAXERROR)
-		panic("sys_time_msec: %e", (int)now);
-	if (end < now)
-		panic("sleep: wrap");
-
-	while (sys_time_msec() < end)
-		sys_yield();
+	if ((r = sys_sleep_until(sys_time_usec() + sec * 1000000)) < 0)
+		panic("sys_sleep_until: %e", r);
 }
 
 static void child() {
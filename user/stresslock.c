@@ -0,0 +1,117 @@
+// Stress test for the kernel's fine-grained locks.
+// A tree of environments forks and hammers the page mapping syscalls,
+// while pairs of environments ping-pong IPC messages on other CPUs and
+// check that none of them get lost or reordered.
+
+#include <inc/lib.h>
+
+#define NPAIRS		4
+#define NFORKERS	4
+#define DEPTH		3
+#define NROUNDS		100
+#define NPAGES		16
+
+static void
+hammer_pages(void)
+{
+	int i, j, r;
+
+	for (i = 0; i < NROUNDS; i++) {
+		for (j = 0; j < NPAGES; j++) {
+			int *va = (int *) (UTEMP + j*PGSIZE);
+			int *alias = (int *) (UTEMP + (NPAGES + j)*PGSIZE);
+
+			if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_alloc: %e", r);
+			*va = i*NPAGES + j;
+			if ((r = sys_page_map(0, va, 0, alias, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("sys_page_map: %e", r);
+			if (*alias != i*NPAGES + j)
+				panic("alias of %08x reads %d, not %d", va, *alias, 
+					  i*NPAGES + j);
+		}
+		for (j = 0; j < 2*NPAGES; j++)
+			if ((r = sys_page_unmap(0, UTEMP + j*PGSIZE)) < 0)
+				panic("sys_page_unmap: %e", r);
+	}
+}
+
+// like user/forktree, but every node also hammers the page syscalls.
+static void
+forktree(const char *cur)
+{
+	char nxt[DEPTH+1];
+	char branch;
+
+	for (branch = '0'; branch <= '1' && strlen(cur) < DEPTH; branch++) {
+		snprintf(nxt, DEPTH+1, "%s%c", cur, branch);
+		if (fork() == 0) {
+			forktree(nxt);
+			exit();
+		}
+	}
+
+	hammer_pages();
+}
+
+static void
+pingpong(int pair)
+{
+	envid_t peer, from;
+	uint32_t expect, v;
+	bool leader;
+
+	if ((peer = fork()) < 0)
+		panic("fork: %e", peer);
+
+	leader = peer != 0;
+	if (leader) {
+		ipc_send(peer, 0, 0, 0);
+		expect = 1;
+	} else {
+		peer = thisenv->env_parent_id;
+		expect = 0;
+	}
+
+	for (; expect < 2*NROUNDS; expect += 2) {
+		v = ipc_recv(&from, 0, 0);
+		if (from != peer)
+			panic("pair %d: got a message from %08x, not %08x", 
+				  pair, from, peer);
+		if (v != expect)
+			panic("pair %d: got %d, expected %d", pair, v, expect);
+		if (v + 1 < 2*NROUNDS)
+			ipc_send(peer, v + 1, 0, 0);
+	}
+
+	if (leader) {
+		wait(peer);
+		cprintf("stresslock: pair %d OK\n", pair);
+	}
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t children[NPAIRS + NFORKERS];
+	int i;
+
+	for (i = 0; i < NFORKERS; i++) {
+		if ((children[i] = fork()) == 0) {
+			forktree("");
+			return;
+		}
+	}
+
+	for (i = 0; i < NPAIRS; i++) {
+		if ((children[NFORKERS + i] = fork()) == 0) {
+			pingpong(i);
+			return;
+		}
+	}
+
+	for (i = 0; i < NPAIRS + NFORKERS; i++)
+		wait(children[i]);
+
+	cprintf("stresslock: OK\n");
+}
@@ -0,0 +1,47 @@
+// this program checks sys_page_batch: operations are applied in order,
+// and a batch stops at the first bad operation.
+
+#include <inc/lib.h>
+
+#define A	((char *) 0x10000000)
+#define B	(A + PGSIZE)
+#define C	(A + 2*PGSIZE)
+
+void
+umain(int argc, char **argv)
+{
+	struct PageOp ops[3];
+	int r;
+
+	if ((r = sys_page_alloc(0, A, PTE_P | PTE_U | PTE_W)) < 0)
+		panic("sys_page_alloc: %e", r);
+	strcpy(A, "batched");
+
+	// move the page from A to B, and make it read-only there
+	ops[0] = (struct PageOp) { PGOP_MAP, A, B, PTE_P | PTE_U | PTE_W };
+	ops[1] = (struct PageOp) { PGOP_PROTECT, B, B, PTE_P | PTE_U };
+	ops[2] = (struct PageOp) { PGOP_UNMAP, 0, A, 0 };
+	if ((r = sys_page_batch(0, 0, ops, 3)) < 0)
+		panic("sys_page_batch: %e", r);
+
+	if (uvpt[PGNUM(A)] & PTE_P)
+		panic("testbatch: A is still mapped");
+	if (!(uvpt[PGNUM(B)] & PTE_P) || (uvpt[PGNUM(B)] & PTE_W))
+		panic("testbatch: B isn't mapped read-only");
+	if (strcmp(B, "batched") != 0)
+		panic("testbatch: B holds '%s'", B);
+
+	// the second operation would make a read-only page writable
+	ops[0] = (struct PageOp) { PGOP_MAP, B, C, PTE_P | PTE_U };
+	ops[1] = (struct PageOp) { PGOP_PROTECT, B, B, PTE_P | PTE_U | PTE_W };
+	ops[2] = (struct PageOp) { PGOP_UNMAP, 0, B, 0 };
+	if ((r = sys_page_batch(0, 0, ops, 3)) != -E_INVAL)
+		panic("sys_page_batch with a bad operation returned %e", r);
+	if (!(uvpt[PGNUM(C)] & PTE_P) || !(uvpt[PGNUM(B)] & PTE_P))
+		panic("testbatch: the operations around the bad one are wrong");
+
+	if ((r = sys_page_batch(0, 0, ops, PGOP_MAX + 1)) != -E_INVAL)
+		panic("sys_page_batch with too many operations returned %e", r);
+
+	cprintf("testbatch: OK\n");
+}
@@ -0,0 +1,71 @@
+// this program checks that the file server's block cache stays within its
+// size cap: it writes a file twice as big as the cache and reads it back,
+// which only works if blocks get written back and evicted on the way. The
+// sequential read back should also make the server read ahead.
+
+#include <inc/lib.h>
+
+#define NBLOCKS		(2 * 256)
+
+static uint32_t buf[BLKSIZE / 4], want[BLKSIZE / 4];
+
+static void
+fill(uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < BLKSIZE / 4; i++)
+		buf[i] = blockno * 4096 + i;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStats before, after;
+	int fd, i, r;
+
+	if ((r = fs_cache_stats(&before)) < 0)
+		panic("fs_cache_stats: %e", r);
+
+	if ((fd = open("/bcache-test", O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open /bcache-test: %e", fd);
+
+	for (i = 0; i < NBLOCKS; i++) {
+		fill(i);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write block %d: %e", i, r);
+	}
+
+	if ((r = seek(fd, 0)) < 0)
+		panic("seek: %e", r);
+	for (i = 0; i < NBLOCKS; i++) {
+		fill(i);
+		memcpy(want, buf, BLKSIZE);
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read block %d: %e", i, r);
+		if (memcmp(buf, want, BLKSIZE) != 0)
+			panic("testbcache: block %d read back wrong", i);
+	}
+	cprintf("testbcache: data OK\n");
+
+	if ((r = fs_cache_stats(&after)) < 0)
+		panic("fs_cache_stats: %e", r);
+	cprintf("testbcache: hits %d misses %d readahead %d evictions %d "
+		"writebacks %d\n",
+		after.bs_hits - before.bs_hits, after.bs_misses - before.bs_misses,
+		after.bs_readahead - before.bs_readahead,
+		after.bs_evictions - before.bs_evictions,
+		after.bs_writebacks - before.bs_writebacks);
+	if (after.bs_nblocks > after.bs_maxblocks)
+		panic("testbcache: %d blocks cached, cap is %d", after.bs_nblocks,
+			  after.bs_maxblocks);
+	if (after.bs_evictions == before.bs_evictions)
+		panic("testbcache: nothing was evicted");
+	if (after.bs_readahead == before.bs_readahead)
+		panic("testbcache: nothing was read ahead");
+
+	if ((r = ftruncate(fd, 0)) < 0)
+		panic("ftruncate: %e", r);
+	close(fd);
+	cprintf("testbcache: OK\n");
+}
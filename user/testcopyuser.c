@@ -0,0 +1,41 @@
+// this program checks the kernel's copies to userland: a bad buffer makes
+// the syscall fail instead of killing us, and a copy-on-write buffer gets
+// copied before the kernel writes to it.
+
+#include <inc/lib.h>
+
+struct vbe_mode_info info;
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r;
+
+	if ((r = sys_get_mode_info((void *) 0x10000000)) != -E_FAULT)
+		panic("copy to an unmapped page returned %e", r);
+	if ((r = sys_get_mode_info((void *) (ULIM - 4))) != -E_FAULT)
+		panic("copy to kernel memory returned %e", r);
+	if ((r = sys_get_mode_info((void *) UTEXT)) != -E_FAULT)
+		panic("copy to read-only text returned %e", r);
+
+	memset(&info, 0xaa, sizeof(info));
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		// 'info' is copy-on-write now.
+		if ((r = sys_get_mode_info(&info)) < 0)
+			panic("copy to a copy-on-write page returned %e", r);
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		return;
+	}
+
+	ipc_recv(0, 0, 0);
+	if (((unsigned char *) &info)[0] != 0xaa)
+		panic("testcopyuser: the child's copy reached us");
+	wait(child);
+
+	cprintf("testcopyuser: OK\n");
+}
@@ -16,8 +16,9 @@ xopen(const char *path, int mode)
 	fsenv = ipc_find_env(ENV_TYPE_FS);
 	if (!fsenv)
 		panic("FS env not found!\n");
-	ipc_send(fsenv, FSREQ_OPEN, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, FVA, NULL);
+	// the file server only replies to clients waiting in ipc_call.
+	return ipc_call(fsenv, FSREQ_OPEN, &fsipcbuf, PTE_P | PTE_W | PTE_U,
+			FVA, NULL);
 }
 
 void
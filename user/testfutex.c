@@ -0,0 +1,81 @@
+// this program checks the futex-based mutexes and condition variables:
+// threads made with sfork bump a counter under a mutex, and the main
+// thread waits on a condition variable until they are all done. It also
+// checks the errors of sys_futex_wait, and that wait() returns once a
+// child has exited.
+
+#include <inc/lib.h>
+
+#define NTHREADS	4
+#define NITER		1000
+
+struct mutex lock;
+struct cond all_done;
+uint32_t counter, ndone;
+
+static void
+worker(void)
+{
+	int i;
+
+	for (i = 0; i < NITER; i++) {
+		mutex_lock(&lock);
+		counter++;
+		// hold the lock across a yield now and then, so that the others
+		// have to sleep on it.
+		if (i % 100 == 0)
+			sys_yield();
+		mutex_unlock(&lock);
+	}
+
+	mutex_lock(&lock);
+	ndone++;
+	cond_signal(&all_done);
+	mutex_unlock(&lock);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t threads[NTHREADS], child;
+	int i, r;
+
+	for (i = 0; i < NTHREADS; i++) {
+		if ((threads[i] = sfork()) == 0) {
+			worker();
+			// exit() would close the files we share with the main thread
+			sys_env_destroy(0);
+		}
+	}
+
+	mutex_lock(&lock);
+	while (ndone < NTHREADS)
+		cond_wait(&all_done, &lock);
+	mutex_unlock(&lock);
+	if (counter != NTHREADS * NITER)
+		panic("testfutex: counter is %d, not %d", counter, 
+			  NTHREADS * NITER);
+	cprintf("testfutex: mutex OK\n");
+
+	for (i = 0; i < NTHREADS; i++)
+		wait(threads[i]);
+
+	if ((r = sys_futex_wait(&counter, counter + 1, 0)) != -E_AGAIN)
+		panic("testfutex: waiting for a stale value gave %e", r);
+	if ((r = sys_futex_wait(&counter, counter, sys_time_usec() + 20000)) != 
+		-E_TIMEOUT)
+		panic("testfutex: waiting with a deadline gave %e", r);
+	if ((r = sys_futex_wait((uint32_t *) 0x10000000, 0, 0)) != -E_FAULT)
+		panic("testfutex: waiting on unmapped memory gave %e", r);
+
+	if ((child = fork()) == 0) {
+		sys_sleep_until(sys_time_usec() + 50000);
+		exit();
+	}
+	wait(child);
+	if (envs[ENVX(child)].env_id == child && 
+		envs[ENVX(child)].env_status != ENV_FREE)
+		panic("testfutex: wait returned before the child exited");
+
+	cprintf("testfutex: OK\n");
+}
@@ -0,0 +1,54 @@
+// this program checks that fork copies pages on write inside the kernel:
+// writes of either env stay private, PTE_SHARE pages stay shared, and our
+// page fault handler is never asked about copy-on-write faults.
+
+#include <inc/lib.h>
+
+#define SHARED	((char *) 0x10000000)
+
+char buf[PGSIZE] = "parent";
+
+static void
+handler(struct UTrapframe *utf)
+{
+	panic("testkfork: unexpected fault at %08x, eip %08x", 
+		  utf->utf_fault_va, utf->utf_eip);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r;
+
+	set_pgfault_handler(handler);
+
+	if ((r = sys_page_alloc(0, SHARED, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		if (strcmp(buf, "parent") != 0)
+			panic("testkfork: child sees '%s'", buf);
+		strcpy(buf, "child");
+		strcpy(SHARED, "from child");
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		ipc_recv(0, 0, 0);
+		if (strcmp(buf, "child") != 0)
+			panic("testkfork: child's copy holds '%s'", buf);
+		return;
+	}
+
+	ipc_recv(0, 0, 0);
+	if (strcmp(buf, "parent") != 0)
+		panic("testkfork: parent's copy holds '%s'", buf);
+	if (strcmp(SHARED, "from child") != 0)
+		panic("testkfork: shared page holds '%s'", SHARED);
+	strcpy(buf, "parent again");
+	ipc_send(child, 0, 0, 0);
+	wait(child);
+
+	cprintf("testkfork: OK\n");
+}
@@ -0,0 +1,49 @@
+// this program checks notifications: bits sent to a waiting env wake it up,
+// bits sent to an env that isn't waiting stay pending and are merged, and
+// a wait with a deadline returns 0 once the deadline has passed.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), child, who;
+	uint32_t bits;
+	int r;
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		// nobody notifies us yet
+		if ((bits = sys_wait_notify(sys_time_usec() + 20000)) != 0)
+			panic("testnotify: woke up with bits 0x%x", bits);
+		ipc_send(parent, 0, 0, 0);
+
+		// the parent notifies us twice, maybe before we get to wait
+		for (bits = 0; bits != 0x5; )
+			bits |= sys_wait_notify(0);
+		ipc_send(parent, bits, 0, 0);
+		exit();
+	}
+
+	ipc_recv(&who, 0, 0);
+	cprintf("testnotify: deadline OK\n");
+
+	if ((r = sys_notify(child, 0x1)) < 0)
+		panic("sys_notify: %e", r);
+	if ((r = sys_notify(child, 0x4)) < 0)
+		panic("sys_notify: %e", r);
+	if ((r = sys_notify(child, 0)) != -E_INVAL)
+		panic("sys_notify with no bits returned %e", r);
+
+	if ((bits = ipc_recv(&who, 0, 0)) != 0x5)
+		panic("testnotify: child got bits 0x%x", bits);
+
+	// nobody is waiting, but the bits stay pending for us
+	sys_notify(parent, 0x8);
+	if ((bits = sys_wait_notify(0)) != 0x8)
+		panic("testnotify: got bits 0x%x", bits);
+
+	cprintf("testnotify: OK\n");
+}
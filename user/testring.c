@@ -0,0 +1,56 @@
+// this program pushes messages through a ring to a child and checks that
+// they all arrive, in order. The ring is much smaller than the number of
+// messages, so both sides have to wait for each other now and then.
+
+#include <inc/lib.h>
+
+#define RING	((struct ring *) 0x10000000)
+#define NSLOTS	8
+#define NMSG	10000
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), child, who;
+	uint32_t *slot, i, sum = 0;
+	int r;
+
+	if ((r = ring_init(RING, NSLOTS, 64, 0x1, 0x1)) < 0)
+		panic("ring_init: %e", r);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		for (i = 0; i < NMSG; i++) {
+			slot = ring_read_slot(RING, 1);
+			if (slot[0] != i)
+				panic("testring: got message %d, expected %d", slot[0], i);
+			sum += slot[1];
+			ring_read_done(RING);
+		}
+		ipc_send(parent, sum, 0, 0);
+		exit();
+	}
+
+	for (i = 0; i < NMSG; i++) {
+		slot = ring_write_slot(RING, 1);
+		slot[0] = i;
+		slot[1] = i * 3;
+		sum += i * 3;
+		ring_write_done(RING);
+	}
+
+	if ((r = ipc_recv(&who, 0, 0)) != sum)
+		panic("testring: child summed up %d, expected %d", r, sum);
+
+	// the child is gone, so nobody makes room for us anymore
+	for (i = 0; i < NSLOTS; i++) {
+		ring_write_slot(RING, 1);
+		ring_write_done(RING);
+	}
+	if (ring_write_slot(RING, 0))
+		panic("testring: got a slot in a full ring");
+
+	cprintf("testring: OK\n");
+}
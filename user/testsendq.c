@@ -0,0 +1,61 @@
+// this program checks that senders queue up in the kernel while the
+// receiver is busy. Several children send to us before we start receiving,
+// and each child's messages must arrive in order. Then a child sends to an
+// env that never receives and is destroyed meanwhile; its send must fail.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NMSG	50
+
+void
+umain(int argc, char **argv)
+{
+	envid_t parent = sys_getenvid(), who, victim;
+	int next[NCHILD] = { 0 };
+	int i, j, r;
+	uint32_t v;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			for (j = 0; j < NMSG; j++)
+				ipc_send(parent, (i << 16) | j, 0, 0);
+			exit();
+		}
+	}
+
+	// give the children time to block sending to us
+	sys_sleep_until(sys_time_usec() + 100000);
+
+	for (i = 0; i < NCHILD * NMSG; i++) {
+		v = ipc_recv(&who, 0, 0);
+		if ((v & 0xffff) != next[v >> 16])
+			panic("testsendq: child %d sent %d after %d",
+			      v >> 16, v & 0xffff, next[v >> 16] - 1);
+		next[v >> 16]++;
+	}
+	cprintf("testsendq: messages arrived in order\n");
+
+	if ((victim = fork()) < 0)
+		panic("fork: %e", victim);
+	if (victim == 0)
+		while (1)
+			sys_sleep_until(sys_time_usec() + 1000000);
+
+	if ((r = fork()) < 0)
+		panic("fork: %e", r);
+	if (r == 0) {
+		r = sys_ipc_send(victim, 0, 0, 0);
+		ipc_send(parent, r, 0, 0);
+		exit();
+	}
+
+	sys_sleep_until(sys_time_usec() + 50000);
+	sys_env_destroy(victim);
+	if ((r = ipc_recv(&who, 0, 0)) != -E_BAD_ENV)
+		panic("testsendq: send to a destroyed env returned %e", r);
+
+	cprintf("testsendq: OK\n");
+}
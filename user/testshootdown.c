@@ -0,0 +1,49 @@
+// this program checks that unmapping a page from an env that runs on
+// another CPU takes effect there right away: the child spins reading a
+// page until its parent unmaps it, and must then fault rather than go on
+// reading through a stale TLB entry. Run it with CPUS > 1.
+
+#include <inc/lib.h>
+
+#define PAGE	((volatile int *) 0x10000000)
+
+static void
+handler(struct UTrapframe *utf)
+{
+	if (utf->utf_fault_va != (uint32_t) PAGE)
+		panic("testshootdown: unexpected fault at %08x, eip %08x", 
+			  utf->utf_fault_va, utf->utf_eip);
+	cprintf("testshootdown: child faulted\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) PAGE, 
+				PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	*PAGE = 1;
+
+	set_pgfault_handler(handler);
+
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+
+	if (child == 0) {
+		ipc_send(thisenv->env_parent_id, 0, 0, 0);
+		while (*PAGE == 1)
+			;
+		panic("testshootdown: child read %d", *PAGE);
+	}
+
+	ipc_recv(0, 0, 0);
+	if ((r = sys_page_unmap(child, (void *) PAGE)) < 0)
+		panic("sys_page_unmap: %e", r);
+	wait(child);
+
+	cprintf("testshootdown: OK\n");
+}
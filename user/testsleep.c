@@ -0,0 +1,50 @@
+// this program checks that sys_sleep_until() blocks for as long as asked,
+// and that sleeping environments wake up in the order of their deadlines.
+
+#include <inc/lib.h>
+
+static const unsigned delays[] = { 300, 100, 200 };	// in msec
+#define NSLEEPERS (sizeof(delays) / sizeof(delays[0]))
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start, elapsed, d, prev = 0;
+	envid_t who;
+	int i, r;
+
+	start = sys_time_usec();
+	if ((r = sys_sleep_until(start + 50000)) < 0)
+		panic("sys_sleep_until: %e", r);
+	elapsed = sys_time_usec() - start;
+	if (elapsed < 50000)
+		panic("testsleep: asked for 50000 us, slept %u us", elapsed);
+
+	// a deadline that has passed doesn't block
+	if ((r = sys_sleep_until(start)) < 0)
+		panic("sys_sleep_until: %e", r);
+
+	start = sys_time_usec();
+	for (i = 0; i < NSLEEPERS; i++) {
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			sys_sleep_until(start + delays[i] * 1000);
+			ipc_send(thisenv->env_parent_id, delays[i], 0, 0);
+			return;
+		}
+	}
+
+	for (i = 0; i < NSLEEPERS; i++) {
+		d = ipc_recv(&who, 0, 0);
+		elapsed = sys_time_usec() - start;
+		if (d < prev)
+			panic("testsleep: %u ms sleeper woke after %u ms one", d, prev);
+		if (elapsed < d * 1000)
+			panic("testsleep: %u ms sleeper woke after %u us", d, elapsed);
+		cprintf("testsleep: %u ms sleeper woke up\n", d);
+		prev = d;
+	}
+
+	cprintf("testsleep: OK\n");
+}
@@ -0,0 +1,66 @@
+// this program checks that data written to a file reaches the disk: it
+// writes a file, syncs, has the file server empty its block cache as if the
+// file system had just been mounted, and reads the file back from the disk.
+
+#include <inc/lib.h>
+
+#define NBLOCKS		32
+
+static uint32_t buf[BLKSIZE / 4], want[BLKSIZE / 4];
+
+static void
+fill(uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < BLKSIZE / 4; i++)
+		buf[i] = 0x5ca1ab1e ^ (blockno * 4096 + i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStats before, after;
+	int fd, i, r;
+
+	if ((fd = open("/sync-test", O_RDWR | O_CREAT | O_TRUNC)) < 0)
+		panic("open /sync-test: %e", fd);
+	for (i = 0; i < NBLOCKS; i++) {
+		fill(i);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write block %d: %e", i, r);
+	}
+	close(fd);
+
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	if ((r = fs_drop_cache()) < 0)
+		panic("fs_drop_cache: %e", r);
+	if ((r = fs_cache_stats(&before)) < 0)
+		panic("fs_cache_stats: %e", r);
+
+	if ((fd = open("/sync-test", O_RDWR)) < 0)
+		panic("open /sync-test again: %e", fd);
+	for (i = 0; i < NBLOCKS; i++) {
+		fill(i);
+		memcpy(want, buf, BLKSIZE);
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("read block %d: %e", i, r);
+		if (memcmp(buf, want, BLKSIZE) != 0)
+			panic("testsync: block %d read back wrong", i);
+	}
+
+	if ((r = fs_cache_stats(&after)) < 0)
+		panic("fs_cache_stats: %e", r);
+	if (after.bs_misses + after.bs_readahead -
+		before.bs_misses - before.bs_readahead < NBLOCKS)
+		panic("testsync: only %d blocks came from the disk",
+			  after.bs_misses + after.bs_readahead -
+			  before.bs_misses - before.bs_readahead);
+	cprintf("testsync: data OK\n");
+
+	if ((r = ftruncate(fd, 0)) < 0)
+		panic("ftruncate: %e", r);
+	close(fd);
+	cprintf("testsync: OK\n");
+}
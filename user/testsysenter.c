@@ -0,0 +1,71 @@
+// this program checks system calls made with sysenter: their return values,
+// which registers they keep, and a system call which changes the caller's
+// own Trapframe, after which sysexit would not return where it should.
+
+#include <inc/lib.h>
+
+#define MAGIC	0x600dcafe
+
+static uint32_t stack[256];
+
+// a system call made the way lib/syscall.c makes them, which also checks
+// that ebx and edi come back unchanged. ebp and esp are checked by our
+// surviving it.
+static int32_t
+sysenter_call(int num, uint32_t a1)
+{
+	uint32_t ebx, edi;
+	int32_t ret;
+
+	asm volatile("pushl %%ebp\n"
+		     "movl %%esp, %%ebp\n"
+		     "leal 1f, %%esi\n"
+		     "sysenter\n"
+		     "1: popl %%ebp\n"
+		     : "=a" (ret), "=b" (ebx), "=D" (edi), "+d" (a1)
+		     : "a" (num), "b" (0x12345678), "D" (0x9abcdef0)
+		     : "ecx", "esi", "cc", "memory");
+
+	if (ebx != 0x12345678 || edi != 0x9abcdef0)
+		panic("testsysenter: syscall %d clobbered ebx %08x, edi %08x",
+			  num, ebx, edi);
+	return ret;
+}
+
+static void
+landed(uint32_t arg)
+{
+	if (arg != MAGIC)
+		panic("testsysenter: landed with %08x", arg);
+	cprintf("testsysenter: trapframe OK\n");
+	cprintf("testsysenter: OK\n");
+	exit();
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct Trapframe tf;
+	uint32_t edx;
+	int r;
+
+	cpuid(1, NULL, NULL, NULL, &edx);
+	if (!(edx & CPUID_SEP))
+		panic("testsysenter: this CPU has no sysenter");
+
+	if ((r = sysenter_call(SYS_getenvid, 0)) != thisenv->env_id)
+		panic("testsysenter: getenvid returned %08x, not %08x",
+			  r, thisenv->env_id);
+	if ((r = sysenter_call(SYS_env_destroy, 0xdeadbeef)) != -E_BAD_ENV)
+		panic("testsysenter: destroying a bad env returned %e", r);
+	cprintf("testsysenter: return values OK\n");
+
+	// move ourselves over to landed(MAGIC), on another stack.
+	memset(&tf, 0, sizeof(tf));
+	tf.tf_eip = (uintptr_t) landed;
+	stack[ARRAY_SIZE(stack) - 1] = MAGIC;
+	tf.tf_esp = (uintptr_t) &stack[ARRAY_SIZE(stack) - 2];
+	if ((r = sys_env_set_trapframe(0, &tf)) < 0)
+		panic("testsysenter: sys_env_set_trapframe: %e", r);
+	panic("testsysenter: sys_env_set_trapframe returned");
+}
@@ -0,0 +1,32 @@
+// this program checks that sys_time_usec() never runs backwards, even when
+// we migrate between CPUs, and that it agrees with sys_time_msec().
+
+#include <inc/lib.h>
+
+#define SPIN_MSEC 200
+
+void
+umain(int argc, char **argv)
+{
+	unsigned start_ms, start_us, prev, now, ms, us;
+
+	start_ms = sys_time_msec();
+	start_us = prev = sys_time_usec();
+
+	while (sys_time_msec() - start_ms < SPIN_MSEC) {
+		now = sys_time_usec();
+		if ((int) (now - prev) < 0)
+			panic("time went backwards: %u -> %u", prev, now);
+		prev = now;
+		sys_yield();
+	}
+
+	us = sys_time_usec() - start_us;
+	ms = sys_time_msec() - start_ms;
+	cprintf("testtimeusec: %u us in %u ms\n", us, ms);
+
+	if (us / 1000 + 2 < ms || us / 1000 > ms + 2)
+		panic("sys_time_usec and sys_time_msec disagree");
+
+	cprintf("testtimeusec: OK\n");
+}